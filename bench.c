@@ -0,0 +1,374 @@
+/*******************************************************************************************
+ *
+ *   libpartikel benchmark - Measure the simulation cost without a window.
+ *
+ *   Runs the particle systems of demo.c and scaled-up stress variants with a
+ *   fixed delta time and prints the cost per particle as JSON:
+ *
+ *   - update:   ParticleSystem_Update, per live particle and frame
+ *   - spawn:    Emitter_Burst into an empty Emitter, per spawned particle
+ *   - vertices: Emitter_BuildVertices, per generated quad
+ *
+ *   Usage: bench [frames]
+ *
+ *   libpartikel is licensed under an unmodified zlib/libpng license (View partikel.h for details)
+ *
+ ********************************************************************************************/
+
+#define _POSIX_C_SOURCE 199309L
+#define LIBPARTIKEL_IMPLEMENTATION
+
+#include "partikel.h"
+#include "raylib.h"
+#include "stdio.h"
+#include "time.h"
+
+// Fixed simulation step and the simulated seconds before measuring,
+// so every scenario reaches its steady state first.
+#define BENCH_DT     (1.0f / 120.0f)
+#define BENCH_WARMUP 3.0f
+
+#define BENCH_MAX_EMITTERS 3
+#define BENCH_MAX_FIELDS   32
+
+// Scenario is one named set of emitters run as a ParticleSystem.
+typedef struct Scenario {
+	const char *  name;
+	size_t        emitterCount;
+	EmitterConfig configs[BENCH_MAX_EMITTERS];
+	size_t        fieldCount;
+	ForceField    fields[BENCH_MAX_FIELDS];
+	float         forceGridCell; // Cell size of the force grid, 0 for none.
+} Scenario;
+
+static Texture2D texCircle16 = {.width = 16, .height = 16};
+static Texture2D texCircle8  = {.width = 8, .height = 8};
+
+// Same kill planes as in the demo.
+static const KillPlane planeBottom = {.normal = {.x = 0, .y = 1}, .distance = 400};
+static const KillPlane planeTop    = {.normal = {.x = 0, .y = -1}, .distance = 400};
+static const KillPlane planeLeft   = {.normal = {.x = -1, .y = 0}, .distance = 500};
+static const KillPlane planeRight  = {.normal = {.x = 1, .y = 0}, .distance = 500};
+
+// NowNs returns a monotonic timestamp in nanoseconds.
+static double NowNs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static Scenario Fountain(void) {
+	Scenario s = {.name = "fountain", .emitterCount = 3};
+
+	EmitterConfig ecfg1 = {
+		.capacity             = 600,
+		.emissionRate         = 200,
+		.originAcceleration   = (FloatRange){.min = 0, .max = 0},
+		.direction            = (Vector2){.x = 0, .y = -1},
+		.directionAngle       = (FloatRange){.min = -6, .max = 6},
+		.velocityAngle        = (FloatRange){.min = 0, .max = 0},
+		.velocity             = (FloatRange){.min = 700, .max = 730},
+		.externalAcceleration = (Vector2){.x = 0, .y = 981},
+		.startColor           = (Color){.r = 0, .g = 20, .b = 255, .a = 255},
+		.endColor             = (Color){.r = 0, .g = 150, .b = 100, .a = 0},
+		.age                  = (FloatRange){.min = 1.0, .max = 3.0},
+		.texture              = texCircle16,
+		.blendMode            = BLEND_ADDITIVE,
+		.seed                 = 1,
+
+		.killPlanes     = {planeBottom, planeLeft, planeRight},
+		.killPlaneCount = 3
+	};
+	s.configs[0] = ecfg1;
+
+	ecfg1.directionAngle = (FloatRange){.min = -1.5, .max = 1.5};
+	ecfg1.velocity       = (FloatRange){.min = 800, .max = 850};
+	ecfg1.texture        = texCircle8;
+	ecfg1.seed           = 2;
+	s.configs[1]         = ecfg1;
+
+	ecfg1.capacity       = 3000;
+	ecfg1.emissionRate   = 1000;
+	ecfg1.directionAngle = (FloatRange){.min = -20, .max = 20};
+	ecfg1.velocity       = (FloatRange){.min = 500, .max = 550};
+	ecfg1.texture        = texCircle16;
+	ecfg1.age            = (FloatRange){.min = 0.0, .max = 3.0};
+	ecfg1.seed           = 3;
+	s.configs[2]         = ecfg1;
+
+	return s;
+}
+
+static Scenario Swirl(void) {
+	Scenario s = {.name = "swirl", .emitterCount = 3};
+
+	EmitterConfig ecfg = {
+		.capacity           = 2500,
+		.emissionRate       = 500,
+		.originAcceleration = (FloatRange){.min = 400, .max = 500},
+		.offset             = (FloatRange){.min = 30, .max = 40},
+		.direction          = (Vector2){.x = 0, .y = -1},
+		.directionAngle     = (FloatRange){.min = -180, .max = 180},
+		.velocityAngle      = (FloatRange){.min = 90, .max = 90},
+		.velocity           = (FloatRange){.min = 200, .max = 500},
+		.startColor         = (Color){.r = 244, .g = 20, .b = 0, .a = 255},
+		.endColor           = (Color){.r = 244, .g = 20, .b = 0, .a = 0},
+		.age                = (FloatRange){.min = 2.5, .max = 5.0},
+		.texture            = texCircle8,
+		.blendMode          = BLEND_ADDITIVE,
+		.seed               = 4,
+
+		.killPlanes     = {planeTop},
+		.killPlaneCount = 1
+	};
+	s.configs[0] = ecfg;
+
+	ecfg.capacity     = 1000;
+	ecfg.emissionRate = 200;
+	ecfg.offset       = (FloatRange){.min = 40, .max = 50};
+	ecfg.seed         = 5;
+	s.configs[1]      = ecfg;
+
+	ecfg.capacity     = 150;
+	ecfg.emissionRate = 30;
+	ecfg.offset       = (FloatRange){.min = 20, .max = 30};
+	ecfg.velocity     = (FloatRange){.min = 100, .max = 200};
+	ecfg.seed         = 6;
+	s.configs[2]      = ecfg;
+
+	return s;
+}
+
+static Scenario Flame(void) {
+	Scenario s = {.name = "flame", .emitterCount = 3};
+
+	EmitterConfig ecfg = {
+		.capacity           = 1000,
+		.emissionRate       = 500,
+		.originAcceleration = (FloatRange){.min = 50, .max = 100},
+		.offset             = (FloatRange){.min = 0, .max = 10},
+		.direction          = (Vector2){.x = 0, .y = -1},
+		.directionAngle     = (FloatRange){.min = -90, .max = -90},
+		.velocityAngle      = (FloatRange){.min = 90, .max = 90},
+		.velocity           = (FloatRange){.min = 30, .max = 150},
+		.startColor         = (Color){.r = 255, .g = 20, .b = 0, .a = 255},
+		.endColor           = (Color){.r = 255, .g = 20, .b = 0, .a = 0},
+		.age                = (FloatRange){.min = 1.0, .max = 2.0},
+		.texture            = texCircle16,
+		.blendMode          = BLEND_ADDITIVE,
+		.seed               = 7,
+
+		.killPlanes     = {planeBottom, planeLeft, planeRight},
+		.killPlaneCount = 3
+	};
+	s.configs[0] = ecfg;
+
+	ecfg.capacity     = 20;
+	ecfg.emissionRate = 20;
+	ecfg.startColor   = (Color){.r = 255, .g = 255, .b = 255, .a = 255};
+	ecfg.endColor     = (Color){.r = 255, .g = 255, .b = 255, .a = 0};
+	ecfg.age          = (FloatRange){.min = 0.5, .max = 1.0};
+	ecfg.seed         = 8;
+	s.configs[1]      = ecfg;
+
+	ecfg.capacity           = 500;
+	ecfg.emissionRate       = 100;
+	ecfg.directionAngle     = (FloatRange){.min = -3, .max = 3};
+	ecfg.velocityAngle      = (FloatRange){.min = 0, .max = 0};
+	ecfg.originAcceleration = (FloatRange){.min = 0, .max = 0};
+	ecfg.startColor         = (Color){.r = 125, .g = 125, .b = 125, .a = 30};
+	ecfg.endColor           = (Color){.r = 125, .g = 125, .b = 125, .a = 10};
+	ecfg.age                = (FloatRange){.min = 3.0, .max = 5.0};
+	ecfg.seed               = 9;
+	s.configs[2]            = ecfg;
+
+	return s;
+}
+
+// Stress is the large fountain emitter scaled to the given capacity.
+// The emission rate keeps it saturated most of the time.
+static Scenario Stress(const char * name, size_t capacity) {
+	Scenario s     = Fountain();
+	s.name         = name;
+	s.emitterCount = 1;
+	s.configs[0]   = s.configs[2];
+
+	s.configs[0].capacity     = capacity;
+	s.configs[0].emissionRate = capacity;
+	return s;
+}
+
+// Analytic renames a scenario and switches all its emitters to analytic mode.
+static Scenario Analytic(Scenario s, const char * name) {
+	s.name = name;
+	for (size_t i = 0; i < s.emitterCount; i++) {
+		s.configs[i].analytic = true;
+	}
+	return s;
+}
+
+// Quantized renames a scenario and makes all its emitters store half
+// float ttls and, in analytic mode, velocities.
+static Scenario Quantized(Scenario s, const char * name) {
+	s.name = name;
+	for (size_t i = 0; i < s.emitterCount; i++) {
+		s.configs[i].quantize = true;
+	}
+	return s;
+}
+
+// Attractors renames a scenario and adds a ring of BENCH_MAX_FIELDS
+// alternating point and vortex fields acting on all its emitters,
+// sampled into a force grid with the given cell size if it is > 0.
+static Scenario Attractors(Scenario s, const char * name, float gridCell) {
+	s.name          = name;
+	s.fieldCount    = BENCH_MAX_FIELDS;
+	s.forceGridCell = gridCell;
+	for (size_t i = 0; i < s.emitterCount; i++) {
+		s.configs[i].forceLayers = PARTIKEL_ALL_LAYERS;
+	}
+	for (size_t i = 0; i < BENCH_MAX_FIELDS; i++) {
+		float angle = (float)i * 2 * PI / BENCH_MAX_FIELDS;
+		s.fields[i] = (ForceField){
+			.type     = i % 2 ? FORCE_VORTEX : FORCE_POINT,
+			.layers   = PARTIKEL_ALL_LAYERS,
+			.strength = i % 4 ? 400 : -300,
+			.position = (Vector2){.x = 250 * cosf(angle), .y = -200 + 150 * sinf(angle)},
+			.radius   = 200,
+			.falloff  = FALLOFF_LINEAR,
+		};
+	}
+	return s;
+}
+
+// Run measures one scenario and prints its JSON object.
+// Returns false if the scenario could not be set up.
+static bool Run(Scenario s, int frames, bool first) {
+	ParticleSystem * ps = ParticleSystem_New();
+	Emitter *        emitters[BENCH_MAX_EMITTERS] = {NULL};
+	size_t           capacity = 0;
+	bool             ok       = ps != NULL;
+
+	for (size_t i = 0; ok && i < s.emitterCount; i++) {
+		emitters[i] = Emitter_New(s.configs[i]);
+		ok          = emitters[i] != NULL && ParticleSystem_Register(ps, emitters[i]);
+		capacity += s.configs[i].capacity;
+	}
+	for (size_t i = 0; ok && i < s.fieldCount; i++) {
+		ok = ParticleSystem_AddForceField(ps, s.fields[i]);
+	}
+	if (ok && s.forceGridCell > 0) {
+		// The area inside the kill planes.
+		ok = ParticleSystem_SetForceGrid(
+			ps, (Rectangle){.x = -500, .y = -400, .width = 1000, .height = 800}, s.forceGridCell);
+	}
+
+	ParticleVertex * vertices = ok ? PARTIKEL_ALLOC(4 * capacity, sizeof(ParticleVertex)) : NULL;
+	if (!ok || vertices == NULL) {
+		// The system releases its Emitters, so it goes first.
+		if (ps != NULL) {
+			ParticleSystem_Free(ps);
+		}
+		for (size_t i = 0; i < s.emitterCount; i++) {
+			if (emitters[i] != NULL) {
+				Emitter_Free(emitters[i]);
+			}
+		}
+		return false;
+	}
+
+	ParticleSystem_Start(ps);
+	for (float t = 0; t < BENCH_WARMUP; t += BENCH_DT) {
+		ParticleSystem_Update(ps, BENCH_DT);
+	}
+
+	// Update.
+	double        updateNs  = 0;
+	double        vertexNs  = 0;
+	unsigned long updated   = 0;
+	unsigned long generated = 0;
+	for (int f = 0; f < frames; f++) {
+		double start = NowNs();
+		updated += ParticleSystem_Update(ps, BENCH_DT);
+		updateNs += NowNs() - start;
+
+		// Vertex generation.
+		start = NowNs();
+		size_t offset = 0;
+		for (size_t i = 0; i < s.emitterCount; i++) {
+			offset += Emitter_BuildVertices(emitters[i], vertices + 4 * offset, emitters[i]->config.capacity);
+		}
+		vertexNs += NowNs() - start;
+		generated += offset;
+	}
+
+	// Spawn: fill every Emitter from empty with one burst.
+	ParticleSystem_Stop(ps);
+	double        spawnNs = 0;
+	unsigned long spawned = 0;
+	for (int f = 0; f < frames / 10 + 1; f++) {
+		for (size_t i = 0; i < s.emitterCount; i++) {
+			Emitter * e      = emitters[i];
+			int       amount = (int)e->config.capacity;
+			e->config.burst  = (IntRange){.min = amount, .max = amount};
+			Emitter_Clear(e);
+
+			double start = NowNs();
+			Emitter_Burst(e);
+			spawnNs += NowNs() - start;
+			spawned += e->length;
+		}
+	}
+
+	printf("%s\n    {\"name\": \"%s\", \"emitters\": %zu, \"capacity\": %zu, "
+	       "\"avg_particles\": %.1f, \"update_ns_per_particle\": %.3f, "
+	       "\"spawn_ns_per_particle\": %.3f, \"vertices_ns_per_particle\": %.3f}",
+	       first ? "" : ",", s.name, s.emitterCount, capacity, (double)updated / frames,
+	       updated ? updateNs / (double)updated : 0.0, spawned ? spawnNs / (double)spawned : 0.0,
+	       generated ? vertexNs / (double)generated : 0.0);
+
+	PARTIKEL_FREE(vertices);
+	ParticleSystem_Free(ps);
+	for (size_t i = 0; i < s.emitterCount; i++) {
+		Emitter_Free(emitters[i]);
+	}
+	return true;
+}
+
+int main(int argc, char * argv[argc + 1]) {
+	int frames = 240;
+	if (argc > 1) {
+		frames = atoi(argv[1]);
+	}
+	if (frames <= 0) {
+		fprintf(stderr, "usage: %s [frames]\n", argv[0]);
+		return 1;
+	}
+
+	Scenario scenarios[] = {
+		Fountain(),
+		Swirl(),
+		Flame(),
+		Stress("stress-10k", 10000),
+		Stress("stress-100k", 100000),
+		Stress("stress-1m", 1000000),
+		Analytic(Stress("stress-1m", 1000000), "stress-1m-analytic"),
+		Quantized(Analytic(Stress("stress-1m", 1000000), "stress-1m-analytic"), "stress-1m-analytic-quantized"),
+		Attractors(Stress("stress-100k", 100000), "attractors-100k", 0),
+		Attractors(Stress("stress-100k", 100000), "attractors-100k-grid", 8),
+	};
+
+	printf("{\n  \"dt\": %f,\n  \"frames\": %d,\n  \"scenarios\": [", BENCH_DT, frames);
+	size_t printed = 0;
+	size_t count   = sizeof(scenarios) / sizeof(scenarios[0]);
+	for (size_t i = 0; i < count; i++) {
+		if (Run(scenarios[i], frames, printed == 0)) {
+			printed++;
+		} else {
+			fprintf(stderr, "OUT OF MEMORY in scenario %s\n", scenarios[i].name);
+		}
+	}
+	printf("\n  ]\n}\n");
+
+	return printed == count ? 0 : 1;
+}
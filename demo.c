@@ -47,16 +47,22 @@ static Emitter *        emitterFlame1 = NULL;
 static Emitter *        emitterFlame2 = NULL;
 static Emitter *        emitterFlame3 = NULL;
 
-// Define a custom particle deactivator function.
-bool Particle_DeactivatorFountain(Particle * p) {
-	return (p->position.y > (camera.target.y + camera.offset.y)    // bottom
-	        || p->position.x < (camera.target.x - camera.offset.x) // left
-	        || p->position.x > (camera.target.x + camera.offset.x) // right
-	        || Particle_DeactivatorAge(p));
+// Kill planes at the screen edges. Particles crossing them are deactivated.
+// The camera does not move, so they are set up once.
+KillPlane KillPlaneBottom() {
+	return (KillPlane){.normal = (Vector2){.x = 0, .y = 1}, .distance = camera.target.y + camera.offset.y};
 }
 
-bool Particle_DeactivatorOutsideCam(Particle * p) {
-	return (p->position.y < (camera.target.y - camera.offset.y) || Particle_DeactivatorAge(p));
+KillPlane KillPlaneTop() {
+	return (KillPlane){.normal = (Vector2){.x = 0, .y = -1}, .distance = -(camera.target.y - camera.offset.y)};
+}
+
+KillPlane KillPlaneLeft() {
+	return (KillPlane){.normal = (Vector2){.x = -1, .y = 0}, .distance = -(camera.target.x - camera.offset.x)};
+}
+
+KillPlane KillPlaneRight() {
+	return (KillPlane){.normal = (Vector2){.x = 1, .y = 0}, .distance = camera.target.x + camera.offset.x};
 }
 
 void OOMExit() {
@@ -85,8 +91,11 @@ void InitFountain() {
 		.age                  = (FloatRange){.min = 1.0, .max = 3.0},
 		.texture              = texCircle16,
 		.blendMode            = BLEND_ADDITIVE,
+		.analytic             = true, // pure ballistic motion, no per-frame integration
 
-		.particle_Deactivator = Particle_DeactivatorFountain
+		// Deactivate particles leaving the screen at the bottom, left or right.
+		.killPlanes     = {KillPlaneBottom(), KillPlaneLeft(), KillPlaneRight()},
+		.killPlaneCount = 3
     };
 	emitterFountain1 = Emitter_New(ecfg1);
 	if (emitterFountain1 == NULL) {
@@ -115,6 +124,8 @@ void InitFountain() {
 	}
 	ParticleSystem_Register(ps1, emitterFountain3);
 
+	// Pack the textures, so the three emitters are drawn in one batch.
+	ParticleSystem_BuildAtlas(ps1);
 	ParticleSystem_Start(ps1);
 }
 
@@ -140,7 +151,9 @@ void InitSwirl() {
 		.texture            = texCircle8,
 		.blendMode          = BLEND_ADDITIVE,
 
-		.particle_Deactivator = Particle_DeactivatorOutsideCam
+		// Deactivate particles leaving the screen at the top.
+		.killPlanes     = {KillPlaneTop()},
+		.killPlaneCount = 1
     };
 
 	emitterSwirl1 = Emitter_New(ecfg);
@@ -174,6 +187,7 @@ void InitSwirl() {
 	}
 	ParticleSystem_Register(ps2, emitterSwirl3);
 
+	ParticleSystem_BuildAtlas(ps2);
 	ParticleSystem_Start(ps2);
 }
 
@@ -199,7 +213,9 @@ void InitFlame() {
 		.texture            = texCircle16,
 		.blendMode          = BLEND_ADDITIVE,
 
-		.particle_Deactivator = Particle_DeactivatorFountain
+		// Deactivate particles leaving the screen at the bottom, left or right.
+		.killPlanes     = {KillPlaneBottom(), KillPlaneLeft(), KillPlaneRight()},
+		.killPlaneCount = 3
     };
 
 	emitterFlame1 = Emitter_New(ecfg);
@@ -228,6 +244,9 @@ void InitFlame() {
 	ecfg.startColor         = (Color){.r = 125, .g = 125, .b = 125, .a = 30};
 	ecfg.endColor           = (Color){.r = 125, .g = 125, .b = 125, .a = 10};
 	ecfg.age                = (FloatRange){.min = 3.0, .max = 5.0};
+	// Alpha blended smoke has to be drawn oldest first to composite right.
+	ecfg.blendMode          = BLEND_ALPHA;
+	ecfg.sortMode           = PARTICLE_SORT_OLDEST_FIRST;
 
 	emitterFlame3 = Emitter_New(ecfg);
 	if (emitterFlame3 == NULL) {
@@ -235,31 +254,32 @@ void InitFlame() {
 	}
 	ParticleSystem_Register(ps3, emitterFlame3);
 
+	ParticleSystem_BuildAtlas(ps3);
 	ParticleSystem_Start(ps3);
 }
 
 void DestroyFountain() {
+	ParticleSystem_Free(ps1);
+
 	Emitter_Free(emitterFountain1);
 	Emitter_Free(emitterFountain2);
 	Emitter_Free(emitterFountain3);
-
-	ParticleSystem_Free(ps1);
 }
 
 void DestroySwirl() {
+	ParticleSystem_Free(ps2);
+
 	Emitter_Free(emitterSwirl1);
 	Emitter_Free(emitterSwirl2);
 	Emitter_Free(emitterSwirl3);
-
-	ParticleSystem_Free(ps2);
 }
 
 void DestroyFlame() {
+	ParticleSystem_Free(ps3);
+
 	Emitter_Free(emitterFlame1);
 	Emitter_Free(emitterFlame2);
 	Emitter_Free(emitterFlame3);
-
-	ParticleSystem_Free(ps3);
 }
 
 // Init sets up all relevant data.
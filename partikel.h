@@ -12,7 +12,7 @@
  *       - Supports all platforms that raylib supports
  *
  *   DEPENDENCIES:
- *       raylib >= v2.5.0 and all of its dependencies
+ *       raylib >= v4.0.0 (including rlgl) and all of its dependencies
  *
  *   CONFIGURATION:
  *   #define LIBPARTIKEL_IMPLEMENTATION
@@ -21,6 +21,22 @@
  *in other headers or source files without problems. But only ONE file should
  *hold the implementation.
  *
+ *   #define PARTIKEL_NO_SIMD
+ *       Disables the SSE2/AVX2/AVX-512 update kernels. By default the best
+ *kernel supported by the running CPU is picked at runtime on x86 with GCC
+ *or Clang. Every other target uses the portable scalar kernel.
+ *
+ *   #define PARTIKEL_THREADS
+ *       Enables ParticleSystem_SetThreads, which updates a ParticleSystem
+ *on a small internal pthread pool, and ParticleSystem_SetPipelined, which
+ *overlaps its updates with drawing. Link with -pthread when defining it.
+ *
+ *   #define PARTIKEL_STATS
+ *       Enables the counters and timings returned by Emitter_GetStats and
+ *ParticleSystem_GetStats and the trace export. Without it the update loops
+ *contain no stats code at all. Define _POSIX_C_SOURCE >= 199309L before
+ *including, so the timings use the monotonic clock instead of clock().
+ *
  *   LICENSE: zlib/libpng
  *
  *   libpartikel is licensed under an unmodified zlib/libpng license, which is
@@ -53,6 +69,7 @@
 #pragma once
 
 #include "raylib.h"
+#include "stdint.h"
 
 /**  TODOs
  *
@@ -77,10 +94,86 @@
 	#define PARTIKEL_FREE(p) free(p)
 #endif
 
+// Amount of particles stepped as one job by the parallel update.
+// Must be a multiple of 16, so jobs split on SIMD vector boundaries.
+#ifndef PARTIKEL_CHUNK_SIZE
+	#define PARTIKEL_CHUNK_SIZE 1024
+#endif
+
+// Maximum amount of kill planes of one EmitterConfig.
+#ifndef PARTIKEL_MAX_KILL_PLANES
+	#define PARTIKEL_MAX_KILL_PLANES 4
+#endif
+
+// Maximum amount of stops of each over-lifetime curve of an EmitterConfig.
+#ifndef PARTIKEL_MAX_CURVE_STOPS
+	#define PARTIKEL_MAX_CURVE_STOPS 8
+#endif
+
+// Resolution of the lookup tables the curves are baked into.
+#ifndef PARTIKEL_LUT_SIZE
+	#define PARTIKEL_LUT_SIZE 256
+#endif
+
+// Smallest storage of an Emitter with autoCapacity in particles.
+#ifndef PARTIKEL_AUTO_MIN_CAPACITY
+	#define PARTIKEL_AUTO_MIN_CAPACITY 64
+#endif
+
+// Seconds over which an Emitter with autoCapacity tracks its peak amount of
+// particles before it may shrink its storage.
+#ifndef PARTIKEL_AUTO_WINDOW
+	#define PARTIKEL_AUTO_WINDOW 2.0f
+#endif
+
+// Most fixed steps one ParticleSystem_Update runs. Time beyond that is
+// dropped, so slow frames do not make the following ones even slower.
+#ifndef PARTIKEL_MAX_FIXED_STEPS
+	#define PARTIKEL_MAX_FIXED_STEPS 4
+#endif
+
+// Alignment in bytes of every particle array owned by an Emitter.
+// Must be a power of two. 64 matches a cache line on most hardware.
+#ifndef PARTIKEL_ALIGNMENT
+	#define PARTIKEL_ALIGNMENT 64
+#endif
+
+// Largest width and height in pixels of the texture atlas of a
+// ParticleSystem (see ParticleSystem_BuildAtlas).
+#ifndef PARTIKEL_ATLAS_MAX_SIZE
+	#define PARTIKEL_ATLAS_MAX_SIZE 2048
+#endif
+
+// Width in pixels of the cells of the grids that find the colliders near
+// a particle and the particles in an area.
+#ifndef PARTIKEL_GRID_CELL_SIZE
+	#define PARTIKEL_GRID_CELL_SIZE 64.0f
+#endif
+
+// Most cells of one grid. Grids over larger areas use wider cells.
+#ifndef PARTIKEL_GRID_MAX_CELLS
+	#define PARTIKEL_GRID_MAX_CELLS 65536
+#endif
+
+// Clock of the stats in nanoseconds (see PARTIKEL_STATS).
+#ifndef PARTIKEL_CLOCK_NS
+	#define PARTIKEL_CLOCK_NS() partikel_clockNs()
+#endif
+
 // Needed forward declarations.
 //----------------------------------------------------------------------------------
+typedef struct RandomStream RandomStream;
 typedef struct Particle Particle;
+typedef struct ParticleData ParticleData;
+typedef struct ParticleVertex ParticleVertex;
+typedef struct ParticleSpan ParticleSpan;
 typedef struct EmitterConfig EmitterConfig;
+typedef struct Collider Collider;
+typedef struct ParticleRef ParticleRef;
+typedef struct ParticleColliders ParticleColliders;
+typedef struct ForceField ForceField;
+typedef struct ParticleForces ParticleForces;
+typedef struct ParticleStats ParticleStats;
 typedef struct Emitter Emitter;
 typedef struct ParticleSystem ParticleSystem;
 
@@ -91,6 +184,13 @@ Vector2 NormalizeV2(Vector2 v);
 Vector2 RotateV2(Vector2 v, float degrees);
 Color LinearFade(Color c1, Color c2, float fraction);
 
+void RandomStream_Seed(RandomStream *r, uint64_t seed);
+uint32_t RandomStream_Next(RandomStream *r);
+float RandomStream_Float(RandomStream *r, float min, float max);
+int RandomStream_Int(RandomStream *r, int min, int max);
+void RandomStream_Fill(RandomStream *r, float *out, size_t n, float min,
+                       float max);
+
 bool Particle_DeactivatorAge(Particle *p);
 Particle *Particle_New(bool (*deactivatorFunc)(struct Particle *));
 void Particle_Free(Particle *p);
@@ -101,10 +201,22 @@ Emitter *Emitter_New(EmitterConfig cfg);
 bool Emitter_Reinit(Emitter *e, EmitterConfig cfg);
 void Emitter_Start(Emitter *e);
 void Emitter_Stop(Emitter *e);
+void Emitter_Clear(Emitter *e);
 void Emitter_Free(Emitter *e);
+void Emitter_Seed(Emitter *e, uint64_t seed);
 void Emitter_Burst(Emitter *e);
+size_t Emitter_SpawnN(Emitter *e, size_t n);
 unsigned long Emitter_Update(Emitter *e, float dt);
+unsigned long Emitter_Prewarm(Emitter *e, float seconds);
+size_t Emitter_BuildVertices(const Emitter *e, ParticleVertex *vertices,
+                             size_t maxParticles);
 void Emitter_Draw(Emitter *e);
+Rectangle Emitter_GetBounds(Emitter *e);
+ParticleStats Emitter_GetStats(const Emitter *e);
+void Emitter_ResetStats(Emitter *e);
+size_t Emitter_SnapshotSize(const Emitter *e);
+size_t Emitter_Snapshot(const Emitter *e, void *buffer, size_t size);
+bool Emitter_Restore(Emitter *e, const void *snapshot, size_t size);
 
 ParticleSystem *ParticleSystem_New(void);
 bool ParticleSystem_Register(ParticleSystem *ps, Emitter *emitter);
@@ -114,13 +226,82 @@ void ParticleSystem_Start(ParticleSystem *ps);
 void ParticleSystem_Stop(ParticleSystem *ps);
 void ParticleSystem_Burst(ParticleSystem *ps);
 void ParticleSystem_Draw(ParticleSystem *ps);
+bool ParticleSystem_BuildAtlas(ParticleSystem *ps);
+void ParticleSystem_FreeAtlas(ParticleSystem *ps);
 unsigned long ParticleSystem_Update(ParticleSystem *ps, float dt);
+void ParticleSystem_UpdateAsync(ParticleSystem *ps, float dt);
+unsigned long ParticleSystem_Sync(ParticleSystem *ps);
+unsigned long ParticleSystem_Prewarm(ParticleSystem *ps, float seconds);
+bool ParticleSystem_SetThreads(ParticleSystem *ps, unsigned int threads);
+bool ParticleSystem_SetPipelined(ParticleSystem *ps, bool pipelined);
+bool ParticleSystem_SetPool(ParticleSystem *ps, size_t budget);
+void ParticleSystem_SetFixedRate(ParticleSystem *ps, float stepsPerSecond);
+void ParticleSystem_SetView(ParticleSystem *ps, Rectangle view);
+void ParticleSystem_SetCamera(ParticleSystem *ps, Camera2D camera, int width,
+                              int height);
+void ParticleSystem_SetOffscreenInterval(ParticleSystem *ps,
+                                         unsigned int interval);
+bool ParticleSystem_AddCollider(ParticleSystem *ps, Collider collider);
+void ParticleSystem_ClearColliders(ParticleSystem *ps);
+size_t ParticleSystem_QueryRect(ParticleSystem *ps, Rectangle rect,
+                                ParticleRef *results, size_t maxResults);
+size_t ParticleSystem_QueryCircle(ParticleSystem *ps, Vector2 center,
+                                  float radius, ParticleRef *results,
+                                  size_t maxResults);
+bool ParticleSystem_AddForceField(ParticleSystem *ps, ForceField field);
+bool ParticleSystem_SetForceField(ParticleSystem *ps, size_t index,
+                                  ForceField field);
+void ParticleSystem_ClearForceFields(ParticleSystem *ps);
+bool ParticleSystem_SetForceGrid(ParticleSystem *ps, Rectangle area,
+                                 float cellSize);
+ParticleStats ParticleSystem_GetStats(const ParticleSystem *ps);
+void ParticleSystem_ResetStats(ParticleSystem *ps);
+bool ParticleSystem_StartTrace(ParticleSystem *ps, size_t maxEvents);
+bool ParticleSystem_ExportTrace(const ParticleSystem *ps,
+                                const char *fileName);
+void ParticleSystem_StopTrace(ParticleSystem *ps);
+size_t ParticleSystem_SnapshotSize(ParticleSystem *ps);
+size_t ParticleSystem_Snapshot(ParticleSystem *ps, void *buffer, size_t size);
+bool ParticleSystem_Restore(ParticleSystem *ps, const void *snapshot,
+                            size_t size);
 void ParticleSystem_Free(ParticleSystem *p);
 
 #ifdef LIBPARTIKEL_IMPLEMENTATION
 
+#include "float.h"
 #include "math.h"
+#include "rlgl.h"
 #include "stdlib.h"
+#include "string.h"
+
+#ifdef PARTIKEL_THREADS
+#include "pthread.h"
+#endif
+
+// PARTIKEL_STAT(...) compiles its statements only with PARTIKEL_STATS.
+#ifdef PARTIKEL_STATS
+#include "stdio.h"
+#include "time.h"
+#define PARTIKEL_STAT(...) __VA_ARGS__
+#else
+#define PARTIKEL_STAT(...)
+#endif
+
+#if !defined(PARTIKEL_NO_SIMD) && (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define PARTIKEL_X86_SIMD
+#include "immintrin.h"
+#define PARTIKEL_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+// PARTIKEL_INLINE forces inlining of small helpers called per particle.
+#if defined(__GNUC__) || defined(__clang__)
+#define PARTIKEL_INLINE static inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define PARTIKEL_INLINE static __forceinline
+#else
+#define PARTIKEL_INLINE static inline
+#endif
 
 // Utility functions & structs.
 //----------------------------------------------------------------------------------
@@ -137,7 +318,7 @@ Vector2 NormalizeV2(Vector2 v) {
   if (v.x == 0 && v.y == 0) {
     return v;
   }
-  float len = sqrt(v.x * v.x + v.y * v.y);
+  float len = sqrtf(v.x * v.x + v.y * v.y);
   return (Vector2){.x = v.x / len, .y = v.y / len};
 }
 
@@ -165,6 +346,97 @@ Color LinearFade(Color c1, Color c2, float fraction) {
   return c;
 }
 
+// RandomStream is a small, fast and seedable xoshiro128+ generator.
+// Every Emitter owns one, so emitters neither share global state nor
+// depend on libc rand(). The same seed always yields the same sequence.
+struct RandomStream {
+  uint32_t s[4];
+};
+
+// RandomStream_Seed (re)initializes the stream from a 64 bit seed.
+// The seed is expanded with splitmix64, so any value (even 0) is fine.
+void RandomStream_Seed(RandomStream *r, uint64_t seed) {
+  for (int i = 0; i < 4; i++) {
+    uint64_t z = (seed += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    r->s[i] = (uint32_t)((z ^ (z >> 31)) >> 32);
+  }
+}
+
+// RandomStream_Next returns the next 32 random bits.
+uint32_t RandomStream_Next(RandomStream *r) {
+  uint32_t *s = r->s;
+  uint32_t result = s[0] + s[3];
+  uint32_t t = s[1] << 9;
+
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = (s[3] << 11) | (s[3] >> 21);
+
+  return result;
+}
+
+// RandomStream_Float returns a random float between min and max.
+float RandomStream_Float(RandomStream *r, float min, float max) {
+  // The upper 24 bits are the best ones of xoshiro128+ and fit a float
+  // mantissa exactly.
+  float n = (float)(RandomStream_Next(r) >> 8) * (1.0f / 16777216.0f);
+  return n * (max - min) + min;
+}
+
+// RandomStream_Int returns a random int between min and max (inclusive).
+int RandomStream_Int(RandomStream *r, int min, int max) {
+  if (min > max) {
+    int tmp = min;
+    min = max;
+    max = tmp;
+  }
+  uint64_t range = (uint64_t)((int64_t)max - (int64_t)min) + 1;
+  return (int)((int64_t)min +
+               (int64_t)(((uint64_t)RandomStream_Next(r) * range) >> 32));
+}
+
+// RandomStream_Fill writes n random floats between min and max to out.
+// It yields the same values as n calls to RandomStream_Float.
+void RandomStream_Fill(RandomStream *r, float *out, size_t n, float min,
+                       float max) {
+  // Work on a local copy, so the state stays in registers.
+  RandomStream local = *r;
+  float range = max - min;
+  for (size_t i = 0; i < n; i++) {
+    float f = (float)(RandomStream_Next(&local) >> 8) * (1.0f / 16777216.0f);
+    out[i] = f * range + min;
+  }
+  *r = local;
+}
+
+#ifdef PARTIKEL_STATS
+// partikel_clockNs returns a monotonic timestamp in nanoseconds, or the
+// processor time if the monotonic clock is not available.
+static uint64_t partikel_clockNs(void) {
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#else
+  return (uint64_t)((double)clock() * (1e9 / CLOCKS_PER_SEC));
+#endif
+}
+#endif
+
+// partikel_randomFloat draws from r or, if r is NULL, from raylib's
+// global generator via GetRandomFloat.
+static float partikel_randomFloat(RandomStream *r, float min, float max) {
+  if (r == NULL) {
+    return GetRandomFloat(min, max);
+  }
+  return RandomStream_Float(r, min, max);
+}
+
 // Min/Max pair structs for various types.
 typedef struct FloatRange {
   float min;
@@ -176,8 +448,76 @@ typedef struct IntRange {
   int max;
 } IntRange;
 
+// KillPlane is a half-plane: all points p with
+// normal.x * p.x + normal.y * p.y > distance lie outside of it.
+typedef struct KillPlane {
+  Vector2 normal;
+  float distance;
+} KillPlane;
+
+// ColorStop is a color at a point of the particle lifetime, where time 0
+// is the spawn and time 1 the end of the ttl.
+typedef struct ColorStop {
+  float time;
+  Color color;
+} ColorStop;
+
+// FloatStop is a value at a point of the particle lifetime (see ColorStop).
+typedef struct FloatStop {
+  float time;
+  float value;
+} FloatStop;
+
+// ParticleSortMode is the order Emitter_Draw draws the particles of an
+// Emitter in. Later particles cover earlier ones, which matters for
+// BLEND_ALPHA but not for BLEND_ADDITIVE.
+typedef enum ParticleSortMode {
+  PARTICLE_SORT_NONE,         // Storage order, the fastest.
+  PARTICLE_SORT_OLDEST_FIRST, // Spawn order, the newest particles on top.
+  PARTICLE_SORT_NEWEST_FIRST, // The oldest particles on top.
+  PARTICLE_SORT_KEY,          // Ascending by the keys of sortKeys.
+} ParticleSortMode;
+
+// ParticleStats describe an Emitter or a ParticleSystem. The counters add
+// up since creation or the last reset and need PARTIKEL_STATS. Without it
+// only length, capacity and backlog are set.
+struct ParticleStats {
+  size_t length;        // Live particles.
+  size_t capacity;      // Particles fitting into the current storage.
+  size_t peakLength;    // Most live particles after an update.
+  float backlog;        // Emissions due but not spawned yet.
+  uint64_t spawned;     // Particles spawned.
+  uint64_t deactivated; // Particles removed by their ttl or kill rules.
+  uint64_t dropped;     // Particles of bursts and Emitter_SpawnN lost for
+                        // lack of room.
+  uint64_t saturated;   // Updates whose emissions did not all fit. The rest
+                        // stays in the backlog.
+  uint64_t updates;     // Updates run.
+  uint64_t updateNs;    // Nanoseconds spent in updates. For threaded
+                        // updates it is the sum over all threads.
+  uint64_t draws;       // Draw calls run.
+  uint64_t drawNs;      // Nanoseconds spent drawing.
+};
+
+// ParticleSpan is a view of consecutive live particles handed to batch
+// deactivator functions. Setting dead[i] to a non-zero value deactivates
+// particle i of the span.
+struct ParticleSpan {
+  size_t length;
+  const float *posX;
+  const float *posY;
+  const float *velX;
+  const float *velY;
+  const float *age;
+  const float *ttl;
+  unsigned char *dead;
+};
+
 // EmitterConfig type.
 //----------------------------------------------------------------------------------
+
+// EmitterConfig describes an Emitter. The Emitter derives its update kernel
+// from it, so change the config of an existing Emitter via Emitter_Reinit.
 struct EmitterConfig {
   Vector2 direction;         // Direction vector will be normalized.
   FloatRange velocity;       // The possible range of the particle velocities.
@@ -191,18 +531,86 @@ struct EmitterConfig {
                                  // (centrifugal) the origin.
   IntRange burst;                // The range of sudden particle bursts.
   size_t capacity;               // Maximum amounts of particles in the system.
+  size_t reserve; // Slots guaranteed to the Emitter by the particle pool of
+                  // a ParticleSystem (see ParticleSystem_SetPool).
+  bool autoCapacity; // Start small and grow and shrink the storage with the
+                     // demand, up to capacity. Live particles are kept.
+  bool analytic; // Store only the spawn state and evaluate positions in
+                 // closed form when needed. Used if originAcceleration is
+                 // 0 and neither particle_Deactivator nor
+                 // particle_DeactivatorBatch is set.
+  bool quantize; // Store ttls and, in analytic mode, velocities as half
+                 // floats to save memory. Both are off by a relative
+                 // error of at most 2^-11, so a 3 s ttl by 1.5 ms and an
+                 // analytic position by 2^-11 * velocity * age, 0.3 pixels
+                 // for 200 pixels/s after 3 s. Velocities are clamped to
+                 // +-65504 pixels/s. Fixed step Emitters keep their
+                 // velocities as floats, small accelerations would vanish.
+  bool collide; // Bounce off the colliders of the ParticleSystem the
+                // Emitter is registered to. Disables analytic mode.
+  uint32_t forceLayers; // Bit mask of the force field layers of the
+                        // ParticleSystem acting on the Emitter. 0 ignores
+                        // all fields, non-zero disables analytic mode.
+  unsigned int offscreenInterval; // Outside the view of its ParticleSystem
+                                  // the Emitter is updated only every k-th
+                                  // update. 0 uses the interval of the
+                                  // system, 1 always updates.
   size_t emissionRate;           // Rate of emitted particles per second.
   Vector2 origin;                // Origin is the source of the emitter.
   Vector2 externalAcceleration; // External constant acceleration. e.g. gravity.
   Color startColor;    // The color the particle starts with when it spawns.
   Color endColor;      // The color the particle ends with when it disappears.
+
+  // Optional over-lifetime curves. Stops must be sorted by time and are
+  // interpolated linearly. They are baked into lookup tables by Emitter_New
+  // and Emitter_Reinit, so their cost does not depend on the stop count.
+  ColorStop colorCurve[PARTIKEL_MAX_CURVE_STOPS]; // Replaces start and end
+                                                  // color if used.
+  size_t colorCurveLength;
+  FloatStop alphaCurve[PARTIKEL_MAX_CURVE_STOPS]; // Alpha from 0 to 1,
+                                                  // replaces color alpha.
+  size_t alphaCurveLength;
+  FloatStop sizeCurve[PARTIKEL_MAX_CURVE_STOPS]; // Scale of the texture.
+                                                 // 1 if not used.
+  size_t sizeCurveLength;
+  FloatStop rotationCurve[PARTIKEL_MAX_CURVE_STOPS]; // Rotation in degrees.
+                                                     // 0 if not used.
+  size_t rotationCurveLength;
+
   FloatRange age;      // Age range of particles in seconds.
   BlendMode blendMode; // Color blending mode for all particles of this Emitter.
+  ParticleSortMode sortMode; // Draw order of the particles.
+  // Writes a key per particle of the span to keys for PARTICLE_SORT_KEY,
+  // for example a depth. Lower keys are drawn first. sortData is passed
+  // through. Disables analytic mode, so the span holds current positions.
+  void (*sortKeys)(const ParticleSpan *span, float *keys, void *sortData);
+  void *sortData;
   Texture2D texture;   // The texture used as particle texture.
+  uint64_t seed;       // Seed of the random stream of the Emitter.
+                       // 0 draws a seed from raylib's GetRandomValue.
+
+  // Declarative deactivation rules. They are evaluated for all particles
+  // of the Emitter at once, which is much faster than a function call per
+  // particle. A particle dies if it is older than its ttl or any rule
+  // matches.
+  Rectangle killBounds; // Particles outside are deactivated.
+                        // Unused if width or height is <= 0.
+  KillPlane killPlanes[PARTIKEL_MAX_KILL_PLANES]; // Particles outside of
+                                                  // any plane are deactivated.
+  size_t killPlaneCount; // Amount of used killPlanes.
+
+  // Optional function for custom rules. It is called with spans of
+  // particles and may flag them as dead. With threads enabled (see
+  // ParticleSystem_SetThreads) it is called concurrently for different
+  // spans. deactivatorData is passed through.
+  void (*particle_DeactivatorBatch)(ParticleSpan *span, void *deactivatorData);
+  void *deactivatorData;
 
   bool (*particle_Deactivator)(
       struct Particle *); // Pointer to a function that determines when
-                          // a particle is deactivated.
+                          // a particle is deactivated. Replaces the ttl
+                          // check. Prefer the rules above, it is called
+                          // once per particle.
 };
 
 // Particle type.
@@ -254,44 +662,52 @@ Particle *Particle_New(bool (*deactivatorFunc)(struct Particle *)) {
 // Particle_free frees all memory used by the Particle.
 void Particle_Free(Particle *p) { PARTIKEL_FREE(p); }
 
-// Particle_Init inits a particle. It is then ready to be updated and drawn.
-void Particle_Init(Particle *p, EmitterConfig *cfg) {
+// Particle_initWith inits a particle drawing all random values from r.
+static void Particle_initWith(Particle *p, EmitterConfig *cfg,
+                              RandomStream *r) {
   p->age = 0;
   p->origin = cfg->origin;
 
   // Get a random angle to find an random velocity.
   float randa =
-      GetRandomFloat(cfg->directionAngle.min, cfg->directionAngle.max);
+      partikel_randomFloat(r, cfg->directionAngle.min, cfg->directionAngle.max);
 
   // Rotate base direction with the given angle.
   Vector2 res = RotateV2(cfg->direction, randa);
 
   // Get a random value for velocity range (direction is normalized).
-  float randv = GetRandomFloat(cfg->velocity.min, cfg->velocity.max);
+  float randv = partikel_randomFloat(r, cfg->velocity.min, cfg->velocity.max);
 
   // Multiply direction with factor to set actual velocity in the Particle.
   p->velocity = (Vector2){.x = res.x * randv, .y = res.y * randv};
 
   // Get a random angle to rotate the velocity vector.
-  randa = GetRandomFloat(cfg->velocityAngle.min, cfg->velocityAngle.max);
+  randa =
+      partikel_randomFloat(r, cfg->velocityAngle.min, cfg->velocityAngle.max);
 
   // Rotate velocity vector with given angle.
   p->velocity = RotateV2(p->velocity, randa);
 
   // Get a random value for origin offset and apply it to position.
-  float rando = GetRandomFloat(cfg->offset.min, cfg->offset.max);
+  float rando = partikel_randomFloat(r, cfg->offset.min, cfg->offset.max);
   p->position.x = cfg->origin.x + res.x * rando;
   p->position.y = cfg->origin.y + res.y * rando;
 
   // Get a random value for the intrinsic particle acceleration
-  float rands =
-      GetRandomFloat(cfg->originAcceleration.min, cfg->originAcceleration.max);
+  float rands = partikel_randomFloat(r, cfg->originAcceleration.min,
+                                     cfg->originAcceleration.max);
   p->originAcceleration = rands;
   p->externalAcceleration = cfg->externalAcceleration;
-  p->ttl = GetRandomFloat(cfg->age.min, cfg->age.max);
+  p->ttl = partikel_randomFloat(r, cfg->age.min, cfg->age.max);
   p->active = true;
 }
 
+// Particle_Init inits a particle. It is then ready to be updated and drawn.
+// Random values are drawn from raylib's global generator.
+void Particle_Init(Particle *p, EmitterConfig *cfg) {
+  Particle_initWith(p, cfg, NULL);
+}
+
 // Particle_update updates all properties according to the delta time (in
 // seconds). Deactivates the particle if the deactivator function returns true.
 void Particle_Update(Particle *p, float dt) {
@@ -322,293 +738,5096 @@ void Particle_Update(Particle *p, float dt) {
   p->position.y += p->velocity.y * dt;
 }
 
-// Emitter type.
+// ParticleData type.
 //----------------------------------------------------------------------------------
 
-// Emitter is a single (point) source emitting many particles.
-struct Emitter {
-  EmitterConfig config;
-  float mustEmit; // Amount of particles to be emitted within next update call.
-  Vector2 offset; // Offset holds half the width and height of the texture.
-  bool isEmitting;
-  Particle **particles; // Array of all particles (by pointer).
-};
-
-// Emitter_New creates a new Emitter object.
-Emitter *Emitter_New(EmitterConfig cfg) {
-  Emitter *e = PARTIKEL_ALLOC(1, sizeof(Emitter));
-  if (e == NULL) {
-    return NULL;
-  }
-  e->config = cfg;
-  e->offset.x = e->config.texture.width / 2;
-  e->offset.y = e->config.texture.height / 2;
-  e->particles = PARTIKEL_ALLOC(e->config.capacity, sizeof(Particle *));
-  if (e->particles == NULL) {
-    PARTIKEL_FREE(e);
-    return NULL;
-  }
-  e->mustEmit = 0;
-  // Normalize direction for future uses.
-  e->config.direction = NormalizeV2(e->config.direction);
+// Layout bits of ParticleData. Besides positions, spawn time and flags an
+// Emitter only stores the arrays its config needs (see Emitter_layout),
+// the others are NULL.
+#define PARTIKEL_LAYOUT_PULL 0x01u  // Origins and origin accelerations.
+#define PARTIKEL_LAYOUT_PREV 0x02u  // Positions before the last fixed step.
+#define PARTIKEL_LAYOUT_VEL32 0x04u // Velocities as floats.
+#define PARTIKEL_LAYOUT_VEL16 0x08u // Velocities as half floats.
+#define PARTIKEL_LAYOUT_TTL32 0x10u // Ttls as floats.
+#define PARTIKEL_LAYOUT_TTL16 0x20u // Ttls as half floats.
+#define PARTIKEL_LAYOUT_ALL 0x3Fu
 
-  for (size_t i = 0; i < e->config.capacity; i++) {
-    e->particles[i] = Particle_New(e->config.particle_Deactivator);
-  }
+// PARTIKEL_PARTICLE_FIELDS lists every per-particle array an Emitter may
+// store as (type, name, layout bit) triples. Arrays with bit 0 are always
+// stored. All code moving particles around is generated from this list,
+// so a new field only has to be added here. The age is not stored, it is
+// the clock of the Emitter minus born.
+#define PARTIKEL_PARTICLE_FIELDS(FIELD)                                        \
+  FIELD(float, posX, 0)                                                        \
+  FIELD(float, posY, 0)                                                        \
+  FIELD(float, prevX, PARTIKEL_LAYOUT_PREV)                                    \
+  FIELD(float, prevY, PARTIKEL_LAYOUT_PREV)                                    \
+  FIELD(float, velX, PARTIKEL_LAYOUT_VEL32)                                    \
+  FIELD(float, velY, PARTIKEL_LAYOUT_VEL32)                                    \
+  FIELD(uint16_t, halfVelX, PARTIKEL_LAYOUT_VEL16)                             \
+  FIELD(uint16_t, halfVelY, PARTIKEL_LAYOUT_VEL16)                             \
+  FIELD(float, originX, PARTIKEL_LAYOUT_PULL)                                  \
+  FIELD(float, originY, PARTIKEL_LAYOUT_PULL)                                  \
+  FIELD(float, originAcceleration, PARTIKEL_LAYOUT_PULL)                       \
+  FIELD(float, born, 0)                                                        \
+  FIELD(float, ttl, PARTIKEL_LAYOUT_TTL32)                                     \
+  FIELD(uint16_t, halfTtl, PARTIKEL_LAYOUT_TTL16)                              \
+  FIELD(unsigned char, dead, 0)
 
-  return e;
-}
+// PARTIKEL_HAS_FIELD returns whether layout stores the arrays of bit.
+#define PARTIKEL_HAS_FIELD(layout, bit) ((bit) == 0 || ((layout) & (bit)) != 0)
 
-// Emitter_Reinit reinits the given Emitter with a new EmitterConfig.
-bool Emitter_Reinit(Emitter *e, EmitterConfig cfg) {
-  if (cfg.capacity > e->config.capacity) {
-    // Array needs to be grown to the new size.
-    Particle **newParticles =
-        realloc(e->particles, cfg.capacity * sizeof(Particle *));
-    if (newParticles == NULL) {
-      return false;
-    }
-    e->particles = newParticles;
+// ParticleData holds all particles of an Emitter as a structure of arrays.
+// Every array has the same length (the capacity) and starts on a
+// PARTIKEL_ALIGNMENT boundary, so update and draw stream through memory
+// linearly instead of chasing one pointer per particle.
+struct ParticleData {
+#define PARTIKEL_FIELD_DECLARE(type, name, bit) type *name;
+  PARTIKEL_PARTICLE_FIELDS(PARTIKEL_FIELD_DECLARE)
+#undef PARTIKEL_FIELD_DECLARE
+  size_t capacity;     // Length of every array.
+  unsigned int layout; // PARTIKEL_LAYOUT_* bits of the stored arrays.
+  void *block;         // The single allocation backing all arrays.
+};
 
-    // Create new Particles
-    for (size_t i = e->config.capacity; i < cfg.capacity; i++) {
-      e->particles[i] = Particle_New(cfg.particle_Deactivator);
-    }
-  } else if (cfg.capacity < e->config.capacity) {
-    // First we free the now obsolete Particles.
-    for (size_t i = cfg.capacity; i < e->config.capacity; i++) {
-      Particle_Free(e->particles[i]);
-    }
+// partikel_alignUp rounds n up to the next multiple of PARTIKEL_ALIGNMENT.
+static size_t partikel_alignUp(size_t n) {
+  return (n + PARTIKEL_ALIGNMENT - 1) & ~(size_t)(PARTIKEL_ALIGNMENT - 1);
+}
 
-    // Array needs to be shrunk to the new size.
-    Particle **newParticles =
-        realloc(e->particles, cfg.capacity * sizeof(Particle *));
-    if (newParticles == NULL) {
-      return false;
-    }
-    e->particles = newParticles;
+// ParticleData_size returns the amount of bytes needed to store capacity
+// particles with the given layout including the padding between the
+// arrays.
+static size_t ParticleData_size(size_t capacity, unsigned int layout) {
+  size_t size = 0;
+#define PARTIKEL_FIELD_SIZE(type, name, bit)                                   \
+  if (PARTIKEL_HAS_FIELD(layout, bit)) {                                       \
+    size += partikel_alignUp(capacity * sizeof(type));                         \
   }
+  PARTIKEL_PARTICLE_FIELDS(PARTIKEL_FIELD_SIZE)
+#undef PARTIKEL_FIELD_SIZE
+  return size;
+}
 
-  // Set new config.
-  e->config = cfg;
+// ParticleData_bind lays the arrays for capacity particles out in the
+// ParticleData_size(capacity, layout) bytes at base. d owns no memory
+// afterwards.
+static void ParticleData_bind(ParticleData *d, unsigned char *base,
+                              size_t capacity, unsigned int layout) {
+  d->capacity = capacity;
+  d->layout = layout;
+  d->block = NULL;
+#define PARTIKEL_FIELD_BIND(type, name, bit)                                   \
+  d->name = NULL;                                                              \
+  if (PARTIKEL_HAS_FIELD(layout, bit)) {                                       \
+    d->name = (type *)base;                                                    \
+    base += partikel_alignUp(capacity * sizeof(type));                         \
+  }
+  PARTIKEL_PARTICLE_FIELDS(PARTIKEL_FIELD_BIND)
+#undef PARTIKEL_FIELD_BIND
+}
 
-  // Set new Particle deactivator function for all Particles.
-  for (size_t i = 0; i < e->config.capacity; i++) {
-    e->particles[i]->particle_Deactivator = e->config.particle_Deactivator;
+// ParticleData_alloc allocates zeroed storage for capacity particles with
+// the given layout. Returns false if there is not enough memory.
+static bool ParticleData_alloc(ParticleData *d, size_t capacity,
+                               unsigned int layout) {
+  size_t size = ParticleData_size(capacity, layout);
+  // Over-allocate to be able to align the start of the block and to
+  // remember the original pointer right in front of it.
+  unsigned char *raw =
+      PARTIKEL_ALLOC(1, size + PARTIKEL_ALIGNMENT + sizeof(void *));
+  if (raw == NULL) {
+    return false;
   }
+  uintptr_t start = (uintptr_t)(raw + sizeof(void *));
+  unsigned char *base = (unsigned char *)((start + PARTIKEL_ALIGNMENT - 1) &
+                                          ~(uintptr_t)(PARTIKEL_ALIGNMENT - 1));
+  ((void **)base)[-1] = raw;
 
+  ParticleData_bind(d, base, capacity, layout);
+  d->block = base;
   return true;
 }
 
-// Emitter_Start activates Particle emission.
-void Emitter_Start(Emitter *e) { e->isEmitting = true; }
+// ParticleData_free frees the storage allocated by ParticleData_alloc.
+static void ParticleData_free(ParticleData *d) {
+  if (d->block != NULL) {
+    PARTIKEL_FREE(((void **)d->block)[-1]);
+  }
+  *d = (ParticleData){0};
+}
 
-// Emitter_Start deactivates Particle emission.
-void Emitter_Stop(Emitter *e) { e->isEmitting = false; }
+// ParticleData_view makes view refer to capacity particles of d starting at
+// offset. It only has the arrays of layout, which d must store. The view
+// owns no memory.
+static void ParticleData_view(ParticleData *view, const ParticleData *d,
+                              size_t offset, size_t capacity,
+                              unsigned int layout) {
+#define PARTIKEL_FIELD_VIEW(type, name, bit)                                   \
+  view->name = PARTIKEL_HAS_FIELD(layout, bit) ? d->name + offset : NULL;
+  PARTIKEL_PARTICLE_FIELDS(PARTIKEL_FIELD_VIEW)
+#undef PARTIKEL_FIELD_VIEW
+  view->capacity = capacity;
+  view->layout = layout;
+  view->block = NULL;
+}
 
-// Emitter_Free frees all allocated resources.
-void Emitter_Free(Emitter *e) {
-  for (size_t i = 0; i < e->config.capacity; i++) {
-    Particle_Free(e->particles[i]);
+// ParticleData_copy copies n particles from src (starting at srcIndex) to
+// dst (starting at dstIndex). Only the arrays stored by both are copied,
+// see ParticleData_convert for different layouts. The ranges may overlap.
+static void ParticleData_copy(ParticleData *dst, size_t dstIndex,
+                              const ParticleData *src, size_t srcIndex,
+                              size_t n) {
+#define PARTIKEL_FIELD_COPY(type, name, bit)                                   \
+  if (dst->name != NULL && src->name != NULL) {                                \
+    memmove(dst->name + dstIndex, src->name + srcIndex, n * sizeof(type));     \
   }
-  free(e->particles);
-  PARTIKEL_FREE(e);
+  PARTIKEL_PARTICLE_FIELDS(PARTIKEL_FIELD_COPY)
+#undef PARTIKEL_FIELD_COPY
 }
 
-// Emitter_Burst emits a specified amount of particles at once,
-// ignoring the state of e->isEmitting. Use this for singular events
-// instead of continuous output.
-void Emitter_Burst(Emitter *e) {
-  Particle *p = NULL;
-  size_t emitted = 0;
+// partikel_toHalf rounds f to the nearest IEEE 754 half float. Values
+// beyond its range (and NaN) become the largest finite half, 65504, with
+// the sign of f. Without branches loops of it vectorize.
+PARTIKEL_INLINE uint16_t partikel_toHalf(float f) {
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  uint32_t sign = (bits >> 16) & 0x8000u;
+  // Positive floats order like their bits. 0x477FE000 is 65504. The
+  // masks select without branches.
+  bits &= 0x7FFFFFFFu;
+  uint32_t over = 0u - (uint32_t)(bits > 0x477FE000u);
+  bits = (bits & ~over) | (0x477FE000u & over);
+  // Normal halves: round the 13 dropped mantissa bits to nearest even and
+  // rebias the exponent from 127 to 15. A carry correctly bumps the
+  // exponent.
+  uint32_t normal =
+      (bits + 0x0FFFu + ((bits >> 13) & 1u) - ((127u - 15u) << 23)) >> 13;
+  // Subnormal halves are multiples of 2^-24, the ulp of floats in [0.5, 1),
+  // so adding 0.5 rounds them into the low mantissa bits.
+  float a;
+  memcpy(&a, &bits, sizeof(a));
+  a += 0.5f;
+  uint32_t subnormal;
+  memcpy(&subnormal, &a, sizeof(subnormal));
+  subnormal -= 0x3F000000u;
+  // 0x38800000 is 2^-14, the smallest normal half.
+  uint32_t tiny = 0u - (uint32_t)(bits < 0x38800000u);
+  return (uint16_t)(sign | (subnormal & tiny) | (normal & ~tiny));
+}
 
-  int amount = GetRandomValue(e->config.burst.min, e->config.burst.max);
+// partikel_fromHalf returns the float value of the half float h.
+PARTIKEL_INLINE float partikel_fromHalf(uint16_t h) {
+  // Shifting sign, exponent and mantissa into place and scaling by
+  // 2^(127 - 15) rebiases the exponent and handles subnormal halves alike.
+  // Without branches loops of it vectorize.
+  uint32_t bits = ((uint32_t)(h & 0x8000u) << 16) |
+                  ((uint32_t)(h & 0x7FFFu) << 13);
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f * 0x1p112f;
+}
 
-  for (size_t i = 0; i < e->config.capacity; i++) {
-    p = e->particles[i];
-    if (!p->active) {
-      Particle_Init(p, &e->config);
-      p->position = e->config.origin;
-      emitted++;
+// ParticleData_convert copies n particles from src (starting at srcIndex)
+// to dst (starting at dstIndex), which may have a different layout.
+// Velocities and ttls are converted between floats and half floats,
+// missing previous positions start at the positions and missing origins at
+// origin without acceleration. The ranges must not overlap.
+static void ParticleData_convert(ParticleData *dst, size_t dstIndex,
+                                 const ParticleData *src, size_t srcIndex,
+                                 size_t n, Vector2 origin) {
+  ParticleData_copy(dst, dstIndex, src, srcIndex, n);
+  for (size_t k = 0; k < n; k++) {
+    size_t i = dstIndex + k;
+    size_t j = srcIndex + k;
+    if (dst->prevX != NULL && src->prevX == NULL) {
+      dst->prevX[i] = src->posX[j];
+      dst->prevY[i] = src->posY[j];
     }
-    if (emitted >= amount) {
-      return;
+    if (dst->velX != NULL && src->velX == NULL) {
+      dst->velX[i] = partikel_fromHalf(src->halfVelX[j]);
+      dst->velY[i] = partikel_fromHalf(src->halfVelY[j]);
+    }
+    if (dst->halfVelX != NULL && src->halfVelX == NULL) {
+      dst->halfVelX[i] = partikel_toHalf(src->velX[j]);
+      dst->halfVelY[i] = partikel_toHalf(src->velY[j]);
+    }
+    if (dst->originX != NULL && src->originX == NULL) {
+      dst->originX[i] = origin.x;
+      dst->originY[i] = origin.y;
+      dst->originAcceleration[i] = 0;
+    }
+    if (dst->ttl != NULL && src->ttl == NULL) {
+      dst->ttl[i] = partikel_fromHalf(src->halfTtl[j]);
+    }
+    if (dst->halfTtl != NULL && src->halfTtl == NULL) {
+      dst->halfTtl[i] = partikel_toHalf(src->ttl[j]);
     }
   }
 }
 
-// Emitter_Update updates all particles and returns
-// the current amount of active particles.
-unsigned long Emitter_Update(Emitter *e, float dt) {
-  size_t emitNow = 0;
-  Particle *p = NULL;
-  unsigned long counter = 0;
+// ParticleVertex type.
+//----------------------------------------------------------------------------------
 
-  if (e->isEmitting) {
-    e->mustEmit += dt * (float)e->config.emissionRate;
-    emitNow = (size_t)e->mustEmit; // floor
-  }
+// ParticleVertex is one corner of a particle quad as submitted to rlgl.
+// Emitter_BuildVertices writes 4 of them per particle in the order
+// top-left, bottom-left, bottom-right, top-right.
+struct ParticleVertex {
+  float x, y; // Position in world space.
+  float u, v; // Texture coordinates.
+  Color color;
+};
 
-  for (size_t i = 0; i < e->config.capacity; i++) {
-    p = e->particles[i];
-    if (p->active) {
-      Particle_Update(p, dt);
-      counter++;
-    } else if (e->isEmitting && emitNow > 0) {
-      // emit new particles here
-      Particle_Init(p, &e->config);
-      Particle_Update(p, dt);
-      emitNow--;
-      e->mustEmit--;
-      counter++;
-    }
-  }
+// Maximum amount of quads handed to rlgl between two batch limit checks.
+#define PARTIKEL_QUAD_CHUNK 1024
 
-  return counter;
-}
+// partikel_submitQuads draws quads built by Emitter_BuildVertices with the
+// given texture. All quads end up in rlgl's current render batch, so they
+// are flushed with as few draw calls as the batch size allows.
+static void partikel_submitQuads(Texture2D texture,
+                                 const ParticleVertex *vertices,
+                                 size_t quads) {
+  rlSetTexture(texture.id);
+  for (size_t q = 0; q < quads; q += PARTIKEL_QUAD_CHUNK) {
+    size_t n = quads - q;
+    if (n > PARTIKEL_QUAD_CHUNK) {
+      n = PARTIKEL_QUAD_CHUNK;
+    }
+    // Flushes the batch first if the chunk would not fit.
+    rlCheckRenderBatchLimit((int)(4 * n));
 
-// Emitter_Draw draws all active particles.
-void Emitter_Draw(Emitter *e) {
-  BeginBlendMode(e->config.blendMode);
-  for (size_t i = 0; i < e->config.capacity; i++) {
-    Particle *p = e->particles[i];
-    if (p->active) {
-      DrawTexture(e->config.texture, e->particles[i]->position.x - e->offset.x,
-                  e->particles[i]->position.y - e->offset.y,
-                  LinearFade(e->config.startColor, e->config.endColor,
-                             p->age / p->ttl));
+    rlBegin(RL_QUADS);
+    rlNormal3f(0.0f, 0.0f, 1.0f);
+    const ParticleVertex *v = vertices + 4 * q;
+    for (size_t i = 0; i < 4 * n; i++) {
+      rlColor4ub(v[i].color.r, v[i].color.g, v[i].color.b, v[i].color.a);
+      rlTexCoord2f(v[i].u, v[i].v);
+      rlVertex2f(v[i].x, v[i].y);
     }
+    rlEnd();
   }
-  EndBlendMode();
+  rlSetTexture(0);
 }
 
-// ParticleSystem type.
+// Integration kernels.
 //----------------------------------------------------------------------------------
 
-// ParticleSystem is a set of emitters grouped logically
-// together to achieve a specific visual effect.
-// While Emitters can be used independently, ParticleSystem
-// offers some convenience for handling many Emitters at once.
-struct ParticleSystem {
-  bool active;
-  size_t length;
-  size_t capacity;
-  Vector2 origin;
-  Emitter **emitters;
-};
+// ParticleIntegrator advances velocity and position of the particles in
+// [begin, end) by dt. Each particle is accelerated towards its origin by its
+// origin acceleration and by the constant external acceleration.
+typedef void (*ParticleIntegrator)(ParticleData *d, size_t begin, size_t end,
+                                   Vector2 externalAcceleration, float dt);
 
-// Particlesystem_New creates a new particle system
-// with the given amount of emitters.
-ParticleSystem *ParticleSystem_New(void) {
-  ParticleSystem *ps = PARTIKEL_ALLOC(1, sizeof(ParticleSystem));
-  if (ps == NULL) {
-    return NULL;
-  }
-  ps->active = false;
-  ps->length = 0;
-  ps->capacity = 1;
-  ps->origin = (Vector2){.x = 0, .y = 0};
-  ps->emitters = PARTIKEL_ALLOC(ps->capacity, sizeof(Emitter *));
-  if (ps->emitters == NULL) {
-    PARTIKEL_FREE(ps);
-    return NULL;
+// Every kernel below is written once with two compile time switches and
+// instantiated for each combination, so terms that a config zeroes cost
+// nothing:
+//   pull:    apply the origin acceleration.
+//   gravity: apply the external acceleration.
+
+// PARTIKEL_INTEGRATOR_VARIANTS defines the four instances of kernel with the
+// given function attributes as <kernel>Ballistic, <kernel>Gravity,
+// <kernel>Pull and <kernel>Full.
+#define PARTIKEL_INTEGRATOR_VARIANT(attr, kernel, variant, pull, gravity)      \
+  attr static void kernel##variant(ParticleData *d, size_t begin, size_t end,  \
+                                   Vector2 externalAcceleration, float dt) {   \
+    kernel(d, begin, end, externalAcceleration, dt, pull, gravity);            \
   }
-  return ps;
-}
+#define PARTIKEL_INTEGRATOR_VARIANTS(attr, kernel)                             \
+  PARTIKEL_INTEGRATOR_VARIANT(attr, kernel, Ballistic, false, false)           \
+  PARTIKEL_INTEGRATOR_VARIANT(attr, kernel, Gravity, false, true)              \
+  PARTIKEL_INTEGRATOR_VARIANT(attr, kernel, Pull, true, false)                 \
+  PARTIKEL_INTEGRATOR_VARIANT(attr, kernel, Full, true, true)
 
-// ParticleSystem_Register registers an emitter to the system.
-// The emitter will be controlled by all particle system functions.
-// Returns true on success and false otherwise.
-bool ParticleSystem_Register(ParticleSystem *ps, Emitter *emitter) {
-  // If there is no space for another emitter we have to realloc.
-  if (ps->length >= ps->capacity) {
-    // Double capacity.
-    Emitter **newEmitters =
-        realloc(ps->emitters, 2 * ps->capacity * sizeof(Emitter *));
-    if (newEmitters == NULL) {
-      return false;
+// partikel_integrateScalar is the portable kernel. It is also used by the
+// SIMD kernels for the particles that do not fill a whole vector.
+PARTIKEL_INLINE void partikel_integrateScalar(ParticleData *d, size_t begin,
+                                              size_t end,
+                                              Vector2 externalAcceleration,
+                                              float dt, bool pull,
+                                              bool gravity) {
+  for (size_t i = begin; i < end; i++) {
+    if (pull) {
+      float dx = d->originX[i] - d->posX[i];
+      float dy = d->originY[i] - d->posY[i];
+      float len2 = dx * dx + dy * dy;
+      // Same as NormalizeV2: a particle sitting on its origin is not pulled.
+      float s = len2 > 0 ? d->originAcceleration[i] / sqrtf(len2) : 0;
+      float ax = gravity ? dx * s + externalAcceleration.x : dx * s;
+      float ay = gravity ? dy * s + externalAcceleration.y : dy * s;
+      d->velX[i] += ax * dt;
+      d->velY[i] += ay * dt;
+    } else if (gravity) {
+      d->velX[i] += externalAcceleration.x * dt;
+      d->velY[i] += externalAcceleration.y * dt;
     }
-    ps->emitters = newEmitters;
-    ps->capacity *= 2;
+    d->posX[i] += d->velX[i] * dt;
+    d->posY[i] += d->velY[i] * dt;
   }
+}
+PARTIKEL_INTEGRATOR_VARIANTS(, partikel_integrateScalar)
 
-  // Now the new Emitter can be registered.
-  ps->emitters[ps->length] = emitter;
-  ps->length++;
+#ifdef PARTIKEL_X86_SIMD
 
-  return true;
-}
+// The SIMD kernels compute 1/|toOrigin| with the hardware reciprocal square
+// root estimate refined by one Newton-Raphson step (~22 bits of precision).
 
-// ParticleSystem_Deregister deregisters an Emitter by its pointer.
-// Returns true on success and false otherwise.
-bool ParticleSystem_Deregister(ParticleSystem *ps, Emitter *emitter) {
-  for (size_t i = 0; i < ps->length; i++) {
-    if (ps->emitters[i] == emitter) {
-      // Remove this emitter by replacing its pointer with the
-      // last pointer, if it is not the only Emitter.
-      if (i != ps->length - 1) {
-        ps->emitters[i] = ps->emitters[ps->length - 1];
+// partikel_integrateSSE2 processes 4 particles per iteration.
+PARTIKEL_TARGET("sse2")
+PARTIKEL_INLINE void partikel_integrateSSE2(ParticleData *d, size_t begin,
+                                            size_t end,
+                                            Vector2 externalAcceleration,
+                                            float dt, bool pull,
+                                            bool gravity) {
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 half = _mm_set1_ps(0.5f);
+  const __m128 threeHalves = _mm_set1_ps(1.5f);
+  const __m128 vdt = _mm_set1_ps(dt);
+  const __m128 ax = _mm_set1_ps(externalAcceleration.x);
+  const __m128 ay = _mm_set1_ps(externalAcceleration.y);
+
+  size_t i = begin;
+  for (; i + 4 <= end; i += 4) {
+    __m128 px = _mm_loadu_ps(d->posX + i);
+    __m128 py = _mm_loadu_ps(d->posY + i);
+    __m128 vx = _mm_loadu_ps(d->velX + i);
+    __m128 vy = _mm_loadu_ps(d->velY + i);
+
+    if (pull) {
+      __m128 dx = _mm_sub_ps(_mm_loadu_ps(d->originX + i), px);
+      __m128 dy = _mm_sub_ps(_mm_loadu_ps(d->originY + i), py);
+      __m128 len2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+      __m128 r = _mm_rsqrt_ps(len2);
+      r = _mm_mul_ps(r, _mm_sub_ps(threeHalves,
+                                   _mm_mul_ps(_mm_mul_ps(half, len2),
+                                              _mm_mul_ps(r, r))));
+      r = _mm_and_ps(r, _mm_cmpgt_ps(len2, zero));
+      __m128 s = _mm_mul_ps(r, _mm_loadu_ps(d->originAcceleration + i));
+      __m128 accX = _mm_mul_ps(dx, s);
+      __m128 accY = _mm_mul_ps(dy, s);
+      if (gravity) {
+        accX = _mm_add_ps(accX, ax);
+        accY = _mm_add_ps(accY, ay);
       }
-      // Then NULL the last emitter. It is either a duplicate or
-      // the removed one.
-      ps->length--;
-      ps->emitters[ps->length] = NULL;
+      vx = _mm_add_ps(vx, _mm_mul_ps(accX, vdt));
+      vy = _mm_add_ps(vy, _mm_mul_ps(accY, vdt));
+    } else if (gravity) {
+      vx = _mm_add_ps(vx, _mm_mul_ps(ax, vdt));
+      vy = _mm_add_ps(vy, _mm_mul_ps(ay, vdt));
+    }
 
-      return true;
+    if (pull || gravity) {
+      _mm_storeu_ps(d->velX + i, vx);
+      _mm_storeu_ps(d->velY + i, vy);
     }
+    _mm_storeu_ps(d->posX + i, _mm_add_ps(px, _mm_mul_ps(vx, vdt)));
+    _mm_storeu_ps(d->posY + i, _mm_add_ps(py, _mm_mul_ps(vy, vdt)));
   }
-  // Emitter not found.
-  return false;
+  partikel_integrateScalar(d, i, end, externalAcceleration, dt, pull,
+                           gravity);
 }
+PARTIKEL_INTEGRATOR_VARIANTS(PARTIKEL_TARGET("sse2"), partikel_integrateSSE2)
 
-// ParticleSystem_SetOrigin sets the origin for all registered Emitters.
-void ParticleSystem_SetOrigin(ParticleSystem *ps, Vector2 origin) {
-  ps->origin = origin;
-  for (size_t i = 0; i < ps->length; i++) {
-    ps->emitters[i]->config.origin = origin;
+// partikel_integrateAVX2 processes 8 particles per iteration.
+PARTIKEL_TARGET("avx2,fma")
+PARTIKEL_INLINE void partikel_integrateAVX2(ParticleData *d, size_t begin,
+                                            size_t end,
+                                            Vector2 externalAcceleration,
+                                            float dt, bool pull,
+                                            bool gravity) {
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 half = _mm256_set1_ps(0.5f);
+  const __m256 threeHalves = _mm256_set1_ps(1.5f);
+  const __m256 vdt = _mm256_set1_ps(dt);
+  const __m256 ax = _mm256_set1_ps(externalAcceleration.x);
+  const __m256 ay = _mm256_set1_ps(externalAcceleration.y);
+
+  size_t i = begin;
+  for (; i + 8 <= end; i += 8) {
+    __m256 px = _mm256_loadu_ps(d->posX + i);
+    __m256 py = _mm256_loadu_ps(d->posY + i);
+    __m256 vx = _mm256_loadu_ps(d->velX + i);
+    __m256 vy = _mm256_loadu_ps(d->velY + i);
+
+    if (pull) {
+      __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(d->originX + i), px);
+      __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(d->originY + i), py);
+      __m256 len2 = _mm256_fmadd_ps(dx, dx, _mm256_mul_ps(dy, dy));
+      __m256 r = _mm256_rsqrt_ps(len2);
+      r = _mm256_mul_ps(r, _mm256_fnmadd_ps(_mm256_mul_ps(half, len2),
+                                            _mm256_mul_ps(r, r), threeHalves));
+      r = _mm256_and_ps(r, _mm256_cmp_ps(len2, zero, _CMP_GT_OQ));
+      __m256 s = _mm256_mul_ps(r, _mm256_loadu_ps(d->originAcceleration + i));
+      __m256 accX = gravity ? _mm256_fmadd_ps(dx, s, ax) : _mm256_mul_ps(dx, s);
+      __m256 accY = gravity ? _mm256_fmadd_ps(dy, s, ay) : _mm256_mul_ps(dy, s);
+      vx = _mm256_fmadd_ps(accX, vdt, vx);
+      vy = _mm256_fmadd_ps(accY, vdt, vy);
+    } else if (gravity) {
+      vx = _mm256_fmadd_ps(ax, vdt, vx);
+      vy = _mm256_fmadd_ps(ay, vdt, vy);
+    }
+
+    if (pull || gravity) {
+      _mm256_storeu_ps(d->velX + i, vx);
+      _mm256_storeu_ps(d->velY + i, vy);
+    }
+    _mm256_storeu_ps(d->posX + i, _mm256_fmadd_ps(vx, vdt, px));
+    _mm256_storeu_ps(d->posY + i, _mm256_fmadd_ps(vy, vdt, py));
   }
+  partikel_integrateScalar(d, i, end, externalAcceleration, dt, pull,
+                           gravity);
 }
+PARTIKEL_INTEGRATOR_VARIANTS(PARTIKEL_TARGET("avx2,fma"),
+                             partikel_integrateAVX2)
 
-// ParticleSystem_Start runs Emitter_Start on all registered Emitters.
-void ParticleSystem_Start(ParticleSystem *ps) {
-  for (size_t i = 0; i < ps->length; i++) {
-    Emitter_Start(ps->emitters[i]);
+// partikel_integrateAVX512 processes 16 particles per iteration. The last
+// partial vector is handled with masked loads and stores.
+PARTIKEL_TARGET("avx512f")
+PARTIKEL_INLINE void partikel_integrateAVX512(ParticleData *d, size_t begin,
+                                              size_t end,
+                                              Vector2 externalAcceleration,
+                                              float dt, bool pull,
+                                              bool gravity) {
+  const __m512 zero = _mm512_setzero_ps();
+  const __m512 half = _mm512_set1_ps(0.5f);
+  const __m512 threeHalves = _mm512_set1_ps(1.5f);
+  const __m512 vdt = _mm512_set1_ps(dt);
+  const __m512 ax = _mm512_set1_ps(externalAcceleration.x);
+  const __m512 ay = _mm512_set1_ps(externalAcceleration.y);
+
+  for (size_t i = begin; i < end; i += 16) {
+    __mmask16 m = end - i >= 16 ? (__mmask16)0xFFFF
+                                : (__mmask16)((1u << (end - i)) - 1);
+    __m512 px = _mm512_maskz_loadu_ps(m, d->posX + i);
+    __m512 py = _mm512_maskz_loadu_ps(m, d->posY + i);
+    __m512 vx = _mm512_maskz_loadu_ps(m, d->velX + i);
+    __m512 vy = _mm512_maskz_loadu_ps(m, d->velY + i);
+
+    if (pull) {
+      __m512 dx = _mm512_sub_ps(_mm512_maskz_loadu_ps(m, d->originX + i), px);
+      __m512 dy = _mm512_sub_ps(_mm512_maskz_loadu_ps(m, d->originY + i), py);
+      __m512 len2 = _mm512_fmadd_ps(dx, dx, _mm512_mul_ps(dy, dy));
+      __m512 r = _mm512_rsqrt14_ps(len2);
+      r = _mm512_mul_ps(r, _mm512_fnmadd_ps(_mm512_mul_ps(half, len2),
+                                            _mm512_mul_ps(r, r), threeHalves));
+      __mmask16 pulled = _mm512_cmp_ps_mask(len2, zero, _CMP_GT_OQ);
+      __m512 s = _mm512_maskz_mul_ps(
+          pulled, r, _mm512_maskz_loadu_ps(m, d->originAcceleration + i));
+      __m512 accX = gravity ? _mm512_fmadd_ps(dx, s, ax) : _mm512_mul_ps(dx, s);
+      __m512 accY = gravity ? _mm512_fmadd_ps(dy, s, ay) : _mm512_mul_ps(dy, s);
+      vx = _mm512_fmadd_ps(accX, vdt, vx);
+      vy = _mm512_fmadd_ps(accY, vdt, vy);
+    } else if (gravity) {
+      vx = _mm512_fmadd_ps(ax, vdt, vx);
+      vy = _mm512_fmadd_ps(ay, vdt, vy);
+    }
+
+    if (pull || gravity) {
+      _mm512_mask_storeu_ps(d->velX + i, m, vx);
+      _mm512_mask_storeu_ps(d->velY + i, m, vy);
+    }
+    _mm512_mask_storeu_ps(d->posX + i, m, _mm512_fmadd_ps(vx, vdt, px));
+    _mm512_mask_storeu_ps(d->posY + i, m, _mm512_fmadd_ps(vy, vdt, py));
   }
 }
+PARTIKEL_INTEGRATOR_VARIANTS(PARTIKEL_TARGET("avx512f"),
+                             partikel_integrateAVX512)
 
-// ParticleSystem_Stop runs Emitter_Stop on all registered Emitters.
-void ParticleSystem_Stop(ParticleSystem *ps) {
-  for (size_t i = 0; i < ps->length; i++) {
-    Emitter_Stop(ps->emitters[i]);
+#endif // PARTIKEL_X86_SIMD
+
+// PARTIKEL_INTEGRATOR_TABLE lists the variants of a kernel in the order
+// [pull * 2 + gravity].
+#define PARTIKEL_INTEGRATOR_TABLE(kernel)                                      \
+  {                                                                            \
+    kernel##Ballistic, kernel##Gravity, kernel##Pull, kernel##Full             \
   }
-}
 
-// ParticleSystem_Burst runs Emitter_Burst on all registered Emitters.
-void ParticleSystem_Burst(ParticleSystem *ps) {
-  for (size_t i = 0; i < ps->length; i++) {
-    Emitter_Burst(ps->emitters[i]);
+#ifdef PARTIKEL_X86_SIMD
+// partikel_bestIntegrators is the variant table of the fastest kernel the
+// CPU supports, set by partikel_selectIntegrators.
+static const ParticleIntegrator *partikel_bestIntegrators = NULL;
+
+// partikel_selectIntegrators inspects the CPU.
+static void partikel_selectIntegrators(void) {
+  static const ParticleIntegrator sse2[4] =
+      PARTIKEL_INTEGRATOR_TABLE(partikel_integrateSSE2);
+  static const ParticleIntegrator avx2[4] =
+      PARTIKEL_INTEGRATOR_TABLE(partikel_integrateAVX2);
+  static const ParticleIntegrator avx512[4] =
+      PARTIKEL_INTEGRATOR_TABLE(partikel_integrateAVX512);
+  static const ParticleIntegrator scalar[4] =
+      PARTIKEL_INTEGRATOR_TABLE(partikel_integrateScalar);
+
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    partikel_bestIntegrators = avx512;
+  } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    partikel_bestIntegrators = avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    partikel_bestIntegrators = sse2;
+  } else {
+    partikel_bestIntegrators = scalar;
   }
 }
+#endif
+
+// partikel_integrators returns the variant table of the fastest kernel the
+// CPU supports. The CPU is only inspected on the first call, which with
+// PARTIKEL_THREADS is safe from several threads at once.
+static const ParticleIntegrator *partikel_integrators(void) {
+#ifdef PARTIKEL_X86_SIMD
+#ifdef PARTIKEL_THREADS
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, partikel_selectIntegrators);
+#else
+  if (partikel_bestIntegrators == NULL) {
+    partikel_selectIntegrators();
+  }
+#endif
+  return partikel_bestIntegrators;
+#else
+  static const ParticleIntegrator scalar[4] =
+      PARTIKEL_INTEGRATOR_TABLE(partikel_integrateScalar);
+  return scalar;
+#endif
+}
+
+// Collider type.
+//----------------------------------------------------------------------------------
+
+// ColliderType is the shape of a Collider.
+typedef enum ColliderType {
+  COLLIDER_SEGMENT,   // Line segment from start to end, solid from both sides.
+  COLLIDER_RECTANGLE, // Axis aligned rectangle.
+  COLLIDER_CIRCLE,    // Circle around center.
+} ColliderType;
+
+// Collider is a piece of level geometry particles of Emitters with
+// collide set bounce off (see ParticleSystem_AddCollider). Particles are
+// points, so grow the shapes by the particle size if needed.
+struct Collider {
+  ColliderType type;
+  Vector2 start;       // Start of a segment.
+  Vector2 end;         // End of a segment.
+  Rectangle rectangle; // Area of a rectangle.
+  Vector2 center;      // Center of a circle.
+  float radius;        // Radius of a circle.
+  float restitution;   // Share of the speed along the normal kept by a
+                       // bounce. 0 stops the particle, 1 is fully elastic.
+  float friction;      // Share of the speed along the surface lost on
+                       // contact. 0 slides, 1 sticks.
+};
+
+// ParticleRef names a particle by its Emitter and slot index, as returned
+// by the queries of a ParticleSystem. It is valid until the next update.
+struct ParticleRef {
+  Emitter *emitter;
+  size_t index;
+};
+
+// Distance particles are put off a collider they hit, so they do not hit
+// it again right away due to rounding.
+#define PARTIKEL_COLLIDER_SKIN 0.01f
+
+// Collider_bounds returns the rectangle containing the collider c.
+static Rectangle Collider_bounds(const Collider *c) {
+  switch (c->type) {
+  case COLLIDER_SEGMENT:
+    return (Rectangle){.x = fminf(c->start.x, c->end.x),
+                       .y = fminf(c->start.y, c->end.y),
+                       .width = fabsf(c->end.x - c->start.x),
+                       .height = fabsf(c->end.y - c->start.y)};
+  case COLLIDER_RECTANGLE:
+    return c->rectangle;
+  case COLLIDER_CIRCLE:
+    return (Rectangle){.x = c->center.x - c->radius,
+                       .y = c->center.y - c->radius,
+                       .width = 2 * c->radius,
+                       .height = 2 * c->radius};
+  }
+  return (Rectangle){0};
+}
+
+// Collider_resolve moves a particle that went from old to *pos in this
+// step out of the collider c. Returns true and the surface normal at the
+// contact if it hit c.
+static bool Collider_resolve(const Collider *c, Vector2 old, Vector2 *pos,
+                             Vector2 *normal) {
+  switch (c->type) {
+  case COLLIDER_SEGMENT: {
+    // The particle hit the segment if it changed sides of its line at a
+    // point between start and end.
+    Vector2 d = {.x = c->end.x - c->start.x, .y = c->end.y - c->start.y};
+    Vector2 n = NormalizeV2((Vector2){.x = -d.y, .y = d.x});
+    float before = (old.x - c->start.x) * n.x + (old.y - c->start.y) * n.y;
+    float after = (pos->x - c->start.x) * n.x + (pos->y - c->start.y) * n.y;
+    if (before == 0 || (before > 0) == (after > 0)) {
+      return false;
+    }
+    float t = before / (before - after);
+    Vector2 hit = {.x = old.x + (pos->x - old.x) * t,
+                   .y = old.y + (pos->y - old.y) * t};
+    float u = (hit.x - c->start.x) * d.x + (hit.y - c->start.y) * d.y;
+    if (u < 0 || u > d.x * d.x + d.y * d.y) {
+      return false;
+    }
+    if (before < 0) {
+      n = (Vector2){.x = -n.x, .y = -n.y};
+    }
+    *pos = (Vector2){.x = hit.x + n.x * PARTIKEL_COLLIDER_SKIN,
+                     .y = hit.y + n.y * PARTIKEL_COLLIDER_SKIN};
+    *normal = n;
+    return true;
+  }
+  case COLLIDER_RECTANGLE: {
+    // Push the particle out through the nearest side.
+    Rectangle r = c->rectangle;
+    float left = pos->x - r.x;
+    float right = r.x + r.width - pos->x;
+    float top = pos->y - r.y;
+    float bottom = r.y + r.height - pos->y;
+    if (left <= 0 || right <= 0 || top <= 0 || bottom <= 0) {
+      return false;
+    }
+    float depth = fminf(fminf(left, right), fminf(top, bottom));
+    if (depth == left) {
+      pos->x = r.x - PARTIKEL_COLLIDER_SKIN;
+      *normal = (Vector2){.x = -1, .y = 0};
+    } else if (depth == right) {
+      pos->x = r.x + r.width + PARTIKEL_COLLIDER_SKIN;
+      *normal = (Vector2){.x = 1, .y = 0};
+    } else if (depth == top) {
+      pos->y = r.y - PARTIKEL_COLLIDER_SKIN;
+      *normal = (Vector2){.x = 0, .y = -1};
+    } else {
+      pos->y = r.y + r.height + PARTIKEL_COLLIDER_SKIN;
+      *normal = (Vector2){.x = 0, .y = 1};
+    }
+    return true;
+  }
+  case COLLIDER_CIRCLE: {
+    // Push the particle out along the radius.
+    float dx = pos->x - c->center.x;
+    float dy = pos->y - c->center.y;
+    float dist2 = dx * dx + dy * dy;
+    if (dist2 >= c->radius * c->radius) {
+      return false;
+    }
+    Vector2 n = dist2 > 0 ? NormalizeV2((Vector2){.x = dx, .y = dy})
+                          : (Vector2){.x = 0, .y = -1};
+    float r = c->radius + PARTIKEL_COLLIDER_SKIN;
+    *pos = (Vector2){.x = c->center.x + n.x * r, .y = c->center.y + n.y * r};
+    *normal = n;
+    return true;
+  }
+  }
+  return false;
+}
+
+// ParticleGrid is a uniform grid of columns * rows square cells. The
+// entries of all cells are stored in one array owned by the user of the
+// grid: cell c holds the entries [cellStart[c], cellStart[c + 1]).
+//
+// A grid is filled in three passes: ParticleGrid_count every entry, run
+// ParticleGrid_prefix and then ParticleGrid_place every entry again.
+typedef struct ParticleGrid {
+  Vector2 origin; // Top left corner of cell 0.
+  float cellSize;
+  int columns;
+  int rows;
+  uint32_t *cellStart;
+  size_t cellCapacity; // Allocated length of cellStart.
+} ParticleGrid;
+
+// partikel_reserve returns an array of at least n elements of size bytes.
+// That is data itself if its capacity suffices, otherwise data is freed
+// and its contents are not kept. Returns NULL and keeps data if out of
+// memory.
+static void *partikel_reserve(void *data, size_t *capacity, size_t n,
+                              size_t size) {
+  if (n <= *capacity) {
+    return data;
+  }
+  size_t grown = 2 * *capacity > n ? 2 * *capacity : n;
+  void *fresh = PARTIKEL_ALLOC(grown, size);
+  if (fresh == NULL) {
+    return NULL;
+  }
+  PARTIKEL_FREE(data);
+  *capacity = grown;
+  return fresh;
+}
+
+// ParticleGrid_init empties the grid and lays it over area. The cells are
+// PARTIKEL_GRID_CELL_SIZE wide, or wider if area would need more than
+// PARTIKEL_GRID_MAX_CELLS of them. Returns false if out of memory.
+static bool ParticleGrid_init(ParticleGrid *g, Rectangle area) {
+  // An area overflowing to infinity is clamped, NaN becomes 0.
+  float width = fminf(fmaxf(area.width, 0), FLT_MAX);
+  float height = fminf(fmaxf(area.height, 0), FLT_MAX);
+  float size = PARTIKEL_GRID_CELL_SIZE;
+  while ((width / size + 1) * (height / size + 1) > PARTIKEL_GRID_MAX_CELLS) {
+    size *= 2;
+  }
+  g->origin = (Vector2){.x = area.x, .y = area.y};
+  g->cellSize = size;
+  g->columns = (int)(width / size) + 1;
+  g->rows = (int)(height / size) + 1;
+  size_t count = (size_t)g->columns * (size_t)g->rows + 1;
+  uint32_t *cellStart =
+      partikel_reserve(g->cellStart, &g->cellCapacity, count, sizeof(uint32_t));
+  if (cellStart == NULL) {
+    g->columns = 0;
+    g->rows = 0;
+    return false;
+  }
+  g->cellStart = cellStart;
+  memset(g->cellStart, 0, count * sizeof(uint32_t));
+  return true;
+}
+
+// ParticleGrid_free frees the cells of the grid.
+static void ParticleGrid_free(ParticleGrid *g) {
+  PARTIKEL_FREE(g->cellStart);
+  *g = (ParticleGrid){0};
+}
+
+// ParticleGrid_column returns the column of x clamped to the grid. NaN
+// maps to column 0.
+static int ParticleGrid_column(const ParticleGrid *g, float x) {
+  float c = floorf((x - g->origin.x) / g->cellSize);
+  return !(c >= 0) ? 0 : c >= g->columns ? g->columns - 1 : (int)c;
+}
+
+// ParticleGrid_row returns the row of y clamped to the grid. NaN maps to
+// row 0.
+static int ParticleGrid_row(const ParticleGrid *g, float y) {
+  float r = floorf((y - g->origin.y) / g->cellSize);
+  return !(r >= 0) ? 0 : r >= g->rows ? g->rows - 1 : (int)r;
+}
+
+// ParticleGrid_cell returns the cell containing the point (x, y) or -1 if
+// it lies outside of the grid.
+static long ParticleGrid_cell(const ParticleGrid *g, float x, float y) {
+  float c = floorf((x - g->origin.x) / g->cellSize);
+  float r = floorf((y - g->origin.y) / g->cellSize);
+  if (!(c >= 0 && c < g->columns && r >= 0 && r < g->rows)) {
+    return -1;
+  }
+  return (long)r * g->columns + (long)c;
+}
+
+// ParticleGrid_count adds one entry to cell c.
+static void ParticleGrid_count(ParticleGrid *g, long c) { g->cellStart[c]++; }
+
+// ParticleGrid_prefix turns the counts into the end of each cell and
+// returns the amount of entries.
+static size_t ParticleGrid_prefix(ParticleGrid *g) {
+  size_t cells = (size_t)g->columns * (size_t)g->rows;
+  uint32_t sum = 0;
+  for (size_t c = 0; c < cells; c++) {
+    sum += g->cellStart[c];
+    g->cellStart[c] = sum;
+  }
+  g->cellStart[cells] = sum;
+  return sum;
+}
+
+// ParticleGrid_place returns the slot of the next entry of cell c. Once
+// all entries are placed, cellStart holds the start of each cell.
+static uint32_t ParticleGrid_place(ParticleGrid *g, long c) {
+  return --g->cellStart[c];
+}
+
+// ParticleColliders are the colliders of a ParticleSystem together with
+// the grid of them. Cells list the colliders whose bounds touch them.
+struct ParticleColliders {
+  Collider *colliders;
+  size_t length;
+  size_t capacity;
+  ParticleGrid grid;
+  uint32_t *entries; // Collider indices by cell.
+  size_t entryCapacity;
+  bool stale; // The grid must be rebuilt before the next collision pass.
+  bool ready; // The grid is built and may be used.
+};
+
+// ParticleColliders_build rebuilds the grid of the colliders if they
+// changed.
+static void ParticleColliders_build(ParticleColliders *pc) {
+  if (!pc->stale) {
+    return;
+  }
+  pc->stale = false;
+  pc->ready = false;
+  if (pc->length == 0) {
+    return;
+  }
+
+  Rectangle area = Collider_bounds(&pc->colliders[0]);
+  for (size_t i = 1; i < pc->length; i++) {
+    Rectangle b = Collider_bounds(&pc->colliders[i]);
+    float right = fmaxf(area.x + area.width, b.x + b.width);
+    float bottom = fmaxf(area.y + area.height, b.y + b.height);
+    area.x = fminf(area.x, b.x);
+    area.y = fminf(area.y, b.y);
+    area.width = right - area.x;
+    area.height = bottom - area.y;
+  }
+  ParticleGrid *g = &pc->grid;
+  if (!ParticleGrid_init(g, area)) {
+    return;
+  }
+
+  for (int pass = 0; pass < 2; pass++) {
+    for (size_t i = 0; i < pc->length; i++) {
+      Rectangle b = Collider_bounds(&pc->colliders[i]);
+      int c0 = ParticleGrid_column(g, b.x);
+      int c1 = ParticleGrid_column(g, b.x + b.width);
+      int r0 = ParticleGrid_row(g, b.y);
+      int r1 = ParticleGrid_row(g, b.y + b.height);
+      for (int r = r0; r <= r1; r++) {
+        for (int c = c0; c <= c1; c++) {
+          long cell = (long)r * g->columns + c;
+          if (pass == 0) {
+            ParticleGrid_count(g, cell);
+          } else {
+            pc->entries[ParticleGrid_place(g, cell)] = (uint32_t)i;
+          }
+        }
+      }
+    }
+    if (pass == 0) {
+      uint32_t *entries =
+          partikel_reserve(pc->entries, &pc->entryCapacity,
+                           ParticleGrid_prefix(g), sizeof(uint32_t));
+      if (entries == NULL) {
+        return;
+      }
+      pc->entries = entries;
+    }
+  }
+  pc->ready = true;
+}
+
+// ParticleColliders_free frees all colliders and their grid.
+static void ParticleColliders_free(ParticleColliders *pc) {
+  PARTIKEL_FREE(pc->colliders);
+  PARTIKEL_FREE(pc->entries);
+  ParticleGrid_free(&pc->grid);
+  *pc = (ParticleColliders){0};
+}
+
+// ForceField type.
+//----------------------------------------------------------------------------------
+
+// ForceFieldType is the kind of a ForceField.
+typedef enum ForceFieldType {
+  FORCE_POINT,  // Pulls towards position, or pushes away if strength < 0.
+  FORCE_VORTEX, // Swirls around position, clockwise on screen if
+                // strength > 0.
+  FORCE_WIND,   // Pulls the velocities inside area towards velocity.
+  FORCE_DRAG,   // Slows particles inside area down.
+} ForceFieldType;
+
+// ForceFalloff is how point and vortex fields weaken towards their radius.
+typedef enum ForceFalloff {
+  FALLOFF_NONE,      // Full strength up to radius.
+  FALLOFF_LINEAR,    // Full strength at position, 0 at radius.
+  FALLOFF_QUADRATIC, // Like linear, but squared.
+} ForceFalloff;
+
+// Layers of a ForceField acting on every Emitter with forceLayers set.
+#define PARTIKEL_ALL_LAYERS 0xFFFFFFFFu
+
+// ForceField is a force a ParticleSystem applies to the particles of its
+// Emitters (see ParticleSystem_AddForceField).
+struct ForceField {
+  ForceFieldType type;
+  uint32_t layers; // Acts on the Emitters whose forceLayers share a bit.
+  float strength;  // Acceleration of point and vortex fields in pixels/s^2.
+                   // Rate of wind and drag: the share of the velocity
+                   // difference left after a second is e^-strength.
+  Vector2 position;     // Center of point and vortex fields.
+  float radius;         // Reach of point and vortex fields. 0 is unlimited.
+  ForceFalloff falloff; // Falloff of point and vortex fields.
+  Rectangle area;       // Area of wind and drag fields. Unused if width or
+                        // height is <= 0, then they act everywhere.
+  Vector2 velocity;     // Velocity of wind.
+};
+
+// Amount of particles the force fields are evaluated for at once. The
+// fixed size lets compilers vectorize the field loops even at -O2.
+#define PARTIKEL_FORCE_BLOCK 64
+
+// Distance in pixels added to the distance to the center of point and
+// vortex fields, so their direction does not flip wildly right at it.
+#define PARTIKEL_FORCE_SOFTENING 1.0f
+
+// partikel_rsqrt returns 1 / sqrt(x) for x >= 0 with a relative error
+// around 1e-7. Unlike sqrtf it never sets errno, so loops using it
+// vectorize without -fno-math-errno.
+PARTIKEL_INLINE float partikel_rsqrt(float x) {
+  union {
+    float f;
+    uint32_t i;
+  } u = {.f = x};
+  u.i = 0x5F3759DFu - (u.i >> 1);
+  float y = u.f;
+  // Each Newton step squares the error.
+  y *= 1.5f - 0.5f * x * y * y;
+  y *= 1.5f - 0.5f * x * y * y;
+  y *= 1.5f - 0.5f * x * y * y;
+  return y;
+}
+
+// ForceField_isPull returns whether f is a point or vortex field. Their
+// acceleration only depends on the position, so they can be sampled.
+static bool ForceField_isPull(const ForceField *f) {
+  return f->type == FORCE_POINT || f->type == FORCE_VORTEX;
+}
+
+// ForceField_pull adds the acceleration of the point or vortex field f at
+// the n <= PARTIKEL_FORCE_BLOCK positions x, y to ax, ay. It has no
+// branches, so compilers vectorize it.
+PARTIKEL_INLINE void ForceField_pull(const ForceField *f, const float *x,
+                                     const float *y, float *ax, float *ay,
+                                     size_t n) {
+  float invRadius = f->radius > 0 ? 1.0f / f->radius : 0;
+  float cx = f->position.x;
+  float cy = f->position.y;
+  // The weight is cut (inside of the radius) + linear * w + squared * w^2
+  // for the remaining share w of the radius.
+  float cut = f->falloff == FALLOFF_NONE ? 1.0f : 0.0f;
+  float linear = f->falloff == FALLOFF_LINEAR ? 1.0f : 0.0f;
+  float squared = f->falloff == FALLOFF_QUADRATIC ? 1.0f : 0.0f;
+  // Point fields accelerate along the offset, vortex fields across it.
+  float along = f->type == FORCE_POINT ? f->strength : 0;
+  float across = f->type == FORCE_VORTEX ? f->strength : 0;
+  for (size_t j = 0; j < n; j++) {
+    float dx = cx - x[j];
+    float dy = cy - y[j];
+    float dist2 = dx * dx + dy * dy;
+    float dist = dist2 * partikel_rsqrt(dist2);
+    float w = 1.0f - dist * invRadius;
+    float inside = w > 0 ? cut : 0;
+    w = w > 0 ? w : 0;
+    float s = (inside + linear * w + squared * w * w) /
+              (dist + PARTIKEL_FORCE_SOFTENING);
+    ax[j] += s * (along * dx + across * dy);
+    ay[j] += s * (along * dy - across * dx);
+  }
+}
+
+// ForceField_blend pulls the n <= PARTIKEL_FORCE_BLOCK velocities vx, vy
+// at the positions x, y inside the area of the wind or drag field f
+// towards its velocity. The decay is exact, so large steps never
+// overshoot.
+PARTIKEL_INLINE void ForceField_blend(const ForceField *f, const float *x,
+                                      const float *y, float *vx, float *vy,
+                                      size_t n, float dt) {
+  float rate = 1.0f - expf(-f->strength * dt);
+  float tx = f->type == FORCE_WIND ? f->velocity.x : 0;
+  float ty = f->type == FORCE_WIND ? f->velocity.y : 0;
+  Rectangle a = f->area;
+  if (a.width <= 0 || a.height <= 0) {
+    for (size_t j = 0; j < n; j++) {
+      vx[j] += (tx - vx[j]) * rate;
+      vy[j] += (ty - vy[j]) * rate;
+    }
+    return;
+  }
+  for (size_t j = 0; j < n; j++) {
+    float r = rate * (float)((x[j] >= a.x) & (x[j] <= a.x + a.width) &
+                             (y[j] >= a.y) & (y[j] <= a.y + a.height));
+    vx[j] += (tx - vx[j]) * r;
+    vy[j] += (ty - vy[j]) * r;
+  }
+}
+
+// ParticleForces are the force fields of a ParticleSystem. The point and
+// vortex fields acting on all layers can be sampled into a grid of
+// accelerations, which is then interpolated instead of evaluating them
+// all for every particle.
+struct ParticleForces {
+  ForceField *fields;
+  size_t length;
+  size_t capacity;
+  Rectangle gridArea; // Area covered by the grid. Unused if width <= 0.
+  float gridCellSize;
+  int columns;
+  int rows;
+  float *gridX; // Sampled accelerations at the (columns + 1) * (rows + 1)
+  float *gridY; // corners of the cells.
+  size_t gridCapacity; // Allocated length of gridX and gridY.
+  bool stale;     // The grid must be sampled again before the next update.
+  bool gridReady; // The grid is sampled and may be used.
+};
+
+// ForceField_onGrid returns whether field f is part of the sampled grid.
+static bool ForceField_onGrid(const ParticleForces *pf, const ForceField *f) {
+  return pf->gridReady && ForceField_isPull(f) &&
+         f->layers == PARTIKEL_ALL_LAYERS;
+}
+
+// ParticleForces_build samples the grid again if the fields changed.
+static void ParticleForces_build(ParticleForces *pf) {
+  if (!pf->stale) {
+    return;
+  }
+  pf->stale = false;
+  pf->gridReady = false;
+  if (pf->gridArea.width <= 0 || pf->gridX == NULL) {
+    return;
+  }
+
+  size_t stride = (size_t)pf->columns + 1;
+  size_t count = stride * ((size_t)pf->rows + 1);
+  float x[PARTIKEL_FORCE_BLOCK];
+  float y[PARTIKEL_FORCE_BLOCK];
+  memset(pf->gridX, 0, count * sizeof(float));
+  memset(pf->gridY, 0, count * sizeof(float));
+  for (size_t i = 0; i < count; i += PARTIKEL_FORCE_BLOCK) {
+    size_t n =
+        count - i < PARTIKEL_FORCE_BLOCK ? count - i : PARTIKEL_FORCE_BLOCK;
+    for (size_t j = 0; j < n; j++) {
+      x[j] = pf->gridArea.x + (float)((i + j) % stride) * pf->gridCellSize;
+      y[j] = pf->gridArea.y + (float)((i + j) / stride) * pf->gridCellSize;
+    }
+    for (size_t k = 0; k < pf->length; k++) {
+      const ForceField *f = &pf->fields[k];
+      if (ForceField_isPull(f) && f->layers == PARTIKEL_ALL_LAYERS) {
+        ForceField_pull(f, x, y, pf->gridX + i, pf->gridY + i, n);
+      }
+    }
+  }
+  pf->gridReady = true;
+}
+
+// ParticleForces_sampleBlock writes the accelerations of the fields on the
+// grid at the n <= PARTIKEL_FORCE_BLOCK positions x, y to ax, ay. They are
+// interpolated bilinearly. Positions outside the grid get the exact ones.
+PARTIKEL_INLINE void ParticleForces_sampleBlock(const ParticleForces *pf,
+                                                const float *x,
+                                                const float *y, float *ax,
+                                                float *ay, size_t n) {
+  float inv = 1.0f / pf->gridCellSize;
+  float columns = (float)pf->columns;
+  float rows = (float)pf->rows;
+  int stride = pf->columns + 1;
+  int cell[PARTIKEL_FORCE_BLOCK];
+  float tx[PARTIKEL_FORCE_BLOCK];
+  float ty[PARTIKEL_FORCE_BLOCK];
+  unsigned char outside[PARTIKEL_FORCE_BLOCK];
+  unsigned char any = 0;
+
+  // Find the cells and the offsets within them without branches.
+  for (size_t j = 0; j < n; j++) {
+    float fx = (x[j] - pf->gridArea.x) * inv;
+    float fy = (y[j] - pf->gridArea.y) * inv;
+    outside[j] = !((fx >= 0) & (fx <= columns) & (fy >= 0) & (fy <= rows));
+    any |= outside[j];
+    fx = fx > 0 ? fx : 0;
+    fy = fy > 0 ? fy : 0;
+    float cx = fx < columns - 1 ? fx : columns - 1;
+    float cy = fy < rows - 1 ? fy : rows - 1;
+    int c = (int)cx;
+    int r = (int)cy;
+    float u = fx - (float)c;
+    float v = fy - (float)r;
+    tx[j] = u < 1 ? u : 1;
+    ty[j] = v < 1 ? v : 1;
+    cell[j] = r * stride + c;
+  }
+  for (size_t j = 0; j < n; j++) {
+    int k = cell[j];
+    float topX = pf->gridX[k] + (pf->gridX[k + 1] - pf->gridX[k]) * tx[j];
+    float topY = pf->gridY[k] + (pf->gridY[k + 1] - pf->gridY[k]) * tx[j];
+    k += stride;
+    float bottomX = pf->gridX[k] + (pf->gridX[k + 1] - pf->gridX[k]) * tx[j];
+    float bottomY = pf->gridY[k] + (pf->gridY[k + 1] - pf->gridY[k]) * tx[j];
+    ax[j] = topX + (bottomX - topX) * ty[j];
+    ay[j] = topY + (bottomY - topY) * ty[j];
+  }
+  if (!any) {
+    return;
+  }
+  for (size_t j = 0; j < n; j++) {
+    if (!outside[j]) {
+      continue;
+    }
+    ax[j] = 0;
+    ay[j] = 0;
+    for (size_t k = 0; k < pf->length; k++) {
+      const ForceField *f = &pf->fields[k];
+      if (ForceField_onGrid(pf, f)) {
+        ForceField_pull(f, x + j, y + j, ax + j, ay + j, 1);
+      }
+    }
+  }
+}
+
+// ParticleForces_free frees all fields and the grid.
+static void ParticleForces_free(ParticleForces *pf) {
+  PARTIKEL_FREE(pf->fields);
+  PARTIKEL_FREE(pf->gridX);
+  PARTIKEL_FREE(pf->gridY);
+  *pf = (ParticleForces){0};
+}
+
+// Emitter type.
+//----------------------------------------------------------------------------------
+
+// Emitter is a single (point) source emitting many particles.
+struct Emitter {
+  EmitterConfig config;
+  float mustEmit; // Amount of particles to be emitted within next update call.
+  Vector2 offset; // Offset holds half the width and height of the texture.
+  bool isEmitting;
+  size_t length; // Amount of live particles. They occupy slots [0, length).
+  ParticleIntegrator integrate; // Update kernel picked for config and CPU.
+  RandomStream random; // Source of all random values of this Emitter.
+  // Over-lifetime lookup tables baked from the config. axisX and axisY are
+  // the rotated and scaled half extents of the particle quad.
+  Color colorLut[PARTIKEL_LUT_SIZE];
+  Vector2 axisXLut[PARTIKEL_LUT_SIZE];
+  Vector2 axisYLut[PARTIKEL_LUT_SIZE];
+  Vector2 extent; // Largest distance of a quad corner from its particle.
+  Rectangle bounds; // Contains everything drawn by the Emitter. Kept up to
+                    // date only while its ParticleSystem has a view.
+  float lodDt;      // Time skipped while throttled outside the view.
+  unsigned int lodSkipped; // Updates skipped in a row.
+  float stepDt; // Time the Emitter advances in the current system update.
+  ParticleVertex *vertices; // Quad buffer used by Emitter_Draw.
+  size_t vertexCapacity;    // Amount of particles fitting into vertices.
+  // Quads drawn by ParticleSystem_Draw in pipelined mode. The pipelined
+  // update builds the next frame into vertices meanwhile and
+  // ParticleSystem_Sync swaps both buffers.
+  ParticleVertex *frontVertices;
+  size_t frontCapacity; // Amount of particles fitting into frontVertices.
+  size_t frontQuads;    // Quads to draw from frontVertices.
+  size_t builtQuads;    // Quads built into vertices for the next frame.
+  float *sortBuffer;   // Keys and indices sorted by Emitter_sort.
+  size_t sortCapacity; // Amount of particles fitting into sortBuffer.
+  unsigned int atlasTexture; // Id of the texture packed into the atlas of
+                             // the ParticleSystem or 0.
+  Rectangle atlasUv; // Texture coordinates of it within the atlas.
+  ParticleData particles; // All particles as structure of arrays.
+  size_t peakLength; // Most live particles within the current window.
+  float windowAge;   // Seconds since the current window started.
+  bool interpolate; // Draw between prevX/prevY and posX/posY by alpha.
+  float alpha;      // Fraction of the next fixed step already elapsed.
+  float fixedStep;  // Length of the fixed steps when interpolating.
+  float drawAhead;  // Seconds elapsed since the last fixed step.
+  bool analytic;    // posX/posY and velX/velY hold the spawn state.
+  float clock;      // Time of the Emitter. born is measured on it.
+  bool pooled;       // The particles are a view into the pool of a system.
+  size_t poolOffset; // First slot of the particles in that pool.
+  size_t poolSize;   // Slots planned by ParticleSystem_planPool.
+  ParticleColliders *colliders; // Colliders of the ParticleSystem the
+                                // Emitter is registered to or NULL.
+  ParticleForces *forces;       // Its force fields or NULL.
+#ifdef PARTIKEL_STATS
+  ParticleStats stats; // Counters, see Emitter_GetStats.
+#endif
+};
+
+// Emitter_layout returns the PARTIKEL_LAYOUT_* bits of the arrays an
+// Emitter with config cfg stores in analytic mode or not, with
+// interpolation or not.
+static unsigned int Emitter_layout(const EmitterConfig *cfg, bool analytic,
+                                   bool interpolate) {
+  unsigned int layout = 0;
+  if (cfg->originAcceleration.min != 0 || cfg->originAcceleration.max != 0) {
+    layout |= PARTIKEL_LAYOUT_PULL;
+  }
+  if (interpolate && !analytic) {
+    layout |= PARTIKEL_LAYOUT_PREV;
+  }
+  layout |= cfg->quantize ? PARTIKEL_LAYOUT_TTL16 : PARTIKEL_LAYOUT_TTL32;
+  layout |= cfg->quantize && analytic ? PARTIKEL_LAYOUT_VEL16
+                                      : PARTIKEL_LAYOUT_VEL32;
+  return layout;
+}
+
+// Emitter_ttl returns the ttl of particle i.
+PARTIKEL_INLINE float Emitter_ttl(const Emitter *e, size_t i) {
+  const ParticleData *d = &e->particles;
+  return d->ttl != NULL ? d->ttl[i] : partikel_fromHalf(d->halfTtl[i]);
+}
+
+// Emitter_velocity returns the stored velocity of particle i, which is the
+// spawn velocity in analytic mode.
+PARTIKEL_INLINE Vector2 Emitter_velocity(const Emitter *e, size_t i) {
+  const ParticleData *d = &e->particles;
+  if (d->velX != NULL) {
+    return (Vector2){.x = d->velX[i], .y = d->velY[i]};
+  }
+  return (Vector2){.x = partikel_fromHalf(d->halfVelX[i]),
+                   .y = partikel_fromHalf(d->halfVelY[i])};
+}
+
+// Emitter_setVelocity stores v as the velocity of particle i.
+static void Emitter_setVelocity(Emitter *e, size_t i, Vector2 v) {
+  ParticleData *d = &e->particles;
+  if (d->velX != NULL) {
+    d->velX[i] = v.x;
+    d->velY[i] = v.y;
+  } else {
+    d->halfVelX[i] = partikel_toHalf(v.x);
+    d->halfVelY[i] = partikel_toHalf(v.y);
+  }
+}
+
+// Emitter_loadParticle fills p with the state of slot i of the Emitter.
+// It is used to hand single particles to custom deactivator functions.
+static void Emitter_loadParticle(const Emitter *e, size_t i, Particle *p) {
+  const ParticleData *d = &e->particles;
+  p->position = (Vector2){.x = d->posX[i], .y = d->posY[i]};
+  p->velocity = Emitter_velocity(e, i);
+  p->origin = e->config.origin;
+  p->originAcceleration = 0;
+  if (d->originX != NULL) {
+    p->origin = (Vector2){.x = d->originX[i], .y = d->originY[i]};
+    p->originAcceleration = d->originAcceleration[i];
+  }
+  p->externalAcceleration = e->config.externalAcceleration;
+  p->age = e->clock - d->born[i];
+  p->ttl = Emitter_ttl(e, i);
+  p->active = true;
+  p->particle_Deactivator = e->config.particle_Deactivator;
+}
+
+// Emitter_relayout moves the particles into new storage for capacity
+// particles with the given layout, which must hold all live ones. A pooled
+// Emitter gets storage of its own until its ParticleSystem pools it again.
+// Returns false if there is not enough memory.
+static bool Emitter_relayout(Emitter *e, size_t capacity,
+                             unsigned int layout) {
+  ParticleData data;
+  if (!ParticleData_alloc(&data, capacity, layout)) {
+    return false;
+  }
+  ParticleData_convert(&data, 0, &e->particles, 0, e->length,
+                       e->config.origin);
+  ParticleData_free(&e->particles);
+  e->particles = data;
+  e->pooled = false;
+  if (e->vertexCapacity > capacity) {
+    // Let Emitter_Draw allocate a matching quad buffer.
+    PARTIKEL_FREE(e->vertices);
+    e->vertices = NULL;
+    e->vertexCapacity = 0;
+  }
+  return true;
+}
+
+// Emitter_resize moves the particles into new storage for capacity
+// particles, which must hold all live ones. Returns false if there is not
+// enough memory.
+static bool Emitter_resize(Emitter *e, size_t capacity) {
+  return Emitter_relayout(e, capacity, e->particles.layout);
+}
+
+// Emitter_autoCapacity returns the storage an Emitter with autoCapacity
+// starts with.
+static size_t Emitter_autoCapacity(const EmitterConfig *cfg) {
+  return cfg->capacity < PARTIKEL_AUTO_MIN_CAPACITY
+             ? cfg->capacity
+             : PARTIKEL_AUTO_MIN_CAPACITY;
+}
+
+// Emitter_grow makes room for n more particles if the Emitter uses
+// autoCapacity. The storage at least doubles, so growing is amortized.
+static void Emitter_grow(Emitter *e, size_t n) {
+  if (!e->config.autoCapacity || e->pooled ||
+      e->particles.capacity >= e->config.capacity) {
+    return;
+  }
+  size_t capacity = 2 * e->particles.capacity;
+  if (capacity < e->length + n) {
+    capacity = e->length + n;
+  }
+  if (capacity > e->config.capacity) {
+    capacity = e->config.capacity;
+  }
+  Emitter_resize(e, capacity);
+}
+
+// Emitter_trackDemand records the peak amount of live particles. At the
+// end of each window of PARTIKEL_AUTO_WINDOW seconds an Emitter with
+// autoCapacity returns memory if it used at most a quarter of it.
+static void Emitter_trackDemand(Emitter *e, float dt) {
+  if (e->length > e->peakLength) {
+    e->peakLength = e->length;
+  }
+  e->windowAge += dt;
+  if (e->windowAge < PARTIKEL_AUTO_WINDOW) {
+    return;
+  }
+  size_t capacity = 2 * e->peakLength;
+  if (capacity < Emitter_autoCapacity(&e->config)) {
+    capacity = Emitter_autoCapacity(&e->config);
+  }
+  if (e->config.autoCapacity && !e->pooled &&
+      4 * e->peakLength <= e->particles.capacity &&
+      capacity < e->particles.capacity) {
+    Emitter_resize(e, capacity);
+  }
+  e->peakLength = e->length;
+  e->windowAge = 0;
+}
+
+// Amount of particles Emitter_spawnParticles initializes at once.
+#define PARTIKEL_SPAWN_BLOCK 64
+
+// partikel_sinCos computes sine and cosine of an angle in degrees in single
+// precision. It has no calls or branches, so loops using it vectorize. The
+// error stays around 1e-6 for angles within a few turns. Like the rest of the
+// library it must not be compiled with -ffast-math, which breaks the
+// rounding trick.
+PARTIKEL_INLINE void partikel_sinCos(float degrees, float *s, float *c) {
+  // Split into a quadrant q and a remainder r within [-45, 45] degrees.
+  float x = degrees * (1.0f / 90.0f);
+  float rounded = (x + 12582912.0f) - 12582912.0f; // 1.5 * 2^23
+  int q = (int)rounded;
+  float r = (x - rounded) * (90.0f * DEG2RAD);
+  float r2 = r * r;
+  float sr =
+      r * (1 + r2 * (-1.0f / 6 + r2 * (1.0f / 120 + r2 * (-1.0f / 5040))));
+  float cr =
+      1 + r2 * (-0.5f +
+                r2 * (1.0f / 24 + r2 * (-1.0f / 720 + r2 * (1.0f / 40320))));
+  float sq = (q & 1) ? cr : sr;
+  float cq = (q & 1) ? sr : cr;
+  *s = (q & 2) ? -sq : sq;
+  *c = ((q + 1) & 2) ? -cq : cq;
+}
+
+// partikel_fillAngles writes n random angles from range to out. A fixed
+// range consumes no random numbers.
+static void partikel_fillAngles(RandomStream *r, float *out, size_t n,
+                                FloatRange range) {
+  if (range.min == range.max) {
+    for (size_t j = 0; j < n; j++) {
+      out[j] = range.min;
+    }
+  } else {
+    RandomStream_Fill(r, out, n, range.min, range.max);
+  }
+}
+
+// Emitter_spawnBlock initializes the n <= PARTIKEL_SPAWN_BLOCK particles
+// starting at slot i. All random values of a kind are drawn at once and the
+// direction and velocity rotations are fused into one rotation each:
+// rotating direction by a and then by b equals rotating it by a + b.
+PARTIKEL_INLINE void Emitter_spawnBlock(Emitter *e, size_t i, size_t n) {
+  const EmitterConfig *cfg = &e->config;
+  ParticleData *d = &e->particles;
+  RandomStream *r = &e->random;
+  float dx = cfg->direction.x;
+  float dy = cfg->direction.y;
+  float ox = cfg->origin.x;
+  float oy = cfg->origin.y;
+
+  // Local arrays do not alias the particle arrays, which lets the compiler
+  // vectorize the loops below.
+  float speed[PARTIKEL_SPAWN_BLOCK];
+  float offset[PARTIKEL_SPAWN_BLOCK];
+  float posX[PARTIKEL_SPAWN_BLOCK];
+  float posY[PARTIKEL_SPAWN_BLOCK];
+  float velX[PARTIKEL_SPAWN_BLOCK];
+  float velY[PARTIKEL_SPAWN_BLOCK];
+
+  RandomStream_Fill(r, speed, n, cfg->velocity.min, cfg->velocity.max);
+  RandomStream_Fill(r, offset, n, cfg->offset.min, cfg->offset.max);
+  if (d->originAcceleration != NULL) {
+    RandomStream_Fill(r, d->originAcceleration + i, n,
+                      cfg->originAcceleration.min,
+                      cfg->originAcceleration.max);
+  }
+  if (d->ttl != NULL) {
+    RandomStream_Fill(r, d->ttl + i, n, cfg->age.min, cfg->age.max);
+  } else {
+    float ttl[PARTIKEL_SPAWN_BLOCK];
+    uint16_t half[PARTIKEL_SPAWN_BLOCK];
+    RandomStream_Fill(r, ttl, n, cfg->age.min, cfg->age.max);
+    for (size_t j = 0; j < n; j++) {
+      half[j] = partikel_toHalf(ttl[j]);
+    }
+    memcpy(d->halfTtl + i, half, n * sizeof(uint16_t));
+  }
+
+  if (cfg->directionAngle.min == cfg->directionAngle.max &&
+      cfg->velocityAngle.min == cfg->velocityAngle.max) {
+    // Both angles are fixed, so every particle shares the same rotations.
+    float sa, ca, sv, cv;
+    partikel_sinCos(cfg->directionAngle.min, &sa, &ca);
+    partikel_sinCos(cfg->directionAngle.min + cfg->velocityAngle.min, &sv,
+                    &cv);
+    float ax = ca * dx - sa * dy;
+    float ay = sa * dx + ca * dy;
+    float vx = cv * dx - sv * dy;
+    float vy = sv * dx + cv * dy;
+    for (size_t j = 0; j < n; j++) {
+      posX[j] = ox + ax * offset[j];
+      posY[j] = oy + ay * offset[j];
+      velX[j] = vx * speed[j];
+      velY[j] = vy * speed[j];
+    }
+  } else {
+    float dirAngle[PARTIKEL_SPAWN_BLOCK];
+    float velAngle[PARTIKEL_SPAWN_BLOCK];
+    partikel_fillAngles(r, dirAngle, n, cfg->directionAngle);
+    partikel_fillAngles(r, velAngle, n, cfg->velocityAngle);
+    for (size_t j = 0; j < n; j++) {
+      float sa, ca, sv, cv;
+      partikel_sinCos(dirAngle[j], &sa, &ca);
+      partikel_sinCos(dirAngle[j] + velAngle[j], &sv, &cv);
+      posX[j] = ox + (ca * dx - sa * dy) * offset[j];
+      posY[j] = oy + (sa * dx + ca * dy) * offset[j];
+      velX[j] = (cv * dx - sv * dy) * speed[j];
+      velY[j] = (sv * dx + cv * dy) * speed[j];
+    }
+  }
+
+  memcpy(d->posX + i, posX, n * sizeof(float));
+  memcpy(d->posY + i, posY, n * sizeof(float));
+  if (d->prevX != NULL) {
+    memcpy(d->prevX + i, posX, n * sizeof(float));
+    memcpy(d->prevY + i, posY, n * sizeof(float));
+  }
+  if (d->velX != NULL) {
+    memcpy(d->velX + i, velX, n * sizeof(float));
+    memcpy(d->velY + i, velY, n * sizeof(float));
+  } else {
+    uint16_t halfX[PARTIKEL_SPAWN_BLOCK];
+    uint16_t halfY[PARTIKEL_SPAWN_BLOCK];
+    for (size_t j = 0; j < n; j++) {
+      halfX[j] = partikel_toHalf(velX[j]);
+      halfY[j] = partikel_toHalf(velY[j]);
+    }
+    memcpy(d->halfVelX + i, halfX, n * sizeof(uint16_t));
+    memcpy(d->halfVelY + i, halfY, n * sizeof(uint16_t));
+  }
+  if (d->originX != NULL) {
+    for (size_t j = i; j < i + n; j++) {
+      d->originX[j] = ox;
+    }
+    for (size_t j = i; j < i + n; j++) {
+      d->originY[j] = oy;
+    }
+  }
+  for (size_t j = i; j < i + n; j++) {
+    d->born[j] = e->clock;
+  }
+}
+
+// Emitter_spawnParticles appends up to n new particles behind the live
+// range and returns how many were actually spawned.
+static size_t Emitter_spawnParticles(Emitter *e, size_t n) {
+  if (n > e->particles.capacity - e->length) {
+    Emitter_grow(e, n);
+  }
+  size_t room = e->particles.capacity - e->length;
+  if (n > room) {
+    n = room;
+  }
+  size_t i = e->length;
+  size_t end = e->length + n;
+  for (; i + PARTIKEL_SPAWN_BLOCK <= end; i += PARTIKEL_SPAWN_BLOCK) {
+    Emitter_spawnBlock(e, i, PARTIKEL_SPAWN_BLOCK);
+  }
+  if (i < end) {
+    Emitter_spawnBlock(e, i, end - i);
+  }
+  e->length = end;
+  PARTIKEL_STAT(e->stats.spawned += n;)
+  return n;
+}
+
+// Emitter_removeParticle deactivates the particle in slot i by moving the
+// last live particle into its place. This keeps the live range dense.
+static void Emitter_removeParticle(Emitter *e, size_t i) {
+  e->length--;
+  if (i != e->length) {
+    ParticleData_copy(&e->particles, i, &e->particles, e->length, 1);
+  }
+}
+
+// partikel_sampleFloatCurve evaluates a sorted, piecewise linear curve.
+static float partikel_sampleFloatCurve(const FloatStop *stops, size_t length,
+                                       float t, float fallback) {
+  if (length == 0) {
+    return fallback;
+  }
+  if (t <= stops[0].time) {
+    return stops[0].value;
+  }
+  for (size_t i = 1; i < length; i++) {
+    if (t <= stops[i].time) {
+      float span = stops[i].time - stops[i - 1].time;
+      float f = span > 0 ? (t - stops[i - 1].time) / span : 1;
+      return stops[i - 1].value + (stops[i].value - stops[i - 1].value) * f;
+    }
+  }
+  return stops[length - 1].value;
+}
+
+// partikel_sampleColorCurve evaluates a sorted, piecewise linear gradient.
+static Color partikel_sampleColorCurve(const ColorStop *stops, size_t length,
+                                       float t) {
+  if (t <= stops[0].time) {
+    return stops[0].color;
+  }
+  for (size_t i = 1; i < length; i++) {
+    if (t <= stops[i].time) {
+      float span = stops[i].time - stops[i - 1].time;
+      float f = span > 0 ? (t - stops[i - 1].time) / span : 1;
+      return LinearFade(stops[i - 1].color, stops[i].color, f);
+    }
+  }
+  return stops[length - 1].color;
+}
+
+// Emitter_bakeCurves fills the lookup tables from the config.
+static void Emitter_bakeCurves(Emitter *e) {
+  const EmitterConfig *cfg = &e->config;
+  e->offset.x = 0.5f * (float)cfg->texture.width;
+  e->offset.y = 0.5f * (float)cfg->texture.height;
+
+  e->extent = (Vector2){.x = 0, .y = 0};
+  for (int i = 0; i < PARTIKEL_LUT_SIZE; i++) {
+    float t = (float)i / (PARTIKEL_LUT_SIZE - 1);
+
+    Color c = LinearFade(cfg->startColor, cfg->endColor, t);
+    if (cfg->colorCurveLength > 0) {
+      c = partikel_sampleColorCurve(cfg->colorCurve, cfg->colorCurveLength, t);
+    }
+    if (cfg->alphaCurveLength > 0) {
+      float a = partikel_sampleFloatCurve(cfg->alphaCurve,
+                                          cfg->alphaCurveLength, t, 1);
+      c.a = (unsigned char)(255.0f * (a < 0 ? 0 : a > 1 ? 1 : a) + 0.5f);
+    }
+    e->colorLut[i] = c;
+
+    float size =
+        partikel_sampleFloatCurve(cfg->sizeCurve, cfg->sizeCurveLength, t, 1);
+    float rad = DEG2RAD * partikel_sampleFloatCurve(cfg->rotationCurve,
+                                                    cfg->rotationCurveLength,
+                                                    t, 0);
+    float cs = cosf(rad) * size;
+    float sn = sinf(rad) * size;
+    e->axisXLut[i] = (Vector2){.x = cs * e->offset.x, .y = sn * e->offset.x};
+    e->axisYLut[i] = (Vector2){.x = -sn * e->offset.y, .y = cs * e->offset.y};
+    Vector2 ax = e->axisXLut[i];
+    Vector2 ay = e->axisYLut[i];
+    e->extent.x = fmaxf(e->extent.x, fabsf(ax.x) + fabsf(ay.x));
+    e->extent.y = fmaxf(e->extent.y, fabsf(ax.y) + fabsf(ay.y));
+  }
+}
+
+// Emitter_selectIntegrator picks the kernel for the current config. Terms
+// that the config zeroes are left out entirely. The choice is made once
+// here instead of branching per particle.
+static void Emitter_selectIntegrator(Emitter *e) {
+  bool pull = e->config.originAcceleration.min != 0 ||
+              e->config.originAcceleration.max != 0;
+  bool gravity = e->config.externalAcceleration.x != 0 ||
+                 e->config.externalAcceleration.y != 0;
+  e->integrate = partikel_integrators()[pull * 2 + gravity];
+}
+
+// Seconds after which the clock of an Emitter restarts at 0. At 256 s a
+// float still resolves 30 microseconds.
+#define PARTIKEL_CLOCK_EPOCH 256.0f
+
+// Emitter_restartClock sets the clock to 0 before it loses precision.
+static void Emitter_restartClock(Emitter *e) {
+  for (size_t i = 0; i < e->length; i++) {
+    e->particles.born[i] -= e->clock;
+  }
+  e->clock = 0;
+}
+
+// Emitter_emit spawns the particles due within the next dt seconds and
+// advances the clock of the Emitter. Analytic particles are born when they
+// are due within the update, as if emitted continuously, so their motion
+// does not depend on how time is split into updates.
+static void Emitter_emit(Emitter *e, float dt) {
+  if (e->clock >= PARTIKEL_CLOCK_EPOCH) {
+    Emitter_restartClock(e);
+  }
+  if (e->isEmitting) {
+    float rate = (float)e->config.emissionRate;
+    float owed = e->mustEmit;
+    e->mustEmit += dt * rate;
+    size_t emitNow = (size_t)e->mustEmit; // floor
+    // New particles are appended and updated together with the others.
+    size_t first = e->length;
+    size_t spawned = Emitter_spawnParticles(e, emitNow);
+    e->mustEmit -= (float)spawned;
+    PARTIKEL_STAT(e->stats.saturated += spawned < emitNow;)
+    if (e->analytic && rate > 0) {
+      // The j-th new particle was due once owed + rate * t reached j + 1.
+      // Particles owed from earlier updates, as when the Emitter was full,
+      // are born at its start instead of in the past.
+      float *born = e->particles.born + first;
+      for (size_t j = 0; j < spawned; j++) {
+        float t = ((float)j + 1 - owed) / rate;
+        t = t > 0 ? t : 0;
+        born[j] = e->clock + (t < dt ? t : dt);
+      }
+    }
+  }
+  e->clock += dt;
+  Emitter_trackDemand(e, dt);
+}
+
+// Amount of particles Emitter_markDead evaluates at once. The fixed size
+// lets compilers vectorize the rule loops even at -O2.
+#define PARTIKEL_KILL_BLOCK 64
+
+// Emitter_markBlock applies the ttl check (or keeps the flags in dead if
+// byTtl is false), the kill bounds and the kill planes to n <=
+// PARTIKEL_KILL_BLOCK particles.
+PARTIKEL_INLINE void Emitter_markBlock(const EmitterConfig *cfg,
+                                       const float *posX, const float *posY,
+                                       const float *age, const float *ttl,
+                                       unsigned char *dead, size_t n,
+                                       bool byTtl, bool bounds) {
+  // Collecting the flags in a local array tells the compiler that they do
+  // not alias the particle arrays.
+  unsigned char kill[PARTIKEL_KILL_BLOCK];
+
+  if (byTtl) {
+    for (size_t j = 0; j < n; j++) {
+      kill[j] = age[j] > ttl[j];
+    }
+  } else {
+    memcpy(kill, dead, n);
+  }
+
+  if (bounds) {
+    float minX = cfg->killBounds.x;
+    float minY = cfg->killBounds.y;
+    float maxX = minX + cfg->killBounds.width;
+    float maxY = minY + cfg->killBounds.height;
+    for (size_t j = 0; j < n; j++) {
+      kill[j] |= (posX[j] < minX) | (posX[j] > maxX) | (posY[j] < minY) |
+                 (posY[j] > maxY);
+    }
+  }
+
+  for (size_t k = 0; k < cfg->killPlaneCount; k++) {
+    float nx = cfg->killPlanes[k].normal.x;
+    float ny = cfg->killPlanes[k].normal.y;
+    float distance = cfg->killPlanes[k].distance;
+    for (size_t j = 0; j < n; j++) {
+      kill[j] |= nx * posX[j] + ny * posY[j] > distance;
+    }
+  }
+
+  memcpy(dead, kill, n);
+}
+
+// Emitter_loadBlock writes the ages and ttls of the n particles starting
+// at slot i to age and ttl and returns the latter. Float ttls are
+// returned in place.
+PARTIKEL_INLINE const float *Emitter_loadBlock(const Emitter *e, size_t i,
+                                               size_t n, float *age,
+                                               float *ttl) {
+  const ParticleData *d = &e->particles;
+  const float *born = d->born + i;
+  for (size_t j = 0; j < n; j++) {
+    age[j] = e->clock - born[j];
+  }
+  if (d->ttl != NULL) {
+    return d->ttl + i;
+  }
+  for (size_t j = 0; j < n; j++) {
+    ttl[j] = partikel_fromHalf(d->halfTtl[i + j]);
+  }
+  return ttl;
+}
+
+// Emitter_loadVelocities points vx and vy to the velocities of the n
+// particles starting at slot i. Half floats are decoded into bufX and
+// bufY, float velocities are used in place.
+PARTIKEL_INLINE void Emitter_loadVelocities(const Emitter *e, size_t i,
+                                            size_t n, const float **vx,
+                                            const float **vy, float *bufX,
+                                            float *bufY) {
+  const ParticleData *d = &e->particles;
+  if (d->velX != NULL) {
+    *vx = d->velX + i;
+    *vy = d->velY + i;
+    return;
+  }
+  for (size_t j = 0; j < n; j++) {
+    bufX[j] = partikel_fromHalf(d->halfVelX[i + j]);
+    bufY[j] = partikel_fromHalf(d->halfVelY[i + j]);
+  }
+  *vx = bufX;
+  *vy = bufY;
+}
+
+// Emitter_markAnalyticBlock evaluates the age and, if kill rules need
+// them, the positions of the n <= PARTIKEL_KILL_BLOCK particles of an
+// analytic Emitter starting at slot i and applies the rules to them.
+PARTIKEL_INLINE void Emitter_markAnalyticBlock(Emitter *e, size_t i, size_t n,
+                                               bool positions, bool bounds) {
+  ParticleData *d = &e->particles;
+  float hx = 0.5f * e->config.externalAcceleration.x;
+  float hy = 0.5f * e->config.externalAcceleration.y;
+  float age[PARTIKEL_KILL_BLOCK];
+  float ttl[PARTIKEL_KILL_BLOCK];
+  float posX[PARTIKEL_KILL_BLOCK];
+  float posY[PARTIKEL_KILL_BLOCK];
+
+  const float *ttls = Emitter_loadBlock(e, i, n, age, ttl);
+  if (positions) {
+    const float *x0 = d->posX + i;
+    const float *y0 = d->posY + i;
+    const float *vx;
+    const float *vy;
+    float bufX[PARTIKEL_KILL_BLOCK];
+    float bufY[PARTIKEL_KILL_BLOCK];
+    Emitter_loadVelocities(e, i, n, &vx, &vy, bufX, bufY);
+    for (size_t j = 0; j < n; j++) {
+      posX[j] = x0[j] + (vx[j] + hx * age[j]) * age[j];
+      posY[j] = y0[j] + (vy[j] + hy * age[j]) * age[j];
+    }
+  }
+  Emitter_markBlock(&e->config, posX, posY, age, ttls, d->dead + i, n, true,
+                    bounds);
+}
+
+// Emitter_markStepBlock applies the rules to the n <= PARTIKEL_KILL_BLOCK
+// particles of an Emitter that is not analytic starting at slot i.
+PARTIKEL_INLINE void Emitter_markStepBlock(Emitter *e, size_t i, size_t n,
+                                           bool byTtl, bool bounds) {
+  ParticleData *d = &e->particles;
+  float age[PARTIKEL_KILL_BLOCK];
+  float ttl[PARTIKEL_KILL_BLOCK];
+  const float *ttls = Emitter_loadBlock(e, i, n, age, ttl);
+  Emitter_markBlock(&e->config, d->posX + i, d->posY + i, age, ttls,
+                    d->dead + i, n, byTtl, bounds);
+}
+
+// Amount of particles handed to batch deactivators and sortKeys at once.
+#define PARTIKEL_SPAN_BLOCK 256
+
+// Emitter_loadSpan makes span refer to the n <= PARTIKEL_SPAN_BLOCK
+// particles starting at slot i. Their ages and ttls are written to age
+// and ttl. The Emitter must not be analytic.
+static void Emitter_loadSpan(const Emitter *e, size_t i, size_t n,
+                             float *age, float *ttl, ParticleSpan *span) {
+  const ParticleData *d = &e->particles;
+  *span = (ParticleSpan){.length = n,
+                         .posX = d->posX + i,
+                         .posY = d->posY + i,
+                         .velX = d->velX + i,
+                         .velY = d->velY + i,
+                         .age = age,
+                         .ttl = Emitter_loadBlock(e, i, n, age, ttl),
+                         .dead = d->dead + i};
+}
+
+// Emitter_markDead flags all particles in [begin, end) that are to be
+// deactivated in d->dead. The declarative rules are evaluated branch-free
+// on whole blocks of particles, which compilers turn into SIMD code.
+static void Emitter_markDead(Emitter *e, size_t begin, size_t end) {
+  const EmitterConfig *cfg = &e->config;
+  ParticleData *d = &e->particles;
+  bool byTtl = cfg->particle_Deactivator == NULL ||
+               cfg->particle_Deactivator == Particle_DeactivatorAge;
+  bool bounds = cfg->killBounds.width > 0 && cfg->killBounds.height > 0;
+
+  if (!byTtl) {
+    for (size_t i = begin; i < end; i++) {
+      Particle p;
+      Emitter_loadParticle(e, i, &p);
+      d->dead[i] = cfg->particle_Deactivator(&p);
+    }
+  }
+
+  if (e->analytic) {
+    bool positions = bounds || cfg->killPlaneCount > 0;
+    size_t i = begin;
+    for (; i + PARTIKEL_KILL_BLOCK <= end; i += PARTIKEL_KILL_BLOCK) {
+      Emitter_markAnalyticBlock(e, i, PARTIKEL_KILL_BLOCK, positions, bounds);
+    }
+    Emitter_markAnalyticBlock(e, i, end - i, positions, bounds);
+    return;
+  }
+
+  size_t i = begin;
+  for (; i + PARTIKEL_KILL_BLOCK <= end; i += PARTIKEL_KILL_BLOCK) {
+    Emitter_markStepBlock(e, i, PARTIKEL_KILL_BLOCK, byTtl, bounds);
+  }
+  Emitter_markStepBlock(e, i, end - i, byTtl, bounds);
+
+  if (cfg->particle_DeactivatorBatch != NULL) {
+    float spanAge[PARTIKEL_SPAN_BLOCK];
+    float spanTtl[PARTIKEL_SPAN_BLOCK];
+    for (size_t i = begin; i < end; i += PARTIKEL_SPAN_BLOCK) {
+      size_t n = end - i < PARTIKEL_SPAN_BLOCK ? end - i : PARTIKEL_SPAN_BLOCK;
+      ParticleSpan span;
+      Emitter_loadSpan(e, i, n, spanAge, spanTtl, &span);
+      cfg->particle_DeactivatorBatch(&span, cfg->deactivatorData);
+    }
+  }
+}
+
+// Emitter_forceBlock applies the force fields of the ParticleSystem acting
+// on the Emitter to the velocities of the n <= PARTIKEL_FORCE_BLOCK
+// particles starting at slot i.
+PARTIKEL_INLINE void Emitter_forceBlock(const Emitter *e, size_t i, size_t n,
+                                        float dt) {
+  const ParticleForces *pf = e->forces;
+  uint32_t layers = e->config.forceLayers;
+  const ParticleData *d = &e->particles;
+  const float *x = d->posX + i;
+  const float *y = d->posY + i;
+  // Local arrays tell the compiler that they do not alias the particles.
+  float ax[PARTIKEL_FORCE_BLOCK];
+  float ay[PARTIKEL_FORCE_BLOCK];
+  float vx[PARTIKEL_FORCE_BLOCK];
+  float vy[PARTIKEL_FORCE_BLOCK];
+
+  if (pf->gridReady) {
+    ParticleForces_sampleBlock(pf, x, y, ax, ay, n);
+  } else {
+    memset(ax, 0, n * sizeof(float));
+    memset(ay, 0, n * sizeof(float));
+  }
+  for (size_t k = 0; k < pf->length; k++) {
+    const ForceField *f = &pf->fields[k];
+    if ((f->layers & layers) != 0 && ForceField_isPull(f) &&
+        !ForceField_onGrid(pf, f)) {
+      ForceField_pull(f, x, y, ax, ay, n);
+    }
+  }
+  for (size_t j = 0; j < n; j++) {
+    vx[j] = d->velX[i + j] + ax[j] * dt;
+    vy[j] = d->velY[i + j] + ay[j] * dt;
+  }
+  for (size_t k = 0; k < pf->length; k++) {
+    const ForceField *f = &pf->fields[k];
+    if ((f->layers & layers) != 0 && !ForceField_isPull(f)) {
+      ForceField_blend(f, x, y, vx, vy, n, dt);
+    }
+  }
+  memcpy(d->velX + i, vx, n * sizeof(float));
+  memcpy(d->velY + i, vy, n * sizeof(float));
+}
+
+// Emitter_applyForces applies the force fields of the ParticleSystem
+// acting on the Emitter to the particles in [begin, end).
+static void Emitter_applyForces(Emitter *e, size_t begin, size_t end,
+                                float dt) {
+  size_t i = begin;
+  for (; i + PARTIKEL_FORCE_BLOCK <= end; i += PARTIKEL_FORCE_BLOCK) {
+    Emitter_forceBlock(e, i, PARTIKEL_FORCE_BLOCK, dt);
+  }
+  Emitter_forceBlock(e, i, end - i, dt);
+}
+
+// Emitter_collide lets the particles in [begin, end) bounce off the
+// colliders of the ParticleSystem, each testing only the colliders listed
+// in the grid cells its step touches. A step leads from pos - vel * dt to
+// pos. Only segments are tested along the whole step, so particles moving
+// further than the size of a rectangle or circle per step may pass
+// through it. A collider in several of the cells is tested again, which
+// changes nothing once the particle was moved out of it.
+static void Emitter_collide(Emitter *e, size_t begin, size_t end, float dt) {
+  const ParticleColliders *pc = e->colliders;
+  const ParticleGrid *g = &pc->grid;
+  const uint32_t *cellStart = g->cellStart;
+  float gridRight = g->origin.x + (float)g->columns * g->cellSize;
+  float gridBottom = g->origin.y + (float)g->rows * g->cellSize;
+  ParticleData *d = &e->particles;
+  for (size_t i = begin; i < end; i++) {
+    if (d->dead[i]) {
+      continue;
+    }
+    Vector2 pos = {.x = d->posX[i], .y = d->posY[i]};
+    Vector2 vel = {.x = d->velX[i], .y = d->velY[i]};
+    Vector2 old = {.x = pos.x - vel.x * dt, .y = pos.y - vel.y * dt};
+    float minX = old.x < pos.x ? old.x : pos.x;
+    float minY = old.y < pos.y ? old.y : pos.y;
+    float maxX = old.x < pos.x ? pos.x : old.x;
+    float maxY = old.y < pos.y ? pos.y : old.y;
+    // Steps missing the grid cannot hit anything. NaNs miss it, too.
+    if (!(maxX >= g->origin.x && minX <= gridRight && maxY >= g->origin.y &&
+          minY <= gridBottom)) {
+      continue;
+    }
+    int c0 = ParticleGrid_column(g, minX);
+    int c1 = ParticleGrid_column(g, maxX);
+    int r0 = ParticleGrid_row(g, minY);
+    int r1 = ParticleGrid_row(g, maxY);
+    for (int r = r0; r <= r1; r++) {
+      for (int cl = c0; cl <= c1; cl++) {
+        long cell = (long)r * g->columns + cl;
+        for (uint32_t k = cellStart[cell]; k < cellStart[cell + 1]; k++) {
+          const Collider *c = &pc->colliders[pc->entries[k]];
+          Vector2 n;
+          if (!Collider_resolve(c, old, &pos, &n)) {
+            continue;
+          }
+          // Reflect the speed towards the surface and damp the speed along
+          // it.
+          float into = vel.x * n.x + vel.y * n.y;
+          if (into < 0) {
+            vel.x -= (1 + c->restitution) * into * n.x;
+            vel.y -= (1 + c->restitution) * into * n.y;
+          }
+          float along = vel.x * n.y - vel.y * n.x;
+          vel.x -= c->friction * along * n.y;
+          vel.y += c->friction * along * n.x;
+        }
+      }
+    }
+    d->posX[i] = pos.x;
+    d->posY[i] = pos.y;
+    d->velX[i] = vel.x;
+    d->velY[i] = vel.y;
+  }
+}
+
+// Emitter_step flags the particles in [begin, end) to be deactivated in
+// d->dead and integrates all of them by dt. Emitter_emit already advanced
+// the clock their age is measured on. It touches no state outside of its
+// range, so disjoint ranges may be stepped concurrently. Custom
+// deactivator functions must allow that, too.
+static void Emitter_step(Emitter *e, size_t begin, size_t end, float dt) {
+  ParticleData *d = &e->particles;
+
+  // Analytic particles do not change over time, only their clock advances
+  // (in Emitter_emit). Just find the expired ones.
+  if (e->analytic) {
+    Emitter_markDead(e, begin, end);
+    return;
+  }
+
+  // Deactivation runs before integration, so it sees the same state as
+  // Particle_Update.
+  Emitter_markDead(e, begin, end);
+
+  // Keep the state before this step for interpolated drawing.
+  if (e->interpolate) {
+    memcpy(d->prevX + begin, d->posX + begin, (end - begin) * sizeof(float));
+    memcpy(d->prevY + begin, d->posY + begin, (end - begin) * sizeof(float));
+  }
+
+  // Force fields change the velocities the integration starts from.
+  if (e->config.forceLayers != 0 && e->forces != NULL &&
+      e->forces->length > 0) {
+    Emitter_applyForces(e, begin, end, dt);
+  }
+
+  // Flagged particles are integrated, too. That is cheaper than branching
+  // and they are removed right after anyway.
+  e->integrate(d, begin, end, e->config.externalAcceleration, dt);
+
+  if (e->config.collide && e->colliders != NULL && e->colliders->ready) {
+    Emitter_collide(e, begin, end, dt);
+  }
+}
+
+// Emitter_compactOrdered removes all particles flagged by Emitter_step and
+// keeps the others in order. Runs of live particles move at once.
+static void Emitter_compactOrdered(Emitter *e) {
+  ParticleData *d = &e->particles;
+  size_t i = 0;
+  while (i < e->length && !d->dead[i]) {
+    i++;
+  }
+  size_t length = i;
+  while (i < e->length) {
+    if (d->dead[i]) {
+      i++;
+      continue;
+    }
+    size_t run = i;
+    while (i < e->length && !d->dead[i]) {
+      i++;
+    }
+    ParticleData_copy(d, length, d, run, i - run);
+    length += i - run;
+  }
+  e->length = length;
+}
+
+// Emitter_compact removes all particles flagged by Emitter_step. Sorted
+// Emitters keep the spawn order, so their draw order needs no sort in
+// most frames.
+static void Emitter_compact(Emitter *e) {
+  const ParticleData *d = &e->particles;
+  PARTIKEL_STAT(size_t length = e->length;)
+  size_t i = 0;
+  if (e->config.sortMode != PARTICLE_SORT_NONE) {
+    Emitter_compactOrdered(e);
+    i = e->length;
+  }
+  while (i < e->length) {
+    if (d->dead[i]) {
+      // Slot i now holds the former last particle, which is not yet checked.
+      Emitter_removeParticle(e, i);
+      continue;
+    }
+    i++;
+  }
+  PARTIKEL_STAT(
+      e->stats.deactivated += length - e->length;
+      if (e->length > e->stats.peakLength) {
+        e->stats.peakLength = e->length;
+      })
+}
+
+// Emitter_useAnalytic returns whether an Emitter with config cfg runs in
+// analytic mode.
+static bool Emitter_useAnalytic(const EmitterConfig *cfg) {
+  return cfg->analytic && !cfg->collide && cfg->forceLayers == 0 &&
+         cfg->sortMode != PARTICLE_SORT_KEY &&
+         cfg->originAcceleration.min == 0 &&
+         cfg->originAcceleration.max == 0 &&
+         (cfg->particle_Deactivator == NULL ||
+          cfg->particle_Deactivator == Particle_DeactivatorAge) &&
+         cfg->particle_DeactivatorBatch == NULL;
+}
+
+// Emitter_enterAnalytic turns the current state of all particles into the
+// spawn state that leads to it under the external acceleration.
+static void Emitter_enterAnalytic(Emitter *e) {
+  ParticleData *d = &e->particles;
+  float ax = e->config.externalAcceleration.x;
+  float ay = e->config.externalAcceleration.y;
+  for (size_t i = 0; i < e->length; i++) {
+    float t = e->clock - d->born[i];
+    Vector2 v = Emitter_velocity(e, i);
+    d->posX[i] += (0.5f * ax * t - v.x) * t;
+    d->posY[i] += (0.5f * ay * t - v.y) * t;
+    Emitter_setVelocity(e, i, (Vector2){.x = v.x - ax * t, .y = v.y - ay * t});
+  }
+  e->analytic = true;
+}
+
+// Emitter_leaveAnalytic evaluates the current state of all particles from
+// their spawn state.
+static void Emitter_leaveAnalytic(Emitter *e) {
+  ParticleData *d = &e->particles;
+  float ax = e->config.externalAcceleration.x;
+  float ay = e->config.externalAcceleration.y;
+  for (size_t i = 0; i < e->length; i++) {
+    float t = e->clock - d->born[i];
+    Vector2 v = Emitter_velocity(e, i);
+    d->posX[i] += (v.x + 0.5f * ax * t) * t;
+    d->posY[i] += (v.y + 0.5f * ay * t) * t;
+    Emitter_setVelocity(e, i, (Vector2){.x = v.x + ax * t, .y = v.y + ay * t});
+  }
+  if (d->prevX != NULL) {
+    memcpy(d->prevX, d->posX, e->length * sizeof(float));
+    memcpy(d->prevY, d->posY, e->length * sizeof(float));
+  }
+  e->analytic = false;
+}
+
+// Emitter_position returns the current position of particle i.
+static Vector2 Emitter_position(const Emitter *e, size_t i) {
+  const ParticleData *d = &e->particles;
+  if (!e->analytic) {
+    return (Vector2){.x = d->posX[i], .y = d->posY[i]};
+  }
+  Vector2 a = e->config.externalAcceleration;
+  Vector2 v = Emitter_velocity(e, i);
+  float t = e->clock - d->born[i];
+  return (Vector2){.x = d->posX[i] + (v.x + 0.5f * a.x * t) * t,
+                   .y = d->posY[i] + (v.y + 0.5f * a.y * t) * t};
+}
+
+// Amount of independent minimum and maximum lanes of
+// Emitter_updateBounds. They let compilers vectorize the search.
+#define PARTIKEL_BOUNDS_LANES 16
+
+// Emitter_boundPositions widens the lanes of min and max by the n
+// positions in xs and ys.
+static void Emitter_boundPositions(const float *xs, const float *ys, size_t n,
+                                   float *minX, float *minY, float *maxX,
+                                   float *maxY) {
+  size_t i = 0;
+  for (; i + PARTIKEL_BOUNDS_LANES <= n; i += PARTIKEL_BOUNDS_LANES) {
+    for (size_t j = 0; j < PARTIKEL_BOUNDS_LANES; j++) {
+      float x = xs[i + j];
+      float y = ys[i + j];
+      minX[j] = x < minX[j] ? x : minX[j];
+      minY[j] = y < minY[j] ? y : minY[j];
+      maxX[j] = x > maxX[j] ? x : maxX[j];
+      maxY[j] = y > maxY[j] ? y : maxY[j];
+    }
+  }
+  for (size_t j = 0; i < n; i++, j++) {
+    minX[j] = fminf(minX[j], xs[i]);
+    minY[j] = fminf(minY[j], ys[i]);
+    maxX[j] = fmaxf(maxX[j], xs[i]);
+    maxY[j] = fmaxf(maxY[j], ys[i]);
+  }
+}
+
+// Emitter_updateBounds recomputes the bounds from the live particles and
+// the area around the origin where new particles spawn, grown by the
+// largest quad. With interpolation the previous positions are included,
+// as drawing happens in between.
+static void Emitter_updateBounds(Emitter *e) {
+  const ParticleData *d = &e->particles;
+  const EmitterConfig *cfg = &e->config;
+  float spawn = fmaxf(fabsf(cfg->offset.min), fabsf(cfg->offset.max));
+  float minX[PARTIKEL_BOUNDS_LANES];
+  float minY[PARTIKEL_BOUNDS_LANES];
+  float maxX[PARTIKEL_BOUNDS_LANES];
+  float maxY[PARTIKEL_BOUNDS_LANES];
+  for (size_t j = 0; j < PARTIKEL_BOUNDS_LANES; j++) {
+    minX[j] = cfg->origin.x - spawn;
+    minY[j] = cfg->origin.y - spawn;
+    maxX[j] = cfg->origin.x + spawn;
+    maxY[j] = cfg->origin.y + spawn;
+  }
+
+  Vector2 extent = e->extent;
+  if (e->analytic) {
+    // Bound the positions now and after the next fixed step, between
+    // which they are drawn. A parabola bulges out of the box of its ends
+    // by at most a * step^2 / 8.
+    Vector2 a = e->config.externalAcceleration;
+    float step = e->interpolate ? e->fixedStep : 0;
+    extent.x += 0.125f * fabsf(a.x) * step * step;
+    extent.y += 0.125f * fabsf(a.y) * step * step;
+    float x[PARTIKEL_KILL_BLOCK];
+    float y[PARTIKEL_KILL_BLOCK];
+    float bufX[PARTIKEL_KILL_BLOCK];
+    float bufY[PARTIKEL_KILL_BLOCK];
+    for (size_t i = 0; i < e->length; i += PARTIKEL_KILL_BLOCK) {
+      size_t n = e->length - i < PARTIKEL_KILL_BLOCK ? e->length - i
+                                                     : PARTIKEL_KILL_BLOCK;
+      const float *vx;
+      const float *vy;
+      Emitter_loadVelocities(e, i, n, &vx, &vy, bufX, bufY);
+      for (int k = 0; k < (step > 0 ? 2 : 1); k++) {
+        float time = e->clock + (float)k * step;
+        for (size_t j = 0; j < n; j++) {
+          float t = time - d->born[i + j];
+          x[j] = d->posX[i + j] + (vx[j] + 0.5f * a.x * t) * t;
+          y[j] = d->posY[i + j] + (vy[j] + 0.5f * a.y * t) * t;
+        }
+        Emitter_boundPositions(x, y, n, minX, minY, maxX, maxY);
+      }
+    }
+  } else {
+    Emitter_boundPositions(d->posX, d->posY, e->length, minX, minY, maxX,
+                           maxY);
+    if (e->interpolate) {
+      Emitter_boundPositions(d->prevX, d->prevY, e->length, minX, minY, maxX,
+                             maxY);
+    }
+  }
+  for (size_t j = 1; j < PARTIKEL_BOUNDS_LANES; j++) {
+    minX[0] = fminf(minX[0], minX[j]);
+    minY[0] = fminf(minY[0], minY[j]);
+    maxX[0] = fmaxf(maxX[0], maxX[j]);
+    maxY[0] = fmaxf(maxY[0], maxY[j]);
+  }
+
+  e->bounds = (Rectangle){.x = minX[0] - extent.x,
+                          .y = minY[0] - extent.y,
+                          .width = maxX[0] - minX[0] + 2 * extent.x,
+                          .height = maxY[0] - minY[0] + 2 * extent.y};
+}
+
+// Emitter_includeOrigin grows the bounds by the area particles spawn in
+// around the origin, so an Emitter moved into the view is drawn and
+// updated before its bounds are recomputed.
+static void Emitter_includeOrigin(Emitter *e) {
+  const EmitterConfig *cfg = &e->config;
+  float spawn = fmaxf(fabsf(cfg->offset.min), fabsf(cfg->offset.max));
+  Rectangle b = e->bounds;
+  float minX = fminf(b.x, cfg->origin.x - spawn - e->extent.x);
+  float minY = fminf(b.y, cfg->origin.y - spawn - e->extent.y);
+  float maxX = fmaxf(b.x + b.width, cfg->origin.x + spawn + e->extent.x);
+  float maxY = fmaxf(b.y + b.height, cfg->origin.y + spawn + e->extent.y);
+  e->bounds = (Rectangle){
+      .x = minX, .y = minY, .width = maxX - minX, .height = maxY - minY};
+}
+
+// Emitter_New creates a new Emitter object.
+Emitter *Emitter_New(EmitterConfig cfg) {
+  Emitter *e = PARTIKEL_ALLOC(1, sizeof(Emitter));
+  if (e == NULL) {
+    return NULL;
+  }
+  e->config = cfg;
+  e->analytic = Emitter_useAnalytic(&cfg);
+  size_t capacity =
+      cfg.autoCapacity ? Emitter_autoCapacity(&cfg) : cfg.capacity;
+  if (!ParticleData_alloc(&e->particles, capacity,
+                          Emitter_layout(&cfg, e->analytic, false))) {
+    PARTIKEL_FREE(e);
+    return NULL;
+  }
+  e->mustEmit = 0;
+  Emitter_selectIntegrator(e);
+  Emitter_bakeCurves(e);
+  Emitter_Seed(e, cfg.seed);
+  // Normalize direction for future uses.
+  e->config.direction = NormalizeV2(e->config.direction);
+  Emitter_updateBounds(e);
+
+  return e;
+}
+
+// Emitter_Reinit reinits the given Emitter with a new EmitterConfig.
+// If the capacity shrinks below the amount of live particles, the
+// surplus particles are lost. With autoCapacity the current storage is
+// kept as far as the new capacity allows. If the new config needs other
+// particle arrays, a pooled Emitter gets storage of its own until the
+// next update of its system.
+bool Emitter_Reinit(Emitter *e, EmitterConfig cfg) {
+  bool analytic = Emitter_useAnalytic(&cfg);
+  unsigned int layout = Emitter_layout(&cfg, analytic, e->interpolate);
+  if (e->pooled && layout == e->particles.layout) {
+    // The pool of the system adapts the slots on its next update.
+    if (e->length > cfg.capacity) {
+      e->length = cfg.capacity;
+    }
+    if (e->particles.capacity > cfg.capacity) {
+      e->particles.capacity = cfg.capacity;
+    }
+  } else {
+    size_t capacity = cfg.capacity;
+    if (cfg.autoCapacity) {
+      capacity = e->particles.capacity;
+      if (capacity < Emitter_autoCapacity(&cfg)) {
+        capacity = Emitter_autoCapacity(&cfg);
+      }
+      if (capacity > cfg.capacity) {
+        capacity = cfg.capacity;
+      }
+    }
+    if (capacity != e->particles.capacity || layout != e->particles.layout) {
+      size_t length = e->length;
+      if (e->length > capacity) {
+        e->length = capacity;
+      }
+      if (!Emitter_relayout(e, capacity, layout)) {
+        e->length = length;
+        return false;
+      }
+    }
+  }
+
+  // Set new config. Analytic particles are converted with the old one.
+  if (e->analytic) {
+    Emitter_leaveAnalytic(e);
+  }
+  e->config = cfg;
+  if (analytic) {
+    Emitter_enterAnalytic(e);
+  }
+  Emitter_selectIntegrator(e);
+  Emitter_bakeCurves(e);
+  Emitter_updateBounds(e);
+
+  return true;
+}
+
+// Emitter_Seed restarts the random stream of the Emitter. Two emitters with
+// the same config and seed produce identical particles for identical
+// updates. A seed of 0 draws a seed from raylib's GetRandomValue.
+void Emitter_Seed(Emitter *e, uint64_t seed) {
+  if (seed == 0) {
+    seed = ((uint64_t)(uint32_t)GetRandomValue(0, RAND_MAX) << 32) |
+           (uint32_t)GetRandomValue(0, RAND_MAX);
+  }
+  RandomStream_Seed(&e->random, seed);
+}
+
+// Emitter_Start activates Particle emission.
+void Emitter_Start(Emitter *e) { e->isEmitting = true; }
+
+// Emitter_Start deactivates Particle emission.
+void Emitter_Stop(Emitter *e) { e->isEmitting = false; }
+
+// Emitter_Clear removes all particles and pending emissions at once.
+void Emitter_Clear(Emitter *e) {
+  e->length = 0;
+  e->mustEmit = 0;
+}
+
+// Emitter_Free frees all allocated resources.
+// Deregister the Emitter from its ParticleSystem or free the system first.
+void Emitter_Free(Emitter *e) {
+  ParticleData_free(&e->particles);
+  PARTIKEL_FREE(e->vertices);
+  PARTIKEL_FREE(e->frontVertices);
+  PARTIKEL_FREE(e->sortBuffer);
+  PARTIKEL_FREE(e);
+}
+
+// Emitter_SpawnN spawns up to n particles at once, regardless of the
+// emission rate and whether the Emitter is started. It returns the amount
+// of particles actually spawned, which is limited by the capacity.
+size_t Emitter_SpawnN(Emitter *e, size_t n) {
+  size_t spawned = Emitter_spawnParticles(e, n);
+  PARTIKEL_STAT(e->stats.dropped += n - spawned;)
+  return spawned;
+}
+
+// Emitter_Burst emits a specified amount of particles at once,
+// ignoring the state of e->isEmitting. Use this for singular events
+// instead of continuous output.
+void Emitter_Burst(Emitter *e) {
+  ParticleData *d = &e->particles;
+
+  int amount =
+      RandomStream_Int(&e->random, e->config.burst.min, e->config.burst.max);
+  if (amount <= 0) {
+    return;
+  }
+
+  size_t first = e->length;
+  size_t emitted = Emitter_spawnParticles(e, (size_t)amount);
+  PARTIKEL_STAT(e->stats.dropped += (size_t)amount - emitted;)
+  for (size_t i = first; i < first + emitted; i++) {
+    d->posX[i] = e->config.origin.x;
+    d->posY[i] = e->config.origin.y;
+    if (d->prevX != NULL) {
+      d->prevX[i] = e->config.origin.x;
+      d->prevY[i] = e->config.origin.y;
+    }
+  }
+}
+
+// Emitter_Update updates all particles and returns
+// the current amount of active particles.
+// The cost scales with the amount of live particles, not the capacity.
+unsigned long Emitter_Update(Emitter *e, float dt) {
+  PARTIKEL_STAT(uint64_t start = PARTIKEL_CLOCK_NS();)
+  if (e->colliders != NULL) {
+    ParticleColliders_build(e->colliders);
+  }
+  if (e->forces != NULL) {
+    ParticleForces_build(e->forces);
+  }
+  Emitter_emit(e, dt);
+  Emitter_step(e, 0, e->length, dt);
+  Emitter_compact(e);
+
+  PARTIKEL_STAT(e->stats.updates++;
+                e->stats.updateNs += PARTIKEL_CLOCK_NS() - start;)
+  return e->length;
+}
+
+// Length of the coarse steps Emitter_Prewarm simulates Emitters that are
+// not analytic with.
+#define PARTIKEL_PREWARM_STEP 0.05f
+
+// Emitter_prewarmAnalytic advances an analytic Emitter by seconds at once.
+// The emissions due are spawned youngest first straight into their age,
+// as if emitted continuously.
+static void Emitter_prewarmAnalytic(Emitter *e, float seconds) {
+  if (e->clock + seconds >= PARTIKEL_CLOCK_EPOCH) {
+    Emitter_restartClock(e);
+  }
+  e->clock += seconds;
+  Emitter_markDead(e, 0, e->length);
+  Emitter_compact(e);
+  if (!e->isEmitting || e->config.emissionRate == 0) {
+    return;
+  }
+
+  float rate = (float)e->config.emissionRate;
+  float due = e->mustEmit + seconds * rate;
+  size_t n = (size_t)due; // floor
+  e->mustEmit = due - (float)n;
+  // The k-th youngest was due (mustEmit + k) / rate seconds ago.
+  size_t k = 0;
+  while (k < n) {
+    size_t first = e->length;
+    size_t spawned = Emitter_spawnParticles(e, n - k);
+    if (spawned == 0) {
+      break;
+    }
+    for (size_t j = 0; j < spawned; j++) {
+      e->particles.born[first + j] =
+          e->clock - (e->mustEmit + (float)(k + j)) / rate;
+    }
+    k += spawned;
+    Emitter_markDead(e, first, e->length);
+    Emitter_compact(e);
+  }
+  PARTIKEL_STAT(e->stats.saturated += k < n;)
+}
+
+// Emitter_prewarmSteps advances an Emitter that is not analytic by seconds
+// in steps of at most PARTIKEL_PREWARM_STEP. The particles spawned in a
+// step are moved back along their velocity to spread their births over
+// the step, so the coarse steps do not show as bands.
+static void Emitter_prewarmSteps(Emitter *e, float seconds) {
+  int steps = (int)ceilf(seconds / PARTIKEL_PREWARM_STEP);
+  float dt = seconds / (float)steps;
+  ParticleData *d = &e->particles;
+  for (int s = 0; s < steps; s++) {
+    size_t first = e->length;
+    Emitter_emit(e, dt);
+    float share = e->length > first ? dt / (float)(e->length - first) : 0;
+    for (size_t i = first; i < e->length; i++) {
+      float t = share * ((float)(i - first) + 0.5f);
+      d->posX[i] -= d->velX[i] * t;
+      d->posY[i] -= d->velY[i] * t;
+      d->born[i] += t;
+    }
+    Emitter_step(e, 0, e->length, dt);
+    Emitter_compact(e);
+  }
+}
+
+// Emitter_Prewarm advances the Emitter by seconds as fast as possible, for
+// example to start an effect in its steady state. Analytic Emitters jump
+// there in closed form, others are simulated in coarse steps. Only the
+// last age.max seconds are simulated if deactivation depends on the ttl
+// alone, since nothing older survives. If the capacity is exceeded the
+// youngest particles are kept. Returns the amount of live particles.
+unsigned long Emitter_Prewarm(Emitter *e, float seconds) {
+  if (seconds <= 0) {
+    return e->length;
+  }
+  if (e->colliders != NULL) {
+    ParticleColliders_build(e->colliders);
+  }
+  if (e->forces != NULL) {
+    ParticleForces_build(e->forces);
+  }
+
+  const EmitterConfig *cfg = &e->config;
+  float life = cfg->age.max > cfg->age.min ? cfg->age.max : cfg->age.min;
+  bool byTtl = cfg->particle_Deactivator == NULL ||
+               cfg->particle_Deactivator == Particle_DeactivatorAge;
+  if (byTtl && seconds > life) {
+    // Skip the time before: all particles alive now and emitted then die.
+    PARTIKEL_STAT(e->stats.deactivated += e->length;)
+    e->length = 0;
+    e->clock = 0;
+    if (e->isEmitting) {
+      float due = e->mustEmit + (seconds - life) * (float)cfg->emissionRate;
+      e->mustEmit = due - floorf(due);
+    }
+    seconds = life;
+  }
+
+  if (e->analytic) {
+    Emitter_prewarmAnalytic(e, seconds);
+  } else {
+    Emitter_prewarmSteps(e, seconds);
+  }
+  Emitter_trackDemand(e, 0);
+  return e->length;
+}
+
+// Emitter_GetBounds returns a rectangle containing all particles as drawn
+// and the area where new particles spawn.
+Rectangle Emitter_GetBounds(Emitter *e) {
+  Emitter_updateBounds(e);
+  return e->bounds;
+}
+
+// Emitter_GetStats returns the stats of the Emitter (see ParticleStats).
+ParticleStats Emitter_GetStats(const Emitter *e) {
+  ParticleStats stats = {0};
+#ifdef PARTIKEL_STATS
+  stats = e->stats;
+#endif
+  stats.length = e->length;
+  stats.capacity = e->particles.capacity;
+  stats.backlog = e->mustEmit;
+  return stats;
+}
+
+// Emitter_ResetStats sets all counters of the Emitter to 0.
+void Emitter_ResetStats(Emitter *e) {
+  PARTIKEL_STAT(e->stats = (ParticleStats){0};)
+  (void)e;
+}
+
+// Snapshot format.
+//
+// A snapshot of an Emitter is an EmitterSnapshot followed by its live
+// particles, laid out exactly like the storage of ParticleData with a
+// capacity of the live particles and the layout of the Emitter. Restoring
+// is one memcpy per array unless the layouts differ. A
+// snapshot of a ParticleSystem is a SystemSnapshot followed by the
+// snapshots of its Emitters in registration order. All parts start on a
+// PARTIKEL_ALIGNMENT boundary relative to the snapshot. The values are
+// stored in the byte order of the machine; a foreign one fails the magic
+// check.
+#define PARTIKEL_SNAPSHOT_MAGIC 0x4C4B5450u        // "PTKL"
+#define PARTIKEL_SYSTEM_SNAPSHOT_MAGIC 0x534B5450u // "PTKS"
+// Bump on any change to the format, including PARTIKEL_PARTICLE_FIELDS.
+#define PARTIKEL_SNAPSHOT_VERSION 2u
+
+// EmitterSnapshot is the header of the snapshot of an Emitter.
+typedef struct EmitterSnapshot {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t fields;     // Amount of particle arrays.
+  uint32_t fieldBytes; // Size of one particle over all arrays.
+  uint64_t size;       // Size of the whole snapshot in bytes.
+  uint64_t length;     // Live particles.
+  uint64_t peakLength;
+  uint32_t random[4]; // State of the RandomStream.
+  float mustEmit;
+  float clock;
+  float lodDt;
+  float windowAge;
+  uint8_t isEmitting;
+  uint8_t analytic; // The particles hold the spawn state.
+  uint8_t reserved[2];
+  uint32_t layout; // PARTIKEL_LAYOUT_* bits of the particle arrays.
+} EmitterSnapshot;
+
+// Emitter_snapshotFields fills the format fields of snapshot s.
+static void Emitter_snapshotFields(EmitterSnapshot *s) {
+  s->magic = PARTIKEL_SNAPSHOT_MAGIC;
+  s->version = PARTIKEL_SNAPSHOT_VERSION;
+  s->fields = 0;
+  s->fieldBytes = 0;
+#define PARTIKEL_FIELD_COUNT(type, name, bit)                                  \
+  s->fields++;                                                                 \
+  s->fieldBytes += sizeof(type);
+  PARTIKEL_PARTICLE_FIELDS(PARTIKEL_FIELD_COUNT)
+#undef PARTIKEL_FIELD_COUNT
+}
+
+// Emitter_checkSnapshot returns whether the snapshot with header s and at
+// most size bytes can be restored into Emitter e.
+static bool Emitter_checkSnapshot(const Emitter *e, const EmitterSnapshot *s,
+                                  size_t size) {
+  EmitterSnapshot format = {0};
+  Emitter_snapshotFields(&format);
+  return s->magic == format.magic && s->version == format.version &&
+         s->fields == format.fields && s->fieldBytes == format.fieldBytes &&
+         (s->layout & ~PARTIKEL_LAYOUT_ALL) == 0 &&
+         (s->layout & (PARTIKEL_LAYOUT_VEL32 | PARTIKEL_LAYOUT_VEL16)) != 0 &&
+         (s->layout & (PARTIKEL_LAYOUT_TTL32 | PARTIKEL_LAYOUT_TTL16)) != 0 &&
+         s->length <= e->config.capacity && s->size <= size &&
+         s->size == partikel_alignUp(sizeof(EmitterSnapshot)) +
+                        ParticleData_size((size_t)s->length, s->layout);
+}
+
+// Emitter_SnapshotSize returns the amount of bytes Emitter_Snapshot needs
+// for the current state of the Emitter.
+size_t Emitter_SnapshotSize(const Emitter *e) {
+  return partikel_alignUp(sizeof(EmitterSnapshot)) +
+         ParticleData_size(e->length, e->particles.layout);
+}
+
+// Emitter_Snapshot writes the state of the Emitter to buffer: its live
+// particles, pending emissions, clock and random stream. Returns the
+// amount of bytes written or 0 if size is less than Emitter_SnapshotSize.
+// The snapshot can be stored and restored by Emitter_Restore within the
+// same build of the library, on the same kind of machine.
+size_t Emitter_Snapshot(const Emitter *e, void *buffer, size_t size) {
+  size_t total = Emitter_SnapshotSize(e);
+  if (size < total) {
+    return 0;
+  }
+  EmitterSnapshot s = {0};
+  Emitter_snapshotFields(&s);
+  s.size = total;
+  s.length = e->length;
+  s.peakLength = e->peakLength;
+  memcpy(s.random, e->random.s, sizeof(s.random));
+  s.mustEmit = e->mustEmit;
+  s.clock = e->clock;
+  s.lodDt = e->lodDt;
+  s.windowAge = e->windowAge;
+  s.isEmitting = e->isEmitting;
+  s.analytic = e->analytic;
+  s.layout = e->particles.layout;
+
+  unsigned char *out = buffer;
+  size_t header = partikel_alignUp(sizeof(EmitterSnapshot));
+  memset(out, 0, header);
+  memcpy(out, &s, sizeof(s));
+  ParticleData data;
+  ParticleData_bind(&data, out + header, e->length, e->particles.layout);
+  // Zero the padding between the arrays, so equal states give equal bytes.
+  memset(out + header, 0, total - header);
+  ParticleData_copy(&data, 0, &e->particles, 0, e->length);
+  return total;
+}
+
+// Emitter_Restore replaces the state of the Emitter with the snapshot of
+// size bytes written by Emitter_Snapshot. The config is kept, so restore
+// into an Emitter with the config the snapshot was taken with. Returns
+// false and leaves the Emitter unchanged if the snapshot is invalid, of
+// another version or holds more particles than the Emitter can store.
+bool Emitter_Restore(Emitter *e, const void *snapshot, size_t size) {
+  EmitterSnapshot s;
+  size_t header = partikel_alignUp(sizeof(EmitterSnapshot));
+  if (size < header) {
+    return false;
+  }
+  memcpy(&s, snapshot, sizeof(s));
+  if (!Emitter_checkSnapshot(e, &s, size)) {
+    return false;
+  }
+  size_t length = (size_t)s.length;
+  if (length > e->particles.capacity &&
+      (e->pooled || !Emitter_resize(e, length))) {
+    return false;
+  }
+
+  ParticleData data;
+  // The arrays are only read from.
+  ParticleData_bind(&data, (unsigned char *)snapshot + header, length,
+                    s.layout);
+  ParticleData_convert(&e->particles, 0, &data, 0, length, e->config.origin);
+  e->length = length;
+  e->peakLength = (size_t)s.peakLength;
+  memcpy(e->random.s, s.random, sizeof(s.random));
+  e->mustEmit = s.mustEmit;
+  e->clock = s.clock;
+  e->lodDt = s.lodDt;
+  e->windowAge = s.windowAge;
+  e->isEmitting = s.isEmitting;
+  // Convert if the snapshot was taken in the other mode.
+  e->analytic = s.analytic;
+  if (e->analytic && !Emitter_useAnalytic(&e->config)) {
+    Emitter_leaveAnalytic(e);
+  } else if (!e->analytic && Emitter_useAnalytic(&e->config)) {
+    Emitter_enterAnalytic(e);
+  }
+  Emitter_updateBounds(e);
+  return true;
+}
+
+// Texture coordinates of a whole texture.
+#define PARTIKEL_FULL_UV (Rectangle){.x = 0, .y = 0, .width = 1, .height = 1}
+
+// Emitter_buildQuads writes the quads of the first n live particles to
+// vertices. With an order the q-th quad is the one of particle order[q].
+// uv is the area of the texture the quads show.
+PARTIKEL_INLINE void Emitter_buildQuads(const Emitter *e,
+                                        ParticleVertex *vertices, size_t n,
+                                        const uint32_t *order, Rectangle uv) {
+  float u0 = uv.x;
+  float v0 = uv.y;
+  float u1 = uv.x + uv.width;
+  float v1 = uv.y + uv.height;
+  const ParticleData *d = &e->particles;
+  // Without interpolation prev is pos, which yields pos exactly.
+  const float *prevX = e->interpolate ? d->prevX : d->posX;
+  const float *prevY = e->interpolate ? d->prevY : d->posY;
+  float alpha = e->interpolate ? e->alpha : 1;
+  // Analytic particles are evaluated right at the time of drawing.
+  float time = e->clock + e->drawAhead;
+  float hx = 0.5f * e->config.externalAcceleration.x;
+  float hy = 0.5f * e->config.externalAcceleration.y;
+  // Quantized arrays are decoded per particle, the choice is made once.
+  const float *velX = d->velX;
+  const float *velY = d->velY;
+  const uint16_t *halfVelX = d->halfVelX;
+  const uint16_t *halfVelY = d->halfVelY;
+  const float *ttl = d->ttl;
+  const uint16_t *halfTtl = d->halfTtl;
+
+  for (size_t q = 0; q < n; q++) {
+    size_t i = order != NULL ? order[q] : q;
+    float age;
+    float x;
+    float y;
+    if (e->analytic) {
+      age = time - d->born[i];
+      float vx = velX != NULL ? velX[i] : partikel_fromHalf(halfVelX[i]);
+      float vy = velY != NULL ? velY[i] : partikel_fromHalf(halfVelY[i]);
+      x = d->posX[i] + (vx + hx * age) * age;
+      y = d->posY[i] + (vy + hy * age) * age;
+    } else {
+      age = e->clock - d->born[i];
+      x = prevX[i] + (d->posX[i] - prevX[i]) * alpha;
+      y = prevY[i] + (d->posY[i] - prevY[i]) * alpha;
+    }
+
+    // Map the lifetime fraction to a table index. NaN (0 / 0 for a fresh
+    // particle without ttl) ends up at the last entry.
+    float t = age / (ttl != NULL ? ttl[i] : partikel_fromHalf(halfTtl[i]));
+    t = t < 1 ? t : 1;
+    t = t > 0 ? t : 0;
+    int k = (int)(t * (PARTIKEL_LUT_SIZE - 1) + 0.5f);
+
+    Vector2 ax = e->axisXLut[k];
+    Vector2 ay = e->axisYLut[k];
+    Color c = e->colorLut[k];
+
+    ParticleVertex *v = vertices + 4 * q;
+    v[0] = (ParticleVertex){.x = x - ax.x - ay.x,
+                            .y = y - ax.y - ay.y,
+                            .u = u0,
+                            .v = v0,
+                            .color = c};
+    v[1] = (ParticleVertex){.x = x - ax.x + ay.x,
+                            .y = y - ax.y + ay.y,
+                            .u = u0,
+                            .v = v1,
+                            .color = c};
+    v[2] = (ParticleVertex){.x = x + ax.x + ay.x,
+                            .y = y + ax.y + ay.y,
+                            .u = u1,
+                            .v = v1,
+                            .color = c};
+    v[3] = (ParticleVertex){.x = x + ax.x - ay.x,
+                            .y = y + ax.y - ay.y,
+                            .u = u1,
+                            .v = v0,
+                            .color = c};
+  }
+}
+
+// Emitter_BuildVertices writes a textured quad (4 vertices) for each of the
+// first maxParticles live particles to vertices, which must hold at least
+// 4 * maxParticles elements. Returns the amount of quads written.
+// It does not need a graphics context and can be used headless. The quads
+// are in storage order, see Emitter_Draw for the sorted order.
+size_t Emitter_BuildVertices(const Emitter *e, ParticleVertex *vertices,
+                             size_t maxParticles) {
+  size_t n = e->length < maxParticles ? e->length : maxParticles;
+  Emitter_buildQuads(e, vertices, n, NULL, PARTIKEL_FULL_UV);
+  return n;
+}
+
+// partikel_radixSort sorts the indices 0 to n - 1 stably by the n keys
+// below 2^(8 * bytes), least significant byte first. A byte that is the
+// same in all keys is skipped. keys and order are clobbered, as are the
+// temporary arrays of the same size. Returns the sorted order, order or
+// orderTmp.
+static uint32_t *partikel_radixSort(uint32_t *keys, uint32_t *order,
+                                    uint32_t *keysTmp, uint32_t *orderTmp,
+                                    size_t n, int bytes) {
+  uint32_t counts[4][256] = {{0}};
+  for (size_t i = 0; i < n; i++) {
+    for (int pass = 0; pass < bytes; pass++) {
+      counts[pass][(keys[i] >> (8 * pass)) & 0xFF]++;
+    }
+    order[i] = (uint32_t)i;
+  }
+  for (int pass = 0; pass < bytes; pass++) {
+    int shift = 8 * pass;
+    uint32_t *count = counts[pass];
+    if (count[(keys[0] >> shift) & 0xFF] == n) {
+      continue;
+    }
+    uint32_t sum = 0;
+    for (int b = 0; b < 256; b++) {
+      uint32_t c = count[b];
+      count[b] = sum;
+      sum += c;
+    }
+    for (size_t i = 0; i < n; i++) {
+      uint32_t slot = count[(keys[i] >> shift) & 0xFF]++;
+      keysTmp[slot] = keys[i];
+      orderTmp[slot] = order[i];
+    }
+    uint32_t *t = keys;
+    keys = keysTmp;
+    keysTmp = t;
+    t = order;
+    order = orderTmp;
+    orderTmp = t;
+  }
+  return order;
+}
+
+// Emitter_reorder moves the first n particles into the given order.
+// Returns false if out of memory.
+static bool Emitter_reorder(Emitter *e, const uint32_t *order, size_t n) {
+  ParticleData sorted;
+  if (!ParticleData_alloc(&sorted, n, e->particles.layout)) {
+    return false;
+  }
+  const ParticleData *d = &e->particles;
+#define PARTIKEL_FIELD_GATHER(type, name, bit)                                 \
+  if (d->name != NULL) {                                                       \
+    for (size_t q = 0; q < n; q++) {                                           \
+      sorted.name[q] = d->name[order[q]];                                      \
+    }                                                                          \
+  }
+  PARTIKEL_PARTICLE_FIELDS(PARTIKEL_FIELD_GATHER)
+#undef PARTIKEL_FIELD_GATHER
+  ParticleData_copy(&e->particles, 0, &sorted, 0, n);
+  ParticleData_free(&sorted);
+  return true;
+}
+
+// partikel_sortKey maps a float to a key whose unsigned order is the order
+// of the floats, with -0 before 0. NaNs come after everything else.
+PARTIKEL_INLINE uint32_t partikel_sortKey(float f) {
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  if (f != f) {
+    return 0xFFFFFFFFu;
+  }
+  // Negative floats order reversed, so all their bits flip, while positive
+  // ones only need to move above them.
+  return (bits & 0x80000000u) ? ~bits : bits | 0x80000000u;
+}
+
+// partikel_insertionSort sorts the order of the n keys stably, starting
+// from the storage order, unless that takes more than limit moves. It suits
+// keys that are nearly sorted already. Returns false if it gave up.
+static bool partikel_insertionSort(const uint32_t *keys, uint32_t *order,
+                                   size_t n, size_t limit) {
+  size_t moves = 0;
+  order[0] = 0;
+  for (size_t q = 1; q < n; q++) {
+    uint32_t key = keys[q];
+    size_t p = q;
+    for (; p > 0 && keys[order[p - 1]] > key; p--) {
+      order[p] = order[p - 1];
+    }
+    order[p] = (uint32_t)q;
+    moves += q - p;
+    if (moves > limit) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Emitter_sortByKey sorts the particles by their sortKeys values exactly,
+// so outliers and NaNs cannot spoil the order of the others, and moves
+// them into that order. Keys change little between frames, so the next
+// sort mostly finds them in order or takes a few insertions. Returns the
+// order if they could not be moved, NULL otherwise.
+static const uint32_t *Emitter_sortByKey(Emitter *e, const float *values,
+                                         uint32_t *keys, uint32_t *order,
+                                         uint32_t *keysTmp,
+                                         uint32_t *orderTmp) {
+  size_t n = e->length;
+  size_t descents = 0;
+  keys[0] = partikel_sortKey(values[0]);
+  for (size_t i = 1; i < n; i++) {
+    keys[i] = partikel_sortKey(values[i]);
+    descents += keys[i] < keys[i - 1];
+  }
+  if (descents == 0) {
+    return NULL;
+  }
+  // Insertions are bounded to a few moves per particle, otherwise the 4
+  // radix passes are cheaper.
+  if (!partikel_insertionSort(keys, order, n, 4 * n)) {
+    order = partikel_radixSort(keys, order, keysTmp, orderTmp, n, 4);
+  }
+  return Emitter_reorder(e, order, n) ? NULL : order;
+}
+
+// Emitter_sort returns the order Emitter_Draw draws the particles in or
+// NULL for the storage order. The storage keeps the spawn order (see
+// Emitter_compact), so sorting by it mostly takes a check. Otherwise the
+// spawn times are quantized to 16 bits over their range and radix sorted
+// in at most 2 passes. Keys are sorted exactly (see Emitter_sortByKey).
+// Particles are moved into their sorted order, so the following frames
+// take the check again. If out of memory the storage order is used.
+static const uint32_t *Emitter_sort(Emitter *e) {
+  ParticleSortMode mode = e->config.sortMode;
+  size_t n = e->length;
+  if (mode == PARTICLE_SORT_NONE || n < 2 ||
+      (mode == PARTICLE_SORT_KEY && e->config.sortKeys == NULL)) {
+    return NULL;
+  }
+  if (n > e->sortCapacity) {
+    // Values, keys, order and a copy of keys and order for the radix sort.
+    size_t capacity = e->particles.capacity;
+    float *buffer = PARTIKEL_ALLOC(capacity, sizeof(float) +
+                                                 4 * sizeof(uint32_t));
+    if (buffer == NULL) {
+      return NULL;
+    }
+    PARTIKEL_FREE(e->sortBuffer);
+    e->sortBuffer = buffer;
+    e->sortCapacity = capacity;
+  }
+  float *values = e->sortBuffer;
+  uint32_t *keys = (uint32_t *)(values + e->sortCapacity);
+  uint32_t *order = keys + e->sortCapacity;
+  uint32_t *keysTmp = order + e->sortCapacity;
+  uint32_t *orderTmp = keysTmp + e->sortCapacity;
+
+  if (mode == PARTICLE_SORT_KEY) {
+    float age[PARTIKEL_SPAN_BLOCK];
+    float ttl[PARTIKEL_SPAN_BLOCK];
+    for (size_t i = 0; i < n; i += PARTIKEL_SPAN_BLOCK) {
+      size_t count = n - i < PARTIKEL_SPAN_BLOCK ? n - i : PARTIKEL_SPAN_BLOCK;
+      ParticleSpan span;
+      Emitter_loadSpan(e, i, count, age, ttl, &span);
+      e->config.sortKeys(&span, values + i, e->config.sortData);
+    }
+    return Emitter_sortByKey(e, values, keys, order, keysTmp, orderTmp);
+  }
+
+  bool newest = mode == PARTICLE_SORT_NEWEST_FIRST;
+  memcpy(values, e->particles.born, n * sizeof(float));
+
+  size_t rising = 0;
+  size_t falling = 0;
+  // NaNs are left out of the range, as they compare false.
+  float min = INFINITY;
+  float max = -INFINITY;
+  for (size_t i = 0; i < n; i++) {
+    if (i > 0) {
+      rising += values[i] >= values[i - 1];
+      falling += values[i] <= values[i - 1];
+    }
+    min = values[i] < min ? values[i] : min;
+    max = values[i] > max ? values[i] : max;
+  }
+  bool ascending = rising == n - 1;
+  bool descending = falling == n - 1;
+  if ((ascending && !newest) || (descending && newest)) {
+    return NULL;
+  }
+  if (ascending || descending) {
+    for (size_t i = 0; i < n; i++) {
+      order[i] = (uint32_t)(n - 1 - i);
+    }
+    return order;
+  }
+
+  float scale = max > min ? 65535.0f / (max - min) : 0;
+  for (size_t i = 0; i < n; i++) {
+    // NaN ends up at 0.
+    float k = (values[i] - min) * scale;
+    k = k > 0 ? k : 0;
+    k = k < 65535.0f ? k : 65535.0f;
+    keys[i] = (uint32_t)k;
+  }
+  // Sort equal keys exactly, so the check succeeds next time. Only spawn
+  // times closer than the quantization are out of order.
+  order = partikel_radixSort(keys, order, keysTmp, orderTmp, n, 2);
+  for (size_t q = 1; q < n; q++) {
+    uint32_t v = order[q];
+    size_t p = q;
+    for (; p > 0 && values[order[p - 1]] > values[v]; p--) {
+      order[p] = order[p - 1];
+    }
+    order[p] = v;
+  }
+  // Store the spawn order to find it there next time.
+  if (!Emitter_reorder(e, order, n)) {
+    return order;
+  }
+  if (!newest) {
+    return NULL;
+  }
+  for (size_t i = 0; i < n; i++) {
+    order[i] = (uint32_t)(n - 1 - i);
+  }
+  return order;
+}
+
+// Emitter_poolDemand returns the slots the Emitter wants from the pool of
+// its ParticleSystem: room for the live particles, the emissions of the
+// next update and a burst, plus a quarter as headroom. The demand is kept
+// between the reserve and the capacity.
+static size_t Emitter_poolDemand(const Emitter *e, float dt) {
+  const EmitterConfig *cfg = &e->config;
+  size_t demand = e->length;
+  if (e->isEmitting) {
+    demand += (size_t)(e->mustEmit + dt * (float)cfg->emissionRate) + 1;
+  }
+  if (cfg->burst.max > 0) {
+    demand += (size_t)cfg->burst.max;
+  }
+  demand += demand / 4;
+  if (demand < cfg->reserve) {
+    demand = cfg->reserve;
+  }
+  return demand < cfg->capacity ? demand : cfg->capacity;
+}
+
+// Emitter_detach moves the particles of a pooled Emitter into storage of
+// its own. Returns false if there is not enough memory.
+static bool Emitter_detach(Emitter *e) {
+  return Emitter_relayout(e, e->config.capacity, e->particles.layout);
+}
+
+// Emitter_prepareQuads builds the quads of all live particles in the
+// vertex buffer in draw order, showing the area uv of the texture.
+// Returns the amount of quads or 0 if out of memory.
+static size_t Emitter_prepareQuads(Emitter *e, Rectangle uv) {
+  if (e->length > e->vertexCapacity) {
+    // Grow the quad buffer to the storage, so this happens at most once
+    // per storage change.
+    ParticleVertex *vertices =
+        PARTIKEL_ALLOC(4 * e->particles.capacity, sizeof(ParticleVertex));
+    if (vertices == NULL) {
+      return 0;
+    }
+    PARTIKEL_FREE(e->vertices);
+    e->vertices = vertices;
+    e->vertexCapacity = e->particles.capacity;
+  }
+
+  const uint32_t *order = Emitter_sort(e);
+  if (order != NULL) {
+    Emitter_buildQuads(e, e->vertices, e->length, order, uv);
+  } else {
+    Emitter_buildQuads(e, e->vertices, e->length, NULL, uv);
+  }
+  return e->length;
+}
+
+// Emitter_submit draws the first quads of vertices with the texture and
+// blend mode of the Emitter.
+static void Emitter_submit(Emitter *e, const ParticleVertex *vertices,
+                           size_t quads) {
+  PARTIKEL_STAT(uint64_t start = PARTIKEL_CLOCK_NS();)
+  BeginBlendMode(e->config.blendMode);
+  partikel_submitQuads(e->config.texture, vertices, quads);
+  EndBlendMode();
+  PARTIKEL_STAT(e->stats.draws++;
+                e->stats.drawNs += PARTIKEL_CLOCK_NS() - start;)
+}
+
+// Emitter_Draw draws all active particles as one batch of quads.
+void Emitter_Draw(Emitter *e) {
+  PARTIKEL_STAT(uint64_t start = PARTIKEL_CLOCK_NS();)
+  size_t quads = Emitter_prepareQuads(e, PARTIKEL_FULL_UV);
+  PARTIKEL_STAT(e->stats.drawNs += PARTIKEL_CLOCK_NS() - start;)
+  Emitter_submit(e, e->vertices, quads);
+}
+
+// Emitter_isPacked returns whether the texture of the Emitter is in the
+// atlas of its ParticleSystem.
+static bool Emitter_isPacked(const Emitter *e) {
+  return e->atlasTexture != 0 && e->atlasTexture == e->config.texture.id;
+}
+
+// Emitter_swapFrame hands the quads built by the pipelined update over to
+// ParticleSystem_Draw. The old front buffer takes the next frame.
+static void Emitter_swapFrame(Emitter *e) {
+  ParticleVertex *vertices = e->frontVertices;
+  size_t capacity = e->frontCapacity;
+  e->frontVertices = e->vertices;
+  e->frontCapacity = e->vertexCapacity;
+  e->frontQuads = e->builtQuads;
+  e->vertices = vertices;
+  e->vertexCapacity = capacity;
+  e->builtQuads = 0;
+}
+
+// ParticleWorkers type.
+//----------------------------------------------------------------------------------
+
+#ifdef PARTIKEL_THREADS
+
+// ParticleJob is a chunk of particles of one Emitter to be stepped.
+typedef struct ParticleJob {
+  Emitter *emitter;
+  size_t begin;
+  size_t end;
+  float dt;
+#ifdef PARTIKEL_STATS
+  unsigned int worker; // Worker that ran the job.
+  uint64_t start;      // Clock when it started.
+  uint64_t ns;         // Nanoseconds it took.
+#endif
+} ParticleJob;
+
+// ParticleWorkers is the thread pool behind the parallel update of a
+// ParticleSystem. The calling thread takes part as worker 0.
+//
+// Jobs are balanced by work stealing: every worker owns a contiguous range
+// of the job list packed into one 64 bit word (begin in the low and end in
+// the high half). The owner takes jobs from the front, idle workers steal
+// from the back of other ranges. Both only need one compare-and-swap.
+typedef struct ParticleWorkers {
+  unsigned int count; // Amount of workers including the calling thread.
+  pthread_t *threads;
+  uint64_t *ranges; // One range of job indices per worker.
+  ParticleJob *jobs;
+  size_t jobCount;
+  size_t jobCapacity;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t wake;  // Signals a new round of jobs (or quit).
+  pthread_cond_t done;  // Signals that all workers finished a round.
+  unsigned long round;  // Incremented for every round of jobs.
+  unsigned int running; // Workers (without the caller) still running.
+  bool quit;
+} ParticleWorkers;
+
+// ParticleWorkers_take removes one job from the range of worker w. The
+// owner takes from the front, thieves from the back. Returns false if the
+// range is empty.
+static bool ParticleWorkers_take(ParticleWorkers *pw, unsigned int w,
+                                 bool steal, size_t *job) {
+  uint64_t old = __atomic_load_n(&pw->ranges[w], __ATOMIC_ACQUIRE);
+  for (;;) {
+    uint32_t begin = (uint32_t)old;
+    uint32_t end = (uint32_t)(old >> 32);
+    if (begin >= end) {
+      return false;
+    }
+    uint64_t next = steal ? ((uint64_t)(end - 1) << 32) | begin
+                          : ((uint64_t)end << 32) | (begin + 1);
+    if (__atomic_compare_exchange_n(&pw->ranges[w], &old, next, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      *job = steal ? end - 1 : begin;
+      return true;
+    }
+  }
+}
+
+// ParticleWorkers_run executes jobs as worker w until no job is left.
+static void ParticleWorkers_run(ParticleWorkers *pw, unsigned int w) {
+  size_t job;
+  for (;;) {
+    bool found = ParticleWorkers_take(pw, w, false, &job);
+    for (unsigned int i = 1; !found && i < pw->count; i++) {
+      found = ParticleWorkers_take(pw, (w + i) % pw->count, true, &job);
+    }
+    if (!found) {
+      return;
+    }
+    ParticleJob *j = &pw->jobs[job];
+    PARTIKEL_STAT(j->worker = w; j->start = PARTIKEL_CLOCK_NS();)
+    Emitter_step(j->emitter, j->begin, j->end, j->dt);
+    PARTIKEL_STAT(j->ns = PARTIKEL_CLOCK_NS() - j->start;)
+  }
+}
+
+// ParticleWorkers_main is the loop of every pool thread.
+static void *ParticleWorkers_main(void *arg) {
+  ParticleWorkers *pw = ((void **)arg)[0];
+  unsigned int w = (unsigned int)(uintptr_t)((void **)arg)[1];
+  PARTIKEL_FREE(arg);
+
+  unsigned long seen = 0;
+  for (;;) {
+    pthread_mutex_lock(&pw->mutex);
+    while (!pw->quit && pw->round == seen) {
+      pthread_cond_wait(&pw->wake, &pw->mutex);
+    }
+    if (pw->quit) {
+      pthread_mutex_unlock(&pw->mutex);
+      return NULL;
+    }
+    seen = pw->round;
+    pthread_mutex_unlock(&pw->mutex);
+
+    ParticleWorkers_run(pw, w);
+
+    pthread_mutex_lock(&pw->mutex);
+    if (--pw->running == 0) {
+      pthread_cond_signal(&pw->done);
+    }
+    pthread_mutex_unlock(&pw->mutex);
+  }
+}
+
+// ParticleWorkers_free stops and joins all threads and frees the pool.
+static void ParticleWorkers_free(ParticleWorkers *pw) {
+  if (pw == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&pw->mutex);
+  pw->quit = true;
+  pthread_cond_broadcast(&pw->wake);
+  pthread_mutex_unlock(&pw->mutex);
+  for (unsigned int i = 1; i < pw->count; i++) {
+    pthread_join(pw->threads[i], NULL);
+  }
+  pthread_cond_destroy(&pw->done);
+  pthread_cond_destroy(&pw->wake);
+  pthread_mutex_destroy(&pw->mutex);
+  PARTIKEL_FREE(pw->jobs);
+  PARTIKEL_FREE(pw->ranges);
+  PARTIKEL_FREE(pw->threads);
+  PARTIKEL_FREE(pw);
+}
+
+// ParticleWorkers_new starts a pool of count workers (count - 1 threads).
+static ParticleWorkers *ParticleWorkers_new(unsigned int count) {
+  ParticleWorkers *pw = PARTIKEL_ALLOC(1, sizeof(ParticleWorkers));
+  if (pw == NULL) {
+    return NULL;
+  }
+  pw->threads = PARTIKEL_ALLOC(count, sizeof(pthread_t));
+  pw->ranges = PARTIKEL_ALLOC(count, sizeof(uint64_t));
+  if (pw->threads == NULL || pw->ranges == NULL) {
+    PARTIKEL_FREE(pw->ranges);
+    PARTIKEL_FREE(pw->threads);
+    PARTIKEL_FREE(pw);
+    return NULL;
+  }
+  pthread_mutex_init(&pw->mutex, NULL);
+  pthread_cond_init(&pw->wake, NULL);
+  pthread_cond_init(&pw->done, NULL);
+
+  // Count only the started threads, so a failure can clean up.
+  pw->count = 1;
+  for (unsigned int i = 1; i < count; i++) {
+    void **arg = PARTIKEL_ALLOC(2, sizeof(void *));
+    if (arg == NULL) {
+      ParticleWorkers_free(pw);
+      return NULL;
+    }
+    arg[0] = pw;
+    arg[1] = (void *)(uintptr_t)i;
+    if (pthread_create(&pw->threads[i], NULL, ParticleWorkers_main, arg) !=
+        0) {
+      PARTIKEL_FREE(arg);
+      ParticleWorkers_free(pw);
+      return NULL;
+    }
+    pw->count++;
+  }
+
+  return pw;
+}
+
+// ParticleWorkers_addJob appends a job. Returns false if out of memory.
+static bool ParticleWorkers_addJob(ParticleWorkers *pw, ParticleJob job) {
+  if (pw->jobCount >= pw->jobCapacity) {
+    size_t capacity = pw->jobCapacity == 0 ? 64 : 2 * pw->jobCapacity;
+    ParticleJob *jobs = PARTIKEL_ALLOC(capacity, sizeof(ParticleJob));
+    if (jobs == NULL) {
+      return false;
+    }
+    if (pw->jobCount > 0) {
+      memcpy(jobs, pw->jobs, pw->jobCount * sizeof(ParticleJob));
+    }
+    PARTIKEL_FREE(pw->jobs);
+    pw->jobs = jobs;
+    pw->jobCapacity = capacity;
+  }
+  pw->jobs[pw->jobCount++] = job;
+  return true;
+}
+
+// ParticleWorkers_execute runs all added jobs on all workers, waits for
+// them to finish and clears the job list.
+static void ParticleWorkers_execute(ParticleWorkers *pw) {
+  // Hand out equal contiguous ranges, stealing balances the rest.
+  for (unsigned int w = 0; w < pw->count; w++) {
+    uint64_t begin = pw->jobCount * w / pw->count;
+    uint64_t end = pw->jobCount * (w + 1) / pw->count;
+    __atomic_store_n(&pw->ranges[w], (end << 32) | begin, __ATOMIC_RELAXED);
+  }
+
+  pthread_mutex_lock(&pw->mutex);
+  pw->round++;
+  pw->running = pw->count - 1;
+  pthread_cond_broadcast(&pw->wake);
+  pthread_mutex_unlock(&pw->mutex);
+
+  ParticleWorkers_run(pw, 0);
+
+  pthread_mutex_lock(&pw->mutex);
+  while (pw->running > 0) {
+    pthread_cond_wait(&pw->done, &pw->mutex);
+  }
+  pthread_mutex_unlock(&pw->mutex);
+
+  pw->jobCount = 0;
+}
+
+// ParticlePipeline is the thread running the updates of a ParticleSystem
+// in pipelined mode (see ParticleSystem_SetPipelined), while the calling
+// thread draws the previous frame.
+typedef struct ParticlePipeline {
+  pthread_t thread;
+  pthread_mutex_t mutex; // Also guards the trace of the system.
+  pthread_cond_t wake;   // Signals a requested update (or quit).
+  pthread_cond_t done;   // Signals that the update finished.
+  ParticleSystem *ps;
+  float dt;   // Seconds to advance by the requested update.
+  bool busy;  // An update was requested and has not finished yet.
+  bool ready; // A finished frame waits to be handed over.
+  bool quit;
+} ParticlePipeline;
+
+#else
+
+// Without PARTIKEL_THREADS the pool and the pipeline are never created.
+typedef struct ParticleWorkers ParticleWorkers;
+typedef struct ParticlePipeline ParticlePipeline;
+
+#endif // PARTIKEL_THREADS
+
+// ParticleSystem type.
+//----------------------------------------------------------------------------------
+
+#ifdef PARTIKEL_STATS
+// ParticleTraceEvent is a span of time recorded for the trace export.
+typedef struct ParticleTraceEvent {
+  const char *name;
+  uint64_t start;
+  uint64_t duration;
+  unsigned int thread; // 0 is the updating thread, then the pool workers.
+                       // Pipelined draws follow after those.
+  long emitter;        // Index of the Emitter or -1 for the system.
+  size_t particles;    // Live particles afterwards.
+} ParticleTraceEvent;
+#endif
+
+// ParticleSystem is a set of emitters grouped logically
+// together to achieve a specific visual effect.
+// While Emitters can be used independently, ParticleSystem
+// offers some convenience for handling many Emitters at once.
+struct ParticleSystem {
+  bool active;
+  size_t length;
+  size_t capacity;
+  Vector2 origin;
+  Emitter **emitters;
+  ParticleWorkers *workers; // Thread pool of the parallel update or NULL.
+  ParticlePipeline *pipeline; // Thread of the pipelined update or NULL.
+  unsigned long asyncLength;  // Result of ParticleSystem_UpdateAsync
+                              // until ParticleSystem_Sync returns it.
+  ParticleData pool; // Particles shared by all Emitters, if a pool is set.
+  unsigned int poolCooldown; // Updates until the pool may be repacked.
+  float fixedStep;   // Seconds per simulation step or 0 to step by frame.
+  float accumulator; // Seconds not yet simulated in fixed step mode.
+  Rectangle view;    // Visible area. Unused if width or height is <= 0.
+  unsigned int offscreenInterval; // Default update interval of Emitters
+                                  // outside the view.
+  Texture2D atlas; // Textures of the Emitters packed by
+                   // ParticleSystem_BuildAtlas. Its id is 0 if unused.
+  ParticleColliders colliders;
+  ParticleForces forces;
+  // Grid of all live particles answering the queries. It is built by the
+  // first query after the particles changed.
+  ParticleGrid queryGrid;
+  ParticleRef *queryRefs;      // Particles by cell.
+  Vector2 *queryPositions;     // Their positions by cell.
+  Vector2 *queryScratch;       // Positions in Emitter order while building.
+  size_t queryCapacity;        // Allocated length of the arrays above.
+  size_t queryScratchCapacity; // Allocated length of queryScratch.
+  bool queryStale;             // The grid must be rebuilt before a query.
+#ifdef PARTIKEL_STATS
+  ParticleStats stats;       // Updates and draws of the system itself.
+  ParticleTraceEvent *trace; // Events recorded since StartTrace or NULL.
+  size_t traceLength;
+  size_t traceCapacity;
+  uint64_t traceStart; // Clock when the trace started.
+#endif
+};
+
+#ifdef PARTIKEL_STATS
+// ParticleSystem_trace records an event if a trace is running and not full.
+static void ParticleSystem_trace(ParticleSystem *ps, const char *name,
+                                 uint64_t start, uint64_t end,
+                                 unsigned int thread, long emitter,
+                                 size_t particles) {
+#ifdef PARTIKEL_THREADS
+  // Pipelined updates record from their own thread while drawing goes on.
+  if (ps->pipeline != NULL) {
+    pthread_mutex_lock(&ps->pipeline->mutex);
+  }
+#endif
+  if (ps->traceLength < ps->traceCapacity) {
+    ps->trace[ps->traceLength++] =
+        (ParticleTraceEvent){.name = name,
+                             .start = start,
+                             .duration = end - start,
+                             .thread = thread,
+                             .emitter = emitter,
+                             .particles = particles};
+  }
+#ifdef PARTIKEL_THREADS
+  if (ps->pipeline != NULL) {
+    pthread_mutex_unlock(&ps->pipeline->mutex);
+  }
+#endif
+}
+#endif
+
+// ParticleSystem_isVisible returns whether the bounds of Emitter e touch
+// the view of the system. Without a view every Emitter is visible.
+static bool ParticleSystem_isVisible(const ParticleSystem *ps,
+                                     const Emitter *e) {
+  Rectangle v = ps->view;
+  Rectangle b = e->bounds;
+  if (v.width <= 0 || v.height <= 0) {
+    return true;
+  }
+  return b.x <= v.x + v.width && v.x <= b.x + b.width &&
+         b.y <= v.y + v.height && v.y <= b.y + b.height;
+}
+
+// ParticleSystem_lodStep returns the time Emitter e advances in this update.
+// An Emitter outside the view advances only every k-th update, by all the
+// time skipped meanwhile. 0 means the Emitter skips this update.
+static float ParticleSystem_lodStep(ParticleSystem *ps, Emitter *e,
+                                    float dt) {
+  unsigned int interval = e->config.offscreenInterval > 0
+                              ? e->config.offscreenInterval
+                              : ps->offscreenInterval;
+  e->lodDt += dt;
+  if (interval > 1 && !ParticleSystem_isVisible(ps, e) &&
+      ++e->lodSkipped < interval) {
+    return 0;
+  }
+  float stepDt = e->lodDt;
+  e->lodDt = 0;
+  e->lodSkipped = 0;
+  return stepDt;
+}
+
+// Emitter_setInterpolation switches interpolated drawing of an Emitter
+// with fixed steps of step seconds on, or off for a step of 0. Switching
+// on starts from the current positions. It stores the previous positions
+// only while they are needed. Without memory for them the Emitter is drawn
+// at its last step instead.
+static void Emitter_setInterpolation(Emitter *e, float step) {
+  bool interpolate = step > 0;
+  unsigned int layout = Emitter_layout(&e->config, e->analytic, interpolate);
+  if (interpolate && !e->interpolate) {
+    if ((layout & ~e->particles.layout) != 0 &&
+        !Emitter_relayout(e, e->particles.capacity, layout)) {
+      interpolate = false;
+    }
+    ParticleData *d = &e->particles;
+    if (d->prevX != NULL) {
+      memcpy(d->prevX, d->posX, e->length * sizeof(float));
+      memcpy(d->prevY, d->posY, e->length * sizeof(float));
+    }
+    e->alpha = 1;
+  } else if (!interpolate && e->interpolate && !e->pooled &&
+             layout != e->particles.layout) {
+    // Keeping the unused arrays is harmless if out of memory.
+    Emitter_relayout(e, e->particles.capacity, layout);
+  }
+  e->interpolate = interpolate;
+  e->fixedStep = step;
+  e->drawAhead = 0;
+}
+
+// ParticleSystem_planPool sets poolSize of every Emitter for a pool of
+// budget slots. Each Emitter keeps at least its live particles and its
+// reserve. The rest of the budget is lent to the Emitters by their demand,
+// proportionally if it does not suffice. Returns false if the live
+// particles and reserves exceed the budget.
+static bool ParticleSystem_planPool(ParticleSystem *ps, size_t budget,
+                                    float dt) {
+  size_t used = 0;
+  size_t deficit = 0;
+  for (size_t i = 0; i < ps->length; i++) {
+    Emitter *e = ps->emitters[i];
+    size_t reserve = e->config.reserve < e->config.capacity
+                         ? e->config.reserve
+                         : e->config.capacity;
+    e->poolSize = e->length > reserve ? e->length : reserve;
+    used += e->poolSize;
+    deficit += Emitter_poolDemand(e, dt) - e->poolSize;
+  }
+  if (used > budget) {
+    return false;
+  }
+
+  size_t room = budget - used;
+  for (size_t i = 0; i < ps->length; i++) {
+    Emitter *e = ps->emitters[i];
+    size_t extra = Emitter_poolDemand(e, dt) - e->poolSize;
+    if (deficit > room) {
+      extra = (size_t)((double)extra * (double)room / (double)deficit);
+    }
+    e->poolSize += extra;
+  }
+  return true;
+}
+
+// ParticleSystem_movePooled places the particles of Emitter e at offset of
+// the pool. The Emitter may live in the same pool, the previous pool or
+// storage of its own, which is freed then.
+static void ParticleSystem_movePooled(ParticleSystem *ps, Emitter *e,
+                                      size_t offset) {
+  ParticleData view;
+  ParticleData_view(&view, &ps->pool, offset, e->poolSize,
+                    e->particles.layout);
+  if (!e->pooled || view.posX != e->particles.posX) {
+    ParticleData_copy(&view, 0, &e->particles, 0, e->length);
+  }
+  ParticleData_free(&e->particles);
+  e->particles = view;
+  e->poolOffset = offset;
+  e->pooled = true;
+}
+
+// ParticleSystem_layoutPool packs the Emitters into the pool in
+// registration order with the sizes planned by ParticleSystem_planPool.
+// Pooled Emitters moving to lower slots are moved first in ascending
+// order, the others afterwards in descending order, so no live particles
+// of another Emitter are overwritten. Emitters with storage of their own
+// occupy no slots, so they move in last.
+static void ParticleSystem_layoutPool(ParticleSystem *ps) {
+  size_t offset = 0;
+  for (size_t i = 0; i < ps->length; i++) {
+    Emitter *e = ps->emitters[i];
+    if (e->pooled && offset <= e->poolOffset) {
+      ParticleSystem_movePooled(ps, e, offset);
+    }
+    offset += e->poolSize;
+  }
+  for (size_t i = ps->length; i-- > 0;) {
+    Emitter *e = ps->emitters[i];
+    offset -= e->poolSize;
+    if (e->pooled && offset > e->poolOffset) {
+      ParticleSystem_movePooled(ps, e, offset);
+    }
+  }
+  for (size_t i = 0; i < ps->length; i++) {
+    Emitter *e = ps->emitters[i];
+    if (!e->pooled) {
+      ParticleSystem_movePooled(ps, e, offset);
+    }
+    offset += e->poolSize;
+  }
+}
+
+// ParticleSystem_poolLayout returns the layout of a pool storing the
+// arrays of all registered Emitters.
+static unsigned int ParticleSystem_poolLayout(const ParticleSystem *ps) {
+  unsigned int layout = 0;
+  for (size_t i = 0; i < ps->length; i++) {
+    layout |= ps->emitters[i]->particles.layout;
+  }
+  return layout;
+}
+
+// ParticleSystem_setPool is ParticleSystem_SetPool without finishing a
+// pipelined update or presenting the result.
+static bool ParticleSystem_setPool(ParticleSystem *ps, size_t budget) {
+  if (budget == 0 && ps->pool.block == NULL) {
+    return true;
+  }
+  if (budget == 0) {
+    bool ok = true;
+    for (size_t i = 0; i < ps->length; i++) {
+      Emitter *e = ps->emitters[i];
+      if (e->pooled && !Emitter_detach(e)) {
+        // Out of memory: the Emitter continues without particles.
+        e->particles = (ParticleData){.layout = e->particles.layout};
+        e->length = 0;
+        e->pooled = false;
+        ok = false;
+      }
+    }
+    ParticleData_free(&ps->pool);
+    return ok;
+  }
+
+  ParticleData old = ps->pool;
+  ParticleData pool;
+  if (!ParticleSystem_planPool(ps, budget, 0) ||
+      !ParticleData_alloc(&pool, budget, ParticleSystem_poolLayout(ps))) {
+    return false;
+  }
+  ps->pool = pool;
+  ps->poolCooldown = 0;
+  ParticleSystem_layoutPool(ps);
+  ParticleData_free(&old);
+  return true;
+}
+
+// The pool is only repacked for Emitters short of slots if the others can
+// spare the shortfall or 1/PARTIKEL_POOL_HYSTERESIS of the budget, and at
+// most every PARTIKEL_POOL_COOLDOWN updates, so slots freed a few at a time
+// do not move all particles every frame.
+#define PARTIKEL_POOL_HYSTERESIS 16
+#define PARTIKEL_POOL_COOLDOWN 8
+
+// ParticleSystem_balancePool lends slots to Emitters that run out of them
+// before the emission of an update. It only repacks the pool if Emitters
+// are short of slots and others have enough slots to spare, so a stable
+// demand does not move any particles. Emitters that got storage of their own
+// for other particle arrays (see Emitter_relayout) are pooled again, in
+// a new pool if it lacks their arrays.
+static void ParticleSystem_balancePool(ParticleSystem *ps, float dt) {
+  if (ps->pool.block == NULL) {
+    return;
+  }
+  bool detached = false;
+  for (size_t i = 0; i < ps->length; i++) {
+    detached = detached || !ps->emitters[i]->pooled;
+  }
+  if (detached) {
+    if ((ParticleSystem_poolLayout(ps) & ~ps->pool.layout) != 0) {
+      ParticleSystem_setPool(ps, ps->pool.capacity);
+    } else if (ParticleSystem_planPool(ps, ps->pool.capacity, dt)) {
+      ParticleSystem_layoutPool(ps);
+    }
+    return;
+  }
+  if (ps->poolCooldown > 0) {
+    ps->poolCooldown--;
+    return;
+  }
+  size_t shortfall = 0;
+  size_t spare = ps->pool.capacity;
+  for (size_t i = 0; i < ps->length; i++) {
+    Emitter *e = ps->emitters[i];
+    size_t demand = Emitter_poolDemand(e, dt);
+    size_t slots = e->particles.capacity;
+    spare -= slots;
+    if (demand > slots) {
+      shortfall += demand - slots;
+    } else {
+      spare += slots - demand;
+    }
+  }
+  size_t threshold = ps->pool.capacity / PARTIKEL_POOL_HYSTERESIS;
+  if (threshold > shortfall) {
+    threshold = shortfall;
+  }
+  if (shortfall > 0 && spare > 0 && spare >= threshold &&
+      ParticleSystem_planPool(ps, ps->pool.capacity, dt)) {
+    ParticleSystem_layoutPool(ps);
+    ps->poolCooldown = PARTIKEL_POOL_COOLDOWN;
+  }
+}
+
+
+// Particlesystem_New creates a new particle system
+// with the given amount of emitters.
+ParticleSystem *ParticleSystem_New(void) {
+  ParticleSystem *ps = PARTIKEL_ALLOC(1, sizeof(ParticleSystem));
+  if (ps == NULL) {
+    return NULL;
+  }
+  ps->active = false;
+  ps->length = 0;
+  ps->capacity = 1;
+  ps->origin = (Vector2){.x = 0, .y = 0};
+  ps->workers = NULL;
+  ps->pipeline = NULL;
+  ps->asyncLength = 0;
+  ps->pool = (ParticleData){0};
+  ps->poolCooldown = 0;
+  ps->fixedStep = 0;
+  ps->accumulator = 0;
+  ps->view = (Rectangle){0};
+  ps->offscreenInterval = 1;
+  ps->atlas = (Texture2D){0};
+  ps->colliders = (ParticleColliders){0};
+  ps->forces = (ParticleForces){0};
+  ps->queryGrid = (ParticleGrid){0};
+  ps->queryRefs = NULL;
+  ps->queryPositions = NULL;
+  ps->queryScratch = NULL;
+  ps->queryCapacity = 0;
+  ps->queryScratchCapacity = 0;
+  ps->queryStale = true;
+#ifdef PARTIKEL_STATS
+  ps->stats = (ParticleStats){0};
+  ps->trace = NULL;
+  ps->traceLength = 0;
+  ps->traceCapacity = 0;
+  ps->traceStart = 0;
+#endif
+  ps->emitters = PARTIKEL_ALLOC(ps->capacity, sizeof(Emitter *));
+  if (ps->emitters == NULL) {
+    PARTIKEL_FREE(ps);
+    return NULL;
+  }
+  return ps;
+}
+
+// ParticleSystem_buildFrame builds the quads of the Emitters within the
+// view into their back buffers, for the next ParticleSystem_swapFrames.
+static void ParticleSystem_buildFrame(ParticleSystem *ps) {
+  for (size_t i = 0; i < ps->length; i++) {
+    Emitter *e = ps->emitters[i];
+    Rectangle uv = Emitter_isPacked(e) ? e->atlasUv : PARTIKEL_FULL_UV;
+    e->builtQuads =
+        ParticleSystem_isVisible(ps, e) ? Emitter_prepareQuads(e, uv) : 0;
+  }
+}
+
+// ParticleSystem_swapFrames hands the frame built last over to
+// ParticleSystem_Draw.
+static void ParticleSystem_swapFrames(ParticleSystem *ps) {
+  for (size_t i = 0; i < ps->length; i++) {
+    Emitter_swapFrame(ps->emitters[i]);
+  }
+}
+
+// ParticleSystem_present makes ParticleSystem_Draw show the current state
+// in pipelined mode, after it was changed outside the pipelined update.
+static void ParticleSystem_present(ParticleSystem *ps) {
+  if (ps->pipeline != NULL) {
+    ParticleSystem_buildFrame(ps);
+    ParticleSystem_swapFrames(ps);
+  }
+}
+
+// ParticleSystem_finishAsync waits for a running pipelined update and
+// hands its frame over to ParticleSystem_Draw.
+static void ParticleSystem_finishAsync(ParticleSystem *ps) {
+#ifdef PARTIKEL_THREADS
+  ParticlePipeline *pp = ps->pipeline;
+  if (pp == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&pp->mutex);
+  while (pp->busy) {
+    pthread_cond_wait(&pp->done, &pp->mutex);
+  }
+  bool ready = pp->ready;
+  pp->ready = false;
+  pthread_mutex_unlock(&pp->mutex);
+  if (ready) {
+    ParticleSystem_swapFrames(ps);
+  }
+#else
+  (void)ps;
+#endif
+}
+
+// ParticleSystem_Register registers an emitter to the system.
+// The emitter will be controlled by all particle system functions.
+// Returns true on success and false otherwise.
+bool ParticleSystem_Register(ParticleSystem *ps, Emitter *emitter) {
+  ParticleSystem_finishAsync(ps);
+  // If there is no space for another emitter we have to realloc.
+  if (ps->length >= ps->capacity) {
+    // Double capacity.
+    Emitter **newEmitters =
+        realloc(ps->emitters, 2 * ps->capacity * sizeof(Emitter *));
+    if (newEmitters == NULL) {
+      return false;
+    }
+    ps->emitters = newEmitters;
+    ps->capacity *= 2;
+  }
+
+  // Now the new Emitter can be registered.
+  ps->emitters[ps->length] = emitter;
+  ps->length++;
+
+  Emitter_setInterpolation(emitter, ps->fixedStep);
+  Emitter_updateBounds(emitter);
+  emitter->colliders = &ps->colliders;
+  emitter->forces = &ps->forces;
+  ps->queryStale = true;
+
+  // With a pool, the Emitter hands its particles over to it. A pool
+  // lacking its particle arrays is replaced by one storing them.
+  if (ps->pool.block != NULL) {
+    bool fits = (emitter->particles.layout & ~ps->pool.layout) == 0;
+    if (fits ? !ParticleSystem_planPool(ps, ps->pool.capacity, 0)
+             : !ParticleSystem_setPool(ps, ps->pool.capacity)) {
+      ps->length--;
+      ps->emitters[ps->length] = NULL;
+      emitter->colliders = NULL;
+      emitter->forces = NULL;
+      return false;
+    }
+    if (fits) {
+      ParticleSystem_layoutPool(ps);
+    }
+  }
+  ParticleSystem_present(ps);
+
+  return true;
+}
+
+// ParticleSystem_Deregister deregisters an Emitter by its pointer.
+// Returns true on success and false otherwise.
+bool ParticleSystem_Deregister(ParticleSystem *ps, Emitter *emitter) {
+  ParticleSystem_finishAsync(ps);
+  for (size_t i = 0; i < ps->length; i++) {
+    if (ps->emitters[i] == emitter) {
+      // A pooled Emitter needs storage of its own again. Its slots are
+      // lent to the others by the next update.
+      if (emitter->pooled && !Emitter_detach(emitter)) {
+        return false;
+      }
+      Emitter_setInterpolation(emitter, 0);
+      emitter->colliders = NULL;
+      emitter->forces = NULL;
+      emitter->atlasTexture = 0;
+      emitter->frontQuads = 0;
+      ps->queryStale = true;
+      // Remove this emitter by replacing its pointer with the
+      // last pointer, if it is not the only Emitter. The pool keeps the
+      // Emitters in the order of their slots, so there the others move up.
+      if (ps->pool.block != NULL) {
+        memmove(ps->emitters + i, ps->emitters + i + 1,
+                (ps->length - i - 1) * sizeof(Emitter *));
+      } else if (i != ps->length - 1) {
+        ps->emitters[i] = ps->emitters[ps->length - 1];
+      }
+      // Then NULL the last emitter. It is either a duplicate or
+      // the removed one.
+      ps->length--;
+      ps->emitters[ps->length] = NULL;
+      ParticleSystem_present(ps);
+
+      return true;
+    }
+  }
+  // Emitter not found.
+  return false;
+}
+
+// ParticleSystem_SetOrigin sets the origin for all registered Emitters.
+void ParticleSystem_SetOrigin(ParticleSystem *ps, Vector2 origin) {
+  ParticleSystem_finishAsync(ps);
+  ps->origin = origin;
+  for (size_t i = 0; i < ps->length; i++) {
+    ps->emitters[i]->config.origin = origin;
+    Emitter_includeOrigin(ps->emitters[i]);
+  }
+  ParticleSystem_present(ps);
+}
+
+// ParticleSystem_Start runs Emitter_Start on all registered Emitters.
+void ParticleSystem_Start(ParticleSystem *ps) {
+  ParticleSystem_finishAsync(ps);
+  for (size_t i = 0; i < ps->length; i++) {
+    Emitter_Start(ps->emitters[i]);
+  }
+}
+
+// ParticleSystem_Stop runs Emitter_Stop on all registered Emitters.
+void ParticleSystem_Stop(ParticleSystem *ps) {
+  ParticleSystem_finishAsync(ps);
+  for (size_t i = 0; i < ps->length; i++) {
+    Emitter_Stop(ps->emitters[i]);
+  }
+}
+
+// ParticleSystem_Burst runs Emitter_Burst on all registered Emitters.
+void ParticleSystem_Burst(ParticleSystem *ps) {
+  ParticleSystem_finishAsync(ps);
+  for (size_t i = 0; i < ps->length; i++) {
+    Emitter_Burst(ps->emitters[i]);
+  }
+  ps->queryStale = true;
+  ParticleSystem_present(ps);
+}
+
+// ParticleSystem_isDrawn returns whether ParticleSystem_Draw draws
+// Emitter e. In pipelined mode that was decided with the frame.
+static bool ParticleSystem_isDrawn(const ParticleSystem *ps,
+                                   const Emitter *e) {
+  return ps->pipeline != NULL ? e->frontQuads > 0
+                              : ParticleSystem_isVisible(ps, e);
+}
+
+// ParticleSystem_drawEmitter draws Emitter e on its own. In pipelined mode
+// it draws the quads handed over by the last ParticleSystem_Sync.
+static void ParticleSystem_drawEmitter(ParticleSystem *ps, Emitter *e) {
+  if (ps->pipeline != NULL) {
+    Emitter_submit(e, e->frontVertices, e->frontQuads);
+  } else {
+    Emitter_Draw(e);
+  }
+}
+
+// ParticleSystem_drawBatched draws the Emitters within the view from the
+// atlas. Consecutive Emitters with the same blend mode share one blend
+// mode switch and, with the same texture, one draw call. Emitters whose
+// texture is not in the atlas are drawn on their own.
+static void ParticleSystem_drawBatched(ParticleSystem *ps) {
+  bool blending = false;
+  BlendMode blendMode = BLEND_ALPHA;
+  for (size_t i = 0; i < ps->length; i++) {
+    Emitter *e = ps->emitters[i];
+    if (!ParticleSystem_isDrawn(ps, e)) {
+      continue;
+    }
+    bool packed = Emitter_isPacked(e);
+    if (blending && (!packed || e->config.blendMode != blendMode)) {
+      EndBlendMode();
+      blending = false;
+    }
+    if (!packed) {
+      ParticleSystem_drawEmitter(ps, e);
+      continue;
+    }
+    if (!blending) {
+      blendMode = e->config.blendMode;
+      BeginBlendMode(blendMode);
+      blending = true;
+    }
+    PARTIKEL_STAT(uint64_t start = PARTIKEL_CLOCK_NS();)
+    if (ps->pipeline != NULL) {
+      partikel_submitQuads(ps->atlas, e->frontVertices, e->frontQuads);
+    } else {
+      size_t quads = Emitter_prepareQuads(e, e->atlasUv);
+      partikel_submitQuads(ps->atlas, e->vertices, quads);
+    }
+    PARTIKEL_STAT(e->stats.draws++;
+                  e->stats.drawNs += PARTIKEL_CLOCK_NS() - start;)
+  }
+  if (blending) {
+    EndBlendMode();
+  }
+}
+
+// ParticleSystem_Draw runs Emitter_Draw on all registered Emitters within
+// the view. With an atlas (see ParticleSystem_BuildAtlas) they are drawn
+// in batches instead. In pipelined mode (see ParticleSystem_SetPipelined)
+// it draws the frame handed over by the last ParticleSystem_Sync and
+// does not touch the particles, so it may run during an update.
+void ParticleSystem_Draw(ParticleSystem *ps) {
+  PARTIKEL_STAT(uint64_t start = PARTIKEL_CLOCK_NS(); size_t drawn = 0;
+                unsigned int thread = 0;)
+  if (ps->atlas.id != 0) {
+    ParticleSystem_drawBatched(ps);
+  } else {
+    for (size_t i = 0; i < ps->length; i++) {
+      if (ParticleSystem_isDrawn(ps, ps->emitters[i])) {
+        ParticleSystem_drawEmitter(ps, ps->emitters[i]);
+      }
+    }
+  }
+  PARTIKEL_STAT(for (size_t i = 0; i < ps->length; i++) {
+    Emitter *e = ps->emitters[i];
+    if (ParticleSystem_isDrawn(ps, e)) {
+      drawn += ps->pipeline != NULL ? e->frontQuads : e->length;
+    }
+  })
+#if defined(PARTIKEL_STATS) && defined(PARTIKEL_THREADS)
+  if (ps->pipeline != NULL) {
+    thread = ps->workers != NULL ? ps->workers->count : 1;
+  }
+#endif
+  PARTIKEL_STAT(
+      uint64_t end = PARTIKEL_CLOCK_NS(); ps->stats.draws++;
+      ps->stats.drawNs += end - start;
+      ParticleSystem_trace(ps, "ParticleSystem_Draw", start, end, thread,
+                           -1, drawn);)
+}
+
+// Pixels left free around every texture in the atlas, so filtering does
+// not blend in its neighbours.
+#define PARTIKEL_ATLAS_PADDING 2
+
+// AtlasEntry is a texture placed in the atlas of a ParticleSystem.
+typedef struct AtlasEntry {
+  Texture2D texture;
+  int x;
+  int y;
+} AtlasEntry;
+
+// partikel_packAtlas places the n textures, sorted by decreasing height,
+// on shelves in a square atlas of the given size. Returns false if they
+// do not fit.
+static bool partikel_packAtlas(AtlasEntry *entries, size_t n, int size) {
+  int x = 0;
+  int y = 0;
+  int shelf = 0; // Height of the current shelf.
+  for (size_t i = 0; i < n; i++) {
+    int w = entries[i].texture.width + 2 * PARTIKEL_ATLAS_PADDING;
+    int h = entries[i].texture.height + 2 * PARTIKEL_ATLAS_PADDING;
+    if (x + w > size) {
+      x = 0;
+      y += shelf;
+      shelf = 0;
+    }
+    if (x + w > size || y + h > size) {
+      return false;
+    }
+    entries[i].x = x + PARTIKEL_ATLAS_PADDING;
+    entries[i].y = y + PARTIKEL_ATLAS_PADDING;
+    x += w;
+    shelf = h > shelf ? h : shelf;
+  }
+  return true;
+}
+
+// ParticleSystem_BuildAtlas packs the textures of all registered Emitters
+// into one atlas texture. ParticleSystem_Draw then draws consecutive
+// Emitters with the same blend mode as one batch, without a flush per
+// Emitter; register them next to each other to make use of it. Textures
+// are read back from the GPU, so call it after loading them and again
+// after registering Emitters with new textures. Textures larger than
+// PARTIKEL_ATLAS_MAX_SIZE stay on their own. Returns false if no atlas
+// could be built.
+bool ParticleSystem_BuildAtlas(ParticleSystem *ps) {
+  // FreeAtlas waits for a pipelined update.
+  ParticleSystem_FreeAtlas(ps);
+  AtlasEntry *entries = PARTIKEL_ALLOC(ps->length + 1, sizeof(AtlasEntry));
+  if (entries == NULL) {
+    return false;
+  }
+  // Collect each texture once, sorted by decreasing height.
+  size_t n = 0;
+  int limit = PARTIKEL_ATLAS_MAX_SIZE - 2 * PARTIKEL_ATLAS_PADDING;
+  for (size_t i = 0; i < ps->length; i++) {
+    Texture2D t = ps->emitters[i]->config.texture;
+    bool known = t.id == 0 || t.width > limit || t.height > limit;
+    for (size_t k = 0; k < n && !known; k++) {
+      known = entries[k].texture.id == t.id;
+    }
+    if (known) {
+      continue;
+    }
+    size_t k = n++;
+    for (; k > 0 && entries[k - 1].texture.height < t.height; k--) {
+      entries[k] = entries[k - 1];
+    }
+    entries[k] = (AtlasEntry){.texture = t};
+  }
+
+  int size = 64;
+  while (n > 0 && !partikel_packAtlas(entries, n, size)) {
+    if (size >= PARTIKEL_ATLAS_MAX_SIZE) {
+      // Pack the tallest textures that fit.
+      while (n > 0 && !partikel_packAtlas(entries, n, size)) {
+        n--;
+      }
+      break;
+    }
+    size *= 2;
+  }
+  if (n == 0) {
+    PARTIKEL_FREE(entries);
+    return false;
+  }
+
+  Image image = GenImageColor(size, size, (Color){0, 0, 0, 0});
+  for (size_t k = 0; k < n; k++) {
+    Texture2D t = entries[k].texture;
+    Image source = LoadImageFromTexture(t);
+    Rectangle area = {.x = 0,
+                      .y = 0,
+                      .width = (float)t.width,
+                      .height = (float)t.height};
+    Rectangle place = {.x = (float)entries[k].x,
+                       .y = (float)entries[k].y,
+                       .width = (float)t.width,
+                       .height = (float)t.height};
+    ImageDraw(&image, source, area, place, WHITE);
+    UnloadImage(source);
+  }
+  ps->atlas = LoadTextureFromImage(image);
+  UnloadImage(image);
+  if (ps->atlas.id == 0) {
+    PARTIKEL_FREE(entries);
+    return false;
+  }
 
-// ParticleSystem_Draw runs Emitter_Draw on all registered Emitters.
-void ParticleSystem_Draw(ParticleSystem *ps) {
   for (size_t i = 0; i < ps->length; i++) {
-    Emitter_Draw(ps->emitters[i]);
+    Emitter *e = ps->emitters[i];
+    for (size_t k = 0; k < n; k++) {
+      const AtlasEntry *a = &entries[k];
+      if (a->texture.id == e->config.texture.id) {
+        e->atlasTexture = a->texture.id;
+        float scale = 1.0f / (float)size;
+        e->atlasUv = (Rectangle){.x = (float)a->x * scale,
+                                 .y = (float)a->y * scale,
+                                 .width = (float)a->texture.width * scale,
+                                 .height = (float)a->texture.height * scale};
+      }
+    }
   }
+  PARTIKEL_FREE(entries);
+  ParticleSystem_present(ps);
+  return true;
 }
 
-// ParticleSystem_Update runs Emitter_Update on all registered Emitters.
-unsigned long ParticleSystem_Update(ParticleSystem *ps, float dt) {
+// ParticleSystem_FreeAtlas unloads the atlas, so every Emitter is drawn on
+// its own again. ParticleSystem_Free unloads it, too, so free a system
+// with an atlas before closing the window.
+void ParticleSystem_FreeAtlas(ParticleSystem *ps) {
+  ParticleSystem_finishAsync(ps);
+  if (ps->atlas.id != 0) {
+    UnloadTexture(ps->atlas);
+  }
+  ps->atlas = (Texture2D){0};
+  for (size_t i = 0; i < ps->length; i++) {
+    ps->emitters[i]->atlasTexture = 0;
+  }
+  ParticleSystem_present(ps);
+}
+
+// ParticleSystem_finishStep refreshes the bounds of the Emitters that
+// were updated and returns the amount of live particles. Bounds are only
+// needed for culling, so they are skipped without a view.
+static unsigned long ParticleSystem_finishStep(ParticleSystem *ps) {
+  bool culling = ps->view.width > 0 && ps->view.height > 0;
   size_t counter = 0;
+  ps->queryStale = true;
+  for (size_t i = 0; i < ps->length; i++) {
+    Emitter *e = ps->emitters[i];
+    if (culling && e->stepDt > 0) {
+      Emitter_updateBounds(e);
+    }
+    counter += e->length;
+  }
+  return counter;
+}
+
+#if defined(PARTIKEL_STATS) && defined(PARTIKEL_THREADS)
+// ParticleSystem_traceJobs adds the time of the first jobCount jobs run by
+// the workers to their Emitters and records them. The jobs are in the
+// order of the Emitters.
+static void ParticleSystem_traceJobs(ParticleSystem *ps, size_t jobCount) {
+  const ParticleJob *jobs = ps->workers->jobs;
+  size_t k = 0;
+  for (size_t i = 0; i < ps->length; i++) {
+    Emitter *e = ps->emitters[i];
+    for (; k < jobCount && jobs[k].emitter == e; k++) {
+      e->stats.updateNs += jobs[k].ns;
+      ParticleSystem_trace(ps, "Emitter_step", jobs[k].start,
+                           jobs[k].start + jobs[k].ns, jobs[k].worker,
+                           (long)i, jobs[k].end - jobs[k].begin);
+    }
+  }
+}
+#endif
+
+// ParticleSystem_step runs Emitter_Update on all registered Emitters,
+// except for throttled ones outside the view.
+// With threads enabled (see ParticleSystem_SetThreads) the Emitters are
+// split into chunks of PARTIKEL_CHUNK_SIZE particles, which are stepped in
+// parallel. The result is exactly the same as for the serial update.
+static unsigned long ParticleSystem_step(ParticleSystem *ps, float dt) {
+  ParticleSystem_balancePool(ps, dt);
+  // The parallel passes only read the grids, so they are built up front.
+  ParticleColliders_build(&ps->colliders);
+  ParticleForces_build(&ps->forces);
+  for (size_t i = 0; i < ps->length; i++) {
+    ps->emitters[i]->stepDt = ParticleSystem_lodStep(ps, ps->emitters[i], dt);
+  }
+#ifdef PARTIKEL_THREADS
+  if (ps->workers != NULL) {
+    ParticleWorkers *pw = ps->workers;
+    bool queued = true;
+
+    // Spawning draws from the random streams, so it stays serial.
+    for (size_t i = 0; i < ps->length; i++) {
+      Emitter *e = ps->emitters[i];
+      if (e->stepDt <= 0) {
+        continue;
+      }
+      PARTIKEL_STAT(uint64_t start = PARTIKEL_CLOCK_NS();)
+      Emitter_emit(e, e->stepDt);
+      PARTIKEL_STAT(e->stats.updateNs += PARTIKEL_CLOCK_NS() - start;)
+      for (size_t b = 0; queued && b < e->length; b += PARTIKEL_CHUNK_SIZE) {
+        size_t end = b + PARTIKEL_CHUNK_SIZE;
+        queued = ParticleWorkers_addJob(
+            pw, (ParticleJob){.emitter = e,
+                              .begin = b,
+                              .end = end < e->length ? end : e->length,
+                              .dt = e->stepDt});
+      }
+    }
+    PARTIKEL_STAT(size_t jobCount = pw->jobCount;)
+    if (queued) {
+      ParticleWorkers_execute(pw);
+      PARTIKEL_STAT(ParticleSystem_traceJobs(ps, jobCount);)
+    } else {
+      // Out of memory for the job list: step everything on this thread.
+      pw->jobCount = 0;
+      for (size_t i = 0; i < ps->length; i++) {
+        Emitter *e = ps->emitters[i];
+        if (e->stepDt > 0) {
+          Emitter_step(e, 0, e->length, e->stepDt);
+        }
+      }
+    }
+
+    for (size_t i = 0; i < ps->length; i++) {
+      Emitter *e = ps->emitters[i];
+      if (e->stepDt > 0) {
+        PARTIKEL_STAT(uint64_t start = PARTIKEL_CLOCK_NS();)
+        Emitter_compact(e);
+        PARTIKEL_STAT(e->stats.updates++;
+                      e->stats.updateNs += PARTIKEL_CLOCK_NS() - start;)
+      }
+    }
+    return ParticleSystem_finishStep(ps);
+  }
+#endif
+  for (size_t i = 0; i < ps->length; i++) {
+    Emitter *e = ps->emitters[i];
+    if (e->stepDt > 0) {
+      PARTIKEL_STAT(uint64_t start = PARTIKEL_CLOCK_NS();)
+      Emitter_Update(e, e->stepDt);
+      PARTIKEL_STAT(ParticleSystem_trace(ps, "Emitter_Update", start,
+                                         PARTIKEL_CLOCK_NS(), 0, (long)i,
+                                         e->length);)
+    }
+  }
+  return ParticleSystem_finishStep(ps);
+}
+
+// ParticleSystem_advance runs the steps of ParticleSystem_Update.
+static unsigned long ParticleSystem_advance(ParticleSystem *ps, float dt) {
+  if (ps->fixedStep <= 0) {
+    return ParticleSystem_step(ps, dt);
+  }
+
+  ps->accumulator += dt;
+  int steps = 0;
+  while (ps->accumulator >= ps->fixedStep) {
+    if (steps == PARTIKEL_MAX_FIXED_STEPS) {
+      ps->accumulator = 0;
+      break;
+    }
+    ParticleSystem_step(ps, ps->fixedStep);
+    ps->accumulator -= ps->fixedStep;
+    steps++;
+  }
+
+  unsigned long counter = 0;
+  for (size_t i = 0; i < ps->length; i++) {
+    ps->emitters[i]->alpha = ps->accumulator / ps->fixedStep;
+    ps->emitters[i]->drawAhead = ps->accumulator;
+    counter += ps->emitters[i]->length;
+  }
+  return counter;
+}
+
+// ParticleSystem_Prewarm advances all registered Emitters by seconds with
+// Emitter_Prewarm. A pool is rebalanced for the demand of the longest
+// life first. Returns the amount of live particles.
+unsigned long ParticleSystem_Prewarm(ParticleSystem *ps, float seconds) {
+  ParticleSystem_finishAsync(ps);
+  float life = 0;
+  for (size_t i = 0; i < ps->length; i++) {
+    FloatRange age = ps->emitters[i]->config.age;
+    life = age.max > life ? age.max : life;
+    life = age.min > life ? age.min : life;
+  }
+  ps->poolCooldown = 0;
+  ParticleSystem_balancePool(ps, seconds < life ? seconds : life);
+
+  unsigned long counter = 0;
   for (size_t i = 0; i < ps->length; i++) {
-    counter += Emitter_Update(ps->emitters[i], dt);
+    counter += Emitter_Prewarm(ps->emitters[i], seconds);
+  }
+  ps->queryStale = true;
+  ParticleSystem_present(ps);
+  return counter;
+}
+
+// ParticleSystem_runUpdate runs ParticleSystem_Update on the calling or
+// the pipeline thread.
+static unsigned long ParticleSystem_runUpdate(ParticleSystem *ps,
+                                              float dt) {
+  PARTIKEL_STAT(uint64_t start = PARTIKEL_CLOCK_NS();)
+  unsigned long counter = ParticleSystem_advance(ps, dt);
+  PARTIKEL_STAT(
+      uint64_t end = PARTIKEL_CLOCK_NS(); ps->stats.updates++;
+      ps->stats.updateNs += end - start;
+      if (counter > ps->stats.peakLength) {
+        ps->stats.peakLength = counter;
+      } ParticleSystem_trace(ps, "ParticleSystem_Update", start, end, 0, -1,
+                             counter);)
+  return counter;
+}
+
+// ParticleSystem_Update advances all registered Emitters by dt seconds and
+// returns the amount of live particles. In fixed step mode (see
+// ParticleSystem_SetFixedRate) it runs as many fixed steps as have
+// accumulated, at most PARTIKEL_MAX_FIXED_STEPS, and sets the fraction
+// the draw functions interpolate by. In pipelined mode it finishes a
+// running update first and the result is drawn right away.
+unsigned long ParticleSystem_Update(ParticleSystem *ps, float dt) {
+  ParticleSystem_finishAsync(ps);
+  unsigned long counter = ParticleSystem_runUpdate(ps, dt);
+  ParticleSystem_present(ps);
+  return counter;
+}
+
+#ifdef PARTIKEL_THREADS
+
+// ParticlePipeline_main is the loop of the pipeline thread. It runs each
+// requested update and builds the quads of the resulting frame.
+static void *ParticlePipeline_main(void *arg) {
+  ParticlePipeline *pp = arg;
+  pthread_mutex_lock(&pp->mutex);
+  for (;;) {
+    while (!pp->quit && !pp->busy) {
+      pthread_cond_wait(&pp->wake, &pp->mutex);
+    }
+    if (pp->quit) {
+      pthread_mutex_unlock(&pp->mutex);
+      return NULL;
+    }
+    pthread_mutex_unlock(&pp->mutex);
+
+    ParticleSystem *ps = pp->ps;
+    ps->asyncLength = ParticleSystem_runUpdate(ps, pp->dt);
+    ParticleSystem_buildFrame(ps);
+
+    pthread_mutex_lock(&pp->mutex);
+    pp->busy = false;
+    pp->ready = true;
+    pthread_cond_signal(&pp->done);
+  }
+}
+
+// ParticlePipeline_free stops and joins the pipeline thread after its
+// current update.
+static void ParticlePipeline_free(ParticlePipeline *pp) {
+  if (pp == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&pp->mutex);
+  pp->quit = true;
+  pthread_cond_signal(&pp->wake);
+  pthread_mutex_unlock(&pp->mutex);
+  pthread_join(pp->thread, NULL);
+  pthread_cond_destroy(&pp->done);
+  pthread_cond_destroy(&pp->wake);
+  pthread_mutex_destroy(&pp->mutex);
+  PARTIKEL_FREE(pp);
+}
+
+// ParticlePipeline_new starts the pipeline thread of ParticleSystem ps.
+static ParticlePipeline *ParticlePipeline_new(ParticleSystem *ps) {
+  ParticlePipeline *pp = PARTIKEL_ALLOC(1, sizeof(ParticlePipeline));
+  if (pp == NULL) {
+    return NULL;
   }
+  pp->ps = ps;
+  pthread_mutex_init(&pp->mutex, NULL);
+  pthread_cond_init(&pp->wake, NULL);
+  pthread_cond_init(&pp->done, NULL);
+  if (pthread_create(&pp->thread, NULL, ParticlePipeline_main, pp) != 0) {
+    pthread_cond_destroy(&pp->done);
+    pthread_cond_destroy(&pp->wake);
+    pthread_mutex_destroy(&pp->mutex);
+    PARTIKEL_FREE(pp);
+    return NULL;
+  }
+  return pp;
+}
+
+#endif // PARTIKEL_THREADS
+
+// ParticleSystem_UpdateAsync starts ParticleSystem_Update(ps, dt) on the
+// pipeline thread and returns right away (see
+// ParticleSystem_SetPipelined). Meanwhile ParticleSystem_Draw may draw the
+// previous frame. The other functions of the system finish the update
+// first and present their changes right away, but its Emitters must not be
+// touched until ParticleSystem_Sync. A running update is finished first.
+// Without pipelined mode it updates on the calling thread.
+void ParticleSystem_UpdateAsync(ParticleSystem *ps, float dt) {
+#ifdef PARTIKEL_THREADS
+  ParticlePipeline *pp = ps->pipeline;
+  if (pp != NULL) {
+    ParticleSystem_finishAsync(ps);
+    pthread_mutex_lock(&pp->mutex);
+    pp->dt = dt;
+    pp->busy = true;
+    pthread_cond_signal(&pp->wake);
+    pthread_mutex_unlock(&pp->mutex);
+    return;
+  }
+#endif
+  ps->asyncLength = ParticleSystem_Update(ps, dt);
+}
+
+// ParticleSystem_Sync is the fence of pipelined mode: it waits for the
+// update started by ParticleSystem_UpdateAsync and hands the new frame
+// over to ParticleSystem_Draw. Afterwards the system may be used as
+// usual. Returns the amount of live particles after that update, or 0 if
+// none was started since the last call.
+unsigned long ParticleSystem_Sync(ParticleSystem *ps) {
+  ParticleSystem_finishAsync(ps);
+  unsigned long counter = ps->asyncLength;
+  ps->asyncLength = 0;
   return counter;
 }
 
+// ParticleSystem_SetFixedRate makes ParticleSystem_Update simulate in
+// fixed steps of 1 / stepsPerSecond seconds, independent of the frame
+// rate. Drawing interpolates the particle positions between the last two
+// steps, so a rate below the frame rate still moves smoothly. 0 switches
+// back to one step per update.
+void ParticleSystem_SetFixedRate(ParticleSystem *ps, float stepsPerSecond) {
+  ParticleSystem_finishAsync(ps);
+  ps->fixedStep = stepsPerSecond > 0 ? 1.0f / stepsPerSecond : 0;
+  ps->accumulator = 0;
+  for (size_t i = 0; i < ps->length; i++) {
+    Emitter_setInterpolation(ps->emitters[i], ps->fixedStep);
+  }
+  ParticleSystem_present(ps);
+}
+
+// ParticleSystem_SetView sets the area of the world that is visible.
+// ParticleSystem_Draw skips Emitters whose bounds lie outside of it and
+// ParticleSystem_Update throttles them (see
+// ParticleSystem_SetOffscreenInterval). A view with a width or height
+// <= 0 disables culling.
+void ParticleSystem_SetView(ParticleSystem *ps, Rectangle view) {
+  ParticleSystem_finishAsync(ps);
+  bool culling = ps->view.width > 0 && ps->view.height > 0;
+  ps->view = view;
+  if (!culling) {
+    // The bounds were not kept up to date without a view.
+    for (size_t i = 0; i < ps->length; i++) {
+      Emitter_updateBounds(ps->emitters[i]);
+    }
+  }
+  ParticleSystem_present(ps);
+}
+
+// ParticleSystem_SetCamera sets the view to the area of the world visible
+// through camera on a screen of width x height pixels.
+void ParticleSystem_SetCamera(ParticleSystem *ps, Camera2D camera, int width,
+                              int height) {
+  Vector2 corners[4] = {
+      GetScreenToWorld2D((Vector2){.x = 0, .y = 0}, camera),
+      GetScreenToWorld2D((Vector2){.x = (float)width, .y = 0}, camera),
+      GetScreenToWorld2D((Vector2){.x = 0, .y = (float)height}, camera),
+      GetScreenToWorld2D((Vector2){.x = (float)width, .y = (float)height},
+                         camera)};
+  // A rotated camera sees a rotated rectangle, take its bounding box.
+  Vector2 min = corners[0];
+  Vector2 max = corners[0];
+  for (int i = 1; i < 4; i++) {
+    min.x = fminf(min.x, corners[i].x);
+    min.y = fminf(min.y, corners[i].y);
+    max.x = fmaxf(max.x, corners[i].x);
+    max.y = fmaxf(max.y, corners[i].y);
+  }
+  ParticleSystem_SetView(ps, (Rectangle){.x = min.x,
+                                         .y = min.y,
+                                         .width = max.x - min.x,
+                                         .height = max.y - min.y});
+}
+
+// ParticleSystem_SetOffscreenInterval makes ParticleSystem_Update advance
+// Emitters outside the view only every interval-th update, by the time
+// accumulated meanwhile. EmitterConfig.offscreenInterval overrides it per
+// Emitter, e.g. 1 for effects that must never lag. The default 1 updates
+// all Emitters every time.
+void ParticleSystem_SetOffscreenInterval(ParticleSystem *ps,
+                                         unsigned int interval) {
+  ParticleSystem_finishAsync(ps);
+  ps->offscreenInterval = interval;
+}
+
+// ParticleSystem_SetThreads sets the amount of threads (including the
+// calling one) used by ParticleSystem_Update. 0 or 1 switches back to the
+// serial update. Returns false if the threads could not be started or the
+// library was built without PARTIKEL_THREADS.
+bool ParticleSystem_SetThreads(ParticleSystem *ps, unsigned int threads) {
+#ifdef PARTIKEL_THREADS
+  // A pipelined update may be running on the pool.
+  ParticleSystem_finishAsync(ps);
+  ParticleWorkers_free(ps->workers);
+  ps->workers = NULL;
+  if (threads <= 1) {
+    return true;
+  }
+  ps->workers = ParticleWorkers_new(threads);
+  return ps->workers != NULL;
+#else
+  (void)ps;
+  return threads <= 1;
+#endif
+}
+
+// ParticleSystem_SetPipelined switches pipelined mode on or off. In
+// pipelined mode the particles are double-buffered: ParticleSystem_Draw
+// submits the quads of frame N, while ParticleSystem_UpdateAsync computes
+// frame N + 1 on a thread of its own, including its quads and sorting.
+// ParticleSystem_Sync hands the new frame over. With
+// ParticleSystem_SetThreads that thread steps the particles on the pool.
+// Pipelined mode keeps a second quad buffer per Emitter. Returns false if
+// the thread could not be started or the library was built without
+// PARTIKEL_THREADS.
+bool ParticleSystem_SetPipelined(ParticleSystem *ps, bool pipelined) {
+#ifdef PARTIKEL_THREADS
+  if (pipelined == (ps->pipeline != NULL)) {
+    return true;
+  }
+  if (!pipelined) {
+    // The result of a running update stays for ParticleSystem_Sync.
+    ParticleSystem_finishAsync(ps);
+    ParticlePipeline_free(ps->pipeline);
+    ps->pipeline = NULL;
+    return true;
+  }
+  ps->pipeline = ParticlePipeline_new(ps);
+  if (ps->pipeline == NULL) {
+    return false;
+  }
+  // Draw the current state until the first update is synced.
+  ParticleSystem_present(ps);
+  return true;
+#else
+  (void)ps;
+  return !pipelined;
+#endif
+}
+
+// ParticleSystem_SetPool makes all registered Emitters share one
+// allocation of budget particles, including Emitters registered later.
+// Instead of holding its capacity all the time, each Emitter is guaranteed
+// its reserve and borrows further slots up to its capacity from the budget
+// while it needs them. A budget of 0 gives every Emitter storage of its
+// own again. Returns false if there is not enough memory or the budget
+// cannot hold the live particles and reserves.
+bool ParticleSystem_SetPool(ParticleSystem *ps, size_t budget) {
+  ParticleSystem_finishAsync(ps);
+  bool ok = ParticleSystem_setPool(ps, budget);
+  ParticleSystem_present(ps);
+  return ok;
+}
+
+// ParticleSystem_AddCollider adds a collider that particles of the
+// registered Emitters with collide set bounce off. Returns false if out of
+// memory.
+bool ParticleSystem_AddCollider(ParticleSystem *ps, Collider collider) {
+  ParticleSystem_finishAsync(ps);
+  ParticleColliders *pc = &ps->colliders;
+  if (pc->length >= pc->capacity) {
+    size_t capacity = pc->capacity == 0 ? 16 : 2 * pc->capacity;
+    Collider *colliders = PARTIKEL_ALLOC(capacity, sizeof(Collider));
+    if (colliders == NULL) {
+      return false;
+    }
+    if (pc->length > 0) {
+      memcpy(colliders, pc->colliders, pc->length * sizeof(Collider));
+    }
+    PARTIKEL_FREE(pc->colliders);
+    pc->colliders = colliders;
+    pc->capacity = capacity;
+  }
+  pc->colliders[pc->length++] = collider;
+  pc->stale = true;
+  return true;
+}
+
+// ParticleSystem_ClearColliders removes all colliders.
+void ParticleSystem_ClearColliders(ParticleSystem *ps) {
+  ParticleSystem_finishAsync(ps);
+  ps->colliders.length = 0;
+  ps->colliders.stale = true;
+}
+
+// ParticleSystem_AddForceField adds a force field acting on the registered
+// Emitters whose forceLayers share a bit with its layers. Its index for
+// ParticleSystem_SetForceField is the amount of fields added before.
+// Returns false if out of memory.
+bool ParticleSystem_AddForceField(ParticleSystem *ps, ForceField field) {
+  ParticleSystem_finishAsync(ps);
+  ParticleForces *pf = &ps->forces;
+  if (pf->length >= pf->capacity) {
+    size_t capacity = pf->capacity == 0 ? 16 : 2 * pf->capacity;
+    ForceField *fields = PARTIKEL_ALLOC(capacity, sizeof(ForceField));
+    if (fields == NULL) {
+      return false;
+    }
+    if (pf->length > 0) {
+      memcpy(fields, pf->fields, pf->length * sizeof(ForceField));
+    }
+    PARTIKEL_FREE(pf->fields);
+    pf->fields = fields;
+    pf->capacity = capacity;
+  }
+  pf->fields[pf->length++] = field;
+  pf->stale = true;
+  return true;
+}
+
+// ParticleSystem_SetForceField replaces the force field at index, e.g. to
+// move it. Returns false if there is no such field.
+bool ParticleSystem_SetForceField(ParticleSystem *ps, size_t index,
+                                  ForceField field) {
+  ParticleSystem_finishAsync(ps);
+  if (index >= ps->forces.length) {
+    return false;
+  }
+  ps->forces.fields[index] = field;
+  ps->forces.stale = true;
+  return true;
+}
+
+// ParticleSystem_ClearForceFields removes all force fields.
+void ParticleSystem_ClearForceFields(ParticleSystem *ps) {
+  ParticleSystem_finishAsync(ps);
+  ps->forces.length = 0;
+  ps->forces.stale = true;
+}
+
+// ParticleSystem_SetForceGrid samples the point and vortex fields acting
+// on all layers (PARTIKEL_ALL_LAYERS) at the corners of square cells of
+// cellSize pixels over area. Particles inside interpolate the samples
+// instead of evaluating those fields, which makes their cost independent
+// of the amount of fields. The error grows with the cell size, strongly
+// near the centers of the fields. The grid is sampled again in the next
+// update after the fields changed. Its cells grow if area would need more
+// than PARTIKEL_GRID_MAX_CELLS. An area with a width or height <= 0 turns
+// the grid off. Returns false if out of memory, then the grid is off.
+bool ParticleSystem_SetForceGrid(ParticleSystem *ps, Rectangle area,
+                                 float cellSize) {
+  ParticleSystem_finishAsync(ps);
+  ParticleForces *pf = &ps->forces;
+  pf->gridArea = (Rectangle){0};
+  pf->gridReady = false;
+  pf->stale = true;
+  if (area.width <= 0 || area.height <= 0 || !(cellSize > 0)) {
+    return true;
+  }
+  while ((area.width / cellSize + 1) * (area.height / cellSize + 1) >
+         PARTIKEL_GRID_MAX_CELLS) {
+    cellSize *= 2;
+  }
+  pf->columns = (int)ceilf(area.width / cellSize);
+  pf->rows = (int)ceilf(area.height / cellSize);
+  size_t count = ((size_t)pf->columns + 1) * ((size_t)pf->rows + 1);
+  size_t capacity = pf->gridCapacity;
+  float *gridX = partikel_reserve(pf->gridX, &capacity, count, sizeof(float));
+  if (gridX == NULL) {
+    return false;
+  }
+  pf->gridX = gridX;
+  float *gridY =
+      partikel_reserve(pf->gridY, &pf->gridCapacity, count, sizeof(float));
+  if (gridY == NULL) {
+    return false;
+  }
+  pf->gridY = gridY;
+  pf->gridArea = area;
+  pf->gridCellSize = cellSize;
+  return true;
+}
+
+// ParticleSystem_buildQueryGrid sorts the live particles of all Emitters
+// into the query grid, unless it is up to date. Returns false if out of
+// memory.
+static bool ParticleSystem_buildQueryGrid(ParticleSystem *ps) {
+  if (!ps->queryStale) {
+    return true;
+  }
+  size_t total = 0;
+  for (size_t i = 0; i < ps->length; i++) {
+    total += ps->emitters[i]->length;
+  }
+  Vector2 *scratch = partikel_reserve(
+      ps->queryScratch, &ps->queryScratchCapacity, total, sizeof(Vector2));
+  if (scratch == NULL) {
+    return false;
+  }
+  ps->queryScratch = scratch;
+  // Both arrays grow alike. If only refs grows, queryCapacity still fits.
+  size_t refCapacity = ps->queryCapacity;
+  size_t positionCapacity = ps->queryCapacity;
+  ParticleRef *refs = partikel_reserve(ps->queryRefs, &refCapacity, total,
+                                       sizeof(ParticleRef));
+  if (refs == NULL) {
+    return false;
+  }
+  ps->queryRefs = refs;
+  Vector2 *positions = partikel_reserve(
+      ps->queryPositions, &positionCapacity, total, sizeof(Vector2));
+  if (positions == NULL) {
+    return false;
+  }
+  ps->queryPositions = positions;
+  ps->queryCapacity = positionCapacity;
+
+  // Evaluate the positions once and find the area they cover. Particles
+  // at non-finite positions are left out of the grid.
+  Rectangle area = {0};
+  bool first = true;
+  size_t k = 0;
+  for (size_t i = 0; i < ps->length; i++) {
+    const Emitter *e = ps->emitters[i];
+    for (size_t j = 0; j < e->length; j++, k++) {
+      Vector2 p = Emitter_position(e, j);
+      scratch[k] = p;
+      if (!isfinite(p.x) || !isfinite(p.y)) {
+        continue;
+      }
+      if (first) {
+        area = (Rectangle){.x = p.x, .y = p.y};
+        first = false;
+      }
+      float right = fmaxf(area.x + area.width, p.x);
+      float bottom = fmaxf(area.y + area.height, p.y);
+      area.x = fminf(area.x, p.x);
+      area.y = fminf(area.y, p.y);
+      area.width = right - area.x;
+      area.height = bottom - area.y;
+    }
+  }
+  ParticleGrid *g = &ps->queryGrid;
+  if (!ParticleGrid_init(g, area)) {
+    return false;
+  }
+  for (k = 0; k < total; k++) {
+    long cell = ParticleGrid_cell(g, scratch[k].x, scratch[k].y);
+    if (cell >= 0) {
+      ParticleGrid_count(g, cell);
+    }
+  }
+  ParticleGrid_prefix(g);
+  k = 0;
+  for (size_t i = 0; i < ps->length; i++) {
+    Emitter *e = ps->emitters[i];
+    for (size_t j = 0; j < e->length; j++, k++) {
+      long cell = ParticleGrid_cell(g, scratch[k].x, scratch[k].y);
+      if (cell < 0) {
+        continue;
+      }
+      uint32_t slot = ParticleGrid_place(g, cell);
+      refs[slot] = (ParticleRef){.emitter = e, .index = j};
+      positions[slot] = scratch[k];
+    }
+  }
+  ps->queryStale = false;
+  return true;
+}
+
+// ParticleSystem_query writes the particles inside the circle around
+// center, or inside rect if radius is negative, to results. Only the grid
+// cells overlapping the area are searched.
+static size_t ParticleSystem_query(ParticleSystem *ps, Rectangle rect,
+                                   Vector2 center, float radius,
+                                   ParticleRef *results, size_t maxResults) {
+  ParticleSystem_finishAsync(ps);
+  if (!ParticleSystem_buildQueryGrid(ps)) {
+    return 0;
+  }
+  const ParticleGrid *g = &ps->queryGrid;
+  int c0 = ParticleGrid_column(g, rect.x);
+  int c1 = ParticleGrid_column(g, rect.x + rect.width);
+  int r0 = ParticleGrid_row(g, rect.y);
+  int r1 = ParticleGrid_row(g, rect.y + rect.height);
+  size_t found = 0;
+  for (int r = r0; r <= r1; r++) {
+    for (int c = c0; c <= c1; c++) {
+      long cell = (long)r * g->columns + c;
+      for (uint32_t k = g->cellStart[cell]; k < g->cellStart[cell + 1]; k++) {
+        Vector2 p = ps->queryPositions[k];
+        bool inside;
+        if (radius < 0) {
+          inside = p.x >= rect.x && p.x <= rect.x + rect.width &&
+                   p.y >= rect.y && p.y <= rect.y + rect.height;
+        } else {
+          float dx = p.x - center.x;
+          float dy = p.y - center.y;
+          inside = dx * dx + dy * dy <= radius * radius;
+        }
+        if (inside) {
+          if (found >= maxResults) {
+            return found;
+          }
+          results[found++] = ps->queryRefs[k];
+        }
+      }
+    }
+  }
+  return found;
+}
+
+// ParticleSystem_QueryRect writes up to maxResults live particles inside
+// rect to results and returns their amount. The results are valid until
+// the particles change. Changes made by the Emitter functions directly,
+// instead of the ParticleSystem ones, are seen after the next update.
+size_t ParticleSystem_QueryRect(ParticleSystem *ps, Rectangle rect,
+                                ParticleRef *results, size_t maxResults) {
+  return ParticleSystem_query(ps, rect, (Vector2){0}, -1, results,
+                              maxResults);
+}
+
+// ParticleSystem_QueryCircle writes up to maxResults live particles within
+// radius of center to results and returns their amount. See
+// ParticleSystem_QueryRect.
+size_t ParticleSystem_QueryCircle(ParticleSystem *ps, Vector2 center,
+                                  float radius, ParticleRef *results,
+                                  size_t maxResults) {
+  if (radius < 0) {
+    return 0;
+  }
+  Rectangle rect = {.x = center.x - radius,
+                    .y = center.y - radius,
+                    .width = 2 * radius,
+                    .height = 2 * radius};
+  return ParticleSystem_query(ps, rect, center, radius, results, maxResults);
+}
+
+// ParticleSystem_GetStats returns the stats of the system. The particle
+// counters are the sums over the registered Emitters, the timings and
+// peakLength cover ParticleSystem_Update and ParticleSystem_Draw.
+ParticleStats ParticleSystem_GetStats(const ParticleSystem *ps) {
+  ParticleStats stats = {0};
+#ifdef PARTIKEL_STATS
+  stats.peakLength = ps->stats.peakLength;
+  stats.updates = ps->stats.updates;
+  stats.updateNs = ps->stats.updateNs;
+  stats.draws = ps->stats.draws;
+  stats.drawNs = ps->stats.drawNs;
+#endif
+  for (size_t i = 0; i < ps->length; i++) {
+    ParticleStats e = Emitter_GetStats(ps->emitters[i]);
+    stats.length += e.length;
+    stats.capacity += e.capacity;
+    stats.backlog += e.backlog;
+    stats.spawned += e.spawned;
+    stats.deactivated += e.deactivated;
+    stats.dropped += e.dropped;
+    stats.saturated += e.saturated;
+  }
+  return stats;
+}
+
+// ParticleSystem_ResetStats sets all counters of the system and its
+// registered Emitters to 0.
+void ParticleSystem_ResetStats(ParticleSystem *ps) {
+  ParticleSystem_finishAsync(ps);
+  PARTIKEL_STAT(ps->stats = (ParticleStats){0};)
+  for (size_t i = 0; i < ps->length; i++) {
+    Emitter_ResetStats(ps->emitters[i]);
+  }
+}
+
+// ParticleSystem_StartTrace records the updates and draws of the system
+// from now on, up to maxEvents of them: ParticleSystem_Update and
+// ParticleSystem_Draw, each Emitter update within them and, with
+// threads, each job on its worker thread. A running trace is discarded.
+// Returns false if out of memory or compiled without PARTIKEL_STATS.
+bool ParticleSystem_StartTrace(ParticleSystem *ps, size_t maxEvents) {
+  ParticleSystem_StopTrace(ps);
+#ifdef PARTIKEL_STATS
+  ps->trace = PARTIKEL_ALLOC(maxEvents, sizeof(ParticleTraceEvent));
+  if (ps->trace == NULL) {
+    return false;
+  }
+  ps->traceCapacity = maxEvents;
+  ps->traceStart = PARTIKEL_CLOCK_NS();
+  return true;
+#else
+  (void)maxEvents;
+  return false;
+#endif
+}
+
+// ParticleSystem_ExportTrace writes the events recorded so far as Chrome
+// trace event JSON to fileName, to be opened in chrome://tracing or
+// Perfetto. Returns false if the file could not be written or there is
+// no trace.
+bool ParticleSystem_ExportTrace(const ParticleSystem *ps,
+                                const char *fileName) {
+#ifdef PARTIKEL_STATS
+  if (ps->trace == NULL) {
+    return false;
+  }
+  FILE *file = fopen(fileName, "w");
+  if (file == NULL) {
+    return false;
+  }
+  fputs("{\"displayTimeUnit\": \"ns\", \"traceEvents\": [", file);
+  for (size_t i = 0; i < ps->traceLength; i++) {
+    const ParticleTraceEvent *ev = &ps->trace[i];
+    // Timestamps are microseconds since the start of the trace.
+    double ts = (double)(ev->start - ps->traceStart) / 1000.0;
+    fprintf(file,
+            "%s\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, "
+            "\"tid\": %u, \"ts\": %.3f, \"dur\": %.3f, \"args\": "
+            "{\"emitter\": %ld, \"particles\": %zu}}",
+            i == 0 ? "" : ",", ev->name, ev->thread, ts,
+            (double)ev->duration / 1000.0, ev->emitter, ev->particles);
+    if (ev->emitter < 0) {
+      // Plot the live particles of the system as a counter track.
+      fprintf(file,
+              ",\n{\"name\": \"particles\", \"ph\": \"C\", "
+              "\"pid\": 1, \"ts\": %.3f, \"args\": {\"%s\": %zu}}",
+              ts, ev->name, ev->particles);
+    }
+  }
+  fputs("\n]}\n", file);
+  bool ok = !ferror(file);
+  return fclose(file) == 0 && ok;
+#else
+  (void)ps;
+  (void)fileName;
+  return false;
+#endif
+}
+
+// ParticleSystem_StopTrace discards the recorded events and stops
+// recording.
+void ParticleSystem_StopTrace(ParticleSystem *ps) {
+  ParticleSystem_finishAsync(ps);
+#ifdef PARTIKEL_STATS
+  PARTIKEL_FREE(ps->trace);
+  ps->trace = NULL;
+  ps->traceLength = 0;
+  ps->traceCapacity = 0;
+#endif
+}
+
+// SystemSnapshot is the header of the snapshot of a ParticleSystem.
+typedef struct SystemSnapshot {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t size;     // Size of the whole snapshot in bytes.
+  uint64_t emitters; // Amount of Emitter snapshots following.
+  float accumulator; // Time towards the next fixed step.
+  uint8_t active;
+  uint8_t reserved[3];
+} SystemSnapshot;
+
+// ParticleSystem_SnapshotSize returns the amount of bytes
+// ParticleSystem_Snapshot needs for the current state of the system.
+size_t ParticleSystem_SnapshotSize(ParticleSystem *ps) {
+  ParticleSystem_finishAsync(ps);
+  size_t size = partikel_alignUp(sizeof(SystemSnapshot));
+  for (size_t i = 0; i < ps->length; i++) {
+    size += Emitter_SnapshotSize(ps->emitters[i]);
+  }
+  return size;
+}
+
+// ParticleSystem_Snapshot writes the state of the system and all
+// registered Emitters to buffer (see Emitter_Snapshot). Returns the amount
+// of bytes written or 0 if size is less than ParticleSystem_SnapshotSize.
+size_t ParticleSystem_Snapshot(ParticleSystem *ps, void *buffer,
+                               size_t size) {
+  size_t total = ParticleSystem_SnapshotSize(ps);
+  if (size < total) {
+    return 0;
+  }
+  SystemSnapshot s = {.magic = PARTIKEL_SYSTEM_SNAPSHOT_MAGIC,
+                      .version = PARTIKEL_SNAPSHOT_VERSION,
+                      .size = total,
+                      .emitters = ps->length,
+                      .accumulator = ps->accumulator,
+                      .active = ps->active};
+  unsigned char *out = buffer;
+  size_t offset = partikel_alignUp(sizeof(SystemSnapshot));
+  memset(out, 0, offset);
+  memcpy(out, &s, sizeof(s));
+  for (size_t i = 0; i < ps->length; i++) {
+    offset += Emitter_Snapshot(ps->emitters[i], out + offset, total - offset);
+  }
+  return total;
+}
+
+// ParticleSystem_Restore replaces the state of the system and its
+// registered Emitters with the snapshot of size bytes written by
+// ParticleSystem_Snapshot. The same Emitters must be registered in the
+// same order, with the same configs, as when it was taken. A pool is
+// repacked if an Emitter lacks the slots for its particles. Returns false
+// if the snapshot does not match, which changes nothing, or if out of
+// memory.
+bool ParticleSystem_Restore(ParticleSystem *ps, const void *snapshot,
+                            size_t size) {
+  ParticleSystem_finishAsync(ps);
+  SystemSnapshot s;
+  size_t offset = partikel_alignUp(sizeof(SystemSnapshot));
+  if (size < offset) {
+    return false;
+  }
+  memcpy(&s, snapshot, sizeof(s));
+  // All reads below stay within the s.size <= size bytes checked here.
+  if (s.magic != PARTIKEL_SYSTEM_SNAPSHOT_MAGIC ||
+      s.version != PARTIKEL_SNAPSHOT_VERSION || s.size > size ||
+      s.size < offset || s.emitters != ps->length) {
+    return false;
+  }
+  // Check every Emitter snapshot before touching any Emitter.
+  const unsigned char *in = snapshot;
+  size_t needed = 0;
+  bool cramped = false;
+  for (size_t i = 0; i < ps->length; i++) {
+    EmitterSnapshot es;
+    if (s.size - offset < sizeof(es)) {
+      return false;
+    }
+    memcpy(&es, in + offset, sizeof(es));
+    if (!Emitter_checkSnapshot(ps->emitters[i], &es, s.size - offset)) {
+      return false;
+    }
+    needed += (size_t)es.length;
+    cramped = cramped || es.length > ps->emitters[i]->particles.capacity;
+    offset += (size_t)es.size;
+  }
+  if (ps->pool.block != NULL && cramped) {
+    if (needed > ps->pool.capacity ||
+        ((ParticleSystem_poolLayout(ps) & ~ps->pool.layout) != 0 &&
+         !ParticleSystem_setPool(ps, ps->pool.capacity))) {
+      return false;
+    }
+    // Make exactly enough room. The next update lends out the rest.
+    offset = partikel_alignUp(sizeof(SystemSnapshot));
+    for (size_t i = 0; i < ps->length; i++) {
+      EmitterSnapshot es;
+      memcpy(&es, in + offset, sizeof(es));
+      ps->emitters[i]->length = 0;
+      ps->emitters[i]->poolSize = (size_t)es.length;
+      offset += (size_t)es.size;
+    }
+    ParticleSystem_layoutPool(ps);
+    ps->poolCooldown = 0;
+  }
+
+  offset = partikel_alignUp(sizeof(SystemSnapshot));
+  for (size_t i = 0; i < ps->length; i++) {
+    EmitterSnapshot es;
+    memcpy(&es, in + offset, sizeof(es));
+    if (!Emitter_Restore(ps->emitters[i], in + offset, (size_t)es.size)) {
+      ParticleSystem_present(ps);
+      return false;
+    }
+    offset += (size_t)es.size;
+  }
+  ps->active = s.active;
+  ps->accumulator = ps->fixedStep > 0 ? s.accumulator : 0;
+  for (size_t i = 0; i < ps->length; i++) {
+    if (ps->fixedStep > 0) {
+      ps->emitters[i]->alpha = ps->accumulator / ps->fixedStep;
+      ps->emitters[i]->drawAhead = ps->accumulator;
+    }
+  }
+  ps->queryStale = true;
+  ParticleSystem_present(ps);
+  return true;
+}
+
 // ParticleSystem_Free only frees its own resources.
-// The emitters referenced here must be freed on their own.
+// The emitters referenced here must be freed on their own, after the
+// system or after deregistering them, as it releases the Emitters still
+// registered: they stop using its colliders and force fields, and pooled
+// Emitters get storage of their own. Afterwards they may be used alone.
 void ParticleSystem_Free(ParticleSystem *p) {
+#ifdef PARTIKEL_THREADS
+  // Stop the pipeline without handing over its frame to the Emitters.
+  ParticlePipeline_free(p->pipeline);
+  p->pipeline = NULL;
+#endif
+  // The Emitters outlive their colliders and force fields.
+  for (size_t i = 0; i < p->length; i++) {
+    p->emitters[i]->colliders = NULL;
+    p->emitters[i]->forces = NULL;
+  }
+  ParticleSystem_SetPool(p, 0);
+  ParticleSystem_SetThreads(p, 0);
+  ParticleSystem_StopTrace(p);
+  if (p->atlas.id != 0) {
+    UnloadTexture(p->atlas);
+  }
+  ParticleColliders_free(&p->colliders);
+  ParticleForces_free(&p->forces);
+  ParticleGrid_free(&p->queryGrid);
+  PARTIKEL_FREE(p->queryRefs);
+  PARTIKEL_FREE(p->queryPositions);
+  PARTIKEL_FREE(p->queryScratch);
   PARTIKEL_FREE(p->emitters);
   PARTIKEL_FREE(p);
 }
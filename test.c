@@ -0,0 +1,538 @@
+/*******************************************************************************************
+ *
+ *   libpartikel tests - Check the behavior of the library without a window.
+ *
+ *   Runs Emitters and ParticleSystems headless and compares their results
+ *   with known values or with each other. Prints every failed check and
+ *   exits with 1 if any failed.
+ *
+ *   Usage: tests
+ *
+ *   libpartikel is licensed under an unmodified zlib/libpng license (View partikel.h for details)
+ *
+ ********************************************************************************************/
+
+#define LIBPARTIKEL_IMPLEMENTATION
+#ifndef PARTIKEL_THREADS
+#define PARTIKEL_THREADS
+#endif
+
+#include "partikel.h"
+#include "raylib.h"
+#include "stdio.h"
+
+#define TEST_DT (1.0f / 60.0f)
+
+static int checks   = 0;
+static int failures = 0;
+
+// CHECK counts a check and reports it if cond is false.
+#define CHECK(cond)                                                                                \
+	do {                                                                                           \
+		checks++;                                                                                  \
+		if (!(cond)) {                                                                             \
+			failures++;                                                                            \
+			fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, #cond); \
+		}                                                                                          \
+	} while (0)
+
+// CHECK_NEAR checks that a and b differ by at most eps.
+#define CHECK_NEAR(a, b, eps) CHECK(fabsf((float)(a) - (float)(b)) <= (eps))
+
+static Texture2D texSquare = {.width = 4, .height = 4};
+
+// Spray is an emitter config using most of the per-particle randomness.
+static EmitterConfig Spray(uint64_t seed) {
+	EmitterConfig ecfg = {
+		.capacity             = 5000,
+		.emissionRate         = 2000,
+		.offset               = (FloatRange){.min = 0, .max = 10},
+		.direction            = (Vector2){.x = 0, .y = -1},
+		.directionAngle       = (FloatRange){.min = -30, .max = 30},
+		.velocityAngle        = (FloatRange){.min = -5, .max = 5},
+		.velocity             = (FloatRange){.min = 100, .max = 300},
+		.externalAcceleration = (Vector2){.x = 0, .y = 200},
+		.startColor           = (Color){.r = 255, .g = 255, .b = 255, .a = 255},
+		.endColor             = (Color){.r = 255, .g = 0, .b = 0, .a = 0},
+		.age                  = (FloatRange){.min = 0.5, .max = 2.0},
+		.texture              = texSquare,
+		.seed                 = seed,
+	};
+	return ecfg;
+}
+
+// SameEmitters returns whether the snapshots of both Emitters are equal,
+// that is their particles and all state they evolve with.
+static bool SameEmitters(const Emitter * a, const Emitter * b) {
+	size_t size = Emitter_SnapshotSize(a);
+	if (size != Emitter_SnapshotSize(b)) {
+		return false;
+	}
+	unsigned char * x    = PARTIKEL_ALLOC(size, 1);
+	unsigned char * y    = PARTIKEL_ALLOC(size, 1);
+	bool            same = x != NULL && y != NULL && Emitter_Snapshot(a, x, size) == size &&
+	            Emitter_Snapshot(b, y, size) == size && memcmp(x, y, size) == 0;
+	PARTIKEL_FREE(x);
+	PARTIKEL_FREE(y);
+	return same;
+}
+
+// TestSeed checks that Emitters with the same seed emit the same particles
+// and Emitters with different seeds do not.
+static void TestSeed(void) {
+	Emitter * a = Emitter_New(Spray(42));
+	Emitter * b = Emitter_New(Spray(42));
+	Emitter * c = Emitter_New(Spray(43));
+	Emitter_Start(a);
+	Emitter_Start(b);
+	Emitter_Start(c);
+	for (int f = 0; f < 120; f++) {
+		Emitter_Update(a, TEST_DT);
+		Emitter_Update(b, TEST_DT);
+		Emitter_Update(c, TEST_DT);
+	}
+	CHECK(a->length > 0);
+	CHECK(SameEmitters(a, b));
+	CHECK(c->length > 0);
+	CHECK(!SameEmitters(a, c));
+	Emitter_Free(a);
+	Emitter_Free(b);
+	Emitter_Free(c);
+}
+
+// TestThreads checks that a parallel update gives the same result as a
+// serial one.
+static void TestThreads(void) {
+	ParticleSystem * ps[2];
+	Emitter *        emitters[2][3];
+	for (int k = 0; k < 2; k++) {
+		ps[k] = ParticleSystem_New();
+		for (int i = 0; i < 3; i++) {
+			EmitterConfig ecfg = Spray((uint64_t)i + 1);
+			ecfg.capacity      = 40000;
+			ecfg.emissionRate  = 30000;
+			emitters[k][i]     = Emitter_New(ecfg);
+			ParticleSystem_Register(ps[k], emitters[k][i]);
+		}
+		ParticleSystem_Start(ps[k]);
+	}
+	CHECK(ParticleSystem_SetThreads(ps[1], 4));
+	for (int f = 0; f < 90; f++) {
+		CHECK(ParticleSystem_Update(ps[0], TEST_DT) == ParticleSystem_Update(ps[1], TEST_DT));
+	}
+	for (int i = 0; i < 3; i++) {
+		CHECK(emitters[0][i]->length > 0);
+		CHECK(SameEmitters(emitters[0][i], emitters[1][i]));
+	}
+	for (int k = 0; k < 2; k++) {
+		ParticleSystem_Free(ps[k]);
+		for (int i = 0; i < 3; i++) {
+			Emitter_Free(emitters[k][i]);
+		}
+	}
+}
+
+// TestVertices checks the quad of a particle resting at the origin. The
+// texture has odd sizes, so the quad must not be rounded to whole pixels.
+static void TestVertices(void) {
+	Color         red  = {.r = 255, .g = 0, .b = 0, .a = 255};
+	EmitterConfig ecfg = {
+		.capacity   = 4,
+		.origin     = (Vector2){.x = 10, .y = 20},
+		.direction  = (Vector2){.x = 0, .y = -1},
+		.startColor = red,
+		.endColor   = red,
+		.age        = (FloatRange){.min = 1, .max = 1},
+		.burst      = (IntRange){.min = 1, .max = 1},
+		.texture    = (Texture2D){.width = 5, .height = 3},
+		.seed       = 1,
+	};
+	Emitter * e = Emitter_New(ecfg);
+	Emitter_Burst(e);
+
+	ParticleVertex v[4];
+	CHECK(Emitter_BuildVertices(e, v, 1) == 1);
+	// Top-left, bottom-left, bottom-right, top-right.
+	float x[4] = {7.5f, 7.5f, 12.5f, 12.5f};
+	float y[4] = {18.5f, 21.5f, 21.5f, 18.5f};
+	float u[4] = {0, 0, 1, 1};
+	float t[4] = {0, 1, 1, 0};
+	for (int k = 0; k < 4; k++) {
+		CHECK_NEAR(v[k].x, x[k], 1e-4f);
+		CHECK_NEAR(v[k].y, y[k], 1e-4f);
+		CHECK(v[k].u == u[k]);
+		CHECK(v[k].v == t[k]);
+		CHECK(v[k].color.r == 255 && v[k].color.g == 0 && v[k].color.a == 255);
+	}
+	CHECK(Emitter_BuildVertices(e, v, 0) == 0);
+	Emitter_Free(e);
+}
+
+// TestSnapshot checks that a restored Emitter equals the original and
+// evolves like it.
+static void TestSnapshot(void) {
+	Emitter * a = Emitter_New(Spray(7));
+	Emitter * b = Emitter_New(Spray(7));
+	Emitter_Start(a);
+	for (int f = 0; f < 60; f++) {
+		Emitter_Update(a, TEST_DT);
+	}
+	size_t          size   = Emitter_SnapshotSize(a);
+	unsigned char * buffer = PARTIKEL_ALLOC(size, 1);
+	CHECK(Emitter_Snapshot(a, buffer, size) == size);
+	CHECK(Emitter_Snapshot(a, buffer, size - 1) == 0);
+	CHECK(Emitter_Restore(b, buffer, size));
+	CHECK(SameEmitters(a, b));
+	for (int f = 0; f < 60; f++) {
+		Emitter_Update(a, TEST_DT);
+		Emitter_Update(b, TEST_DT);
+	}
+	CHECK(SameEmitters(a, b));
+	PARTIKEL_FREE(buffer);
+	Emitter_Free(a);
+	Emitter_Free(b);
+}
+
+// TestCorruptSnapshot checks that truncated and corrupt snapshots are
+// rejected without reading past their end.
+static void TestCorruptSnapshot(void) {
+	ParticleSystem * ps = ParticleSystem_New();
+	Emitter *        e[2];
+	for (int k = 0; k < 2; k++) {
+		e[k] = Emitter_New(Spray((uint64_t)k + 1));
+		ParticleSystem_Register(ps, e[k]);
+	}
+	ParticleSystem_Start(ps);
+	for (int f = 0; f < 30; f++) {
+		ParticleSystem_Update(ps, TEST_DT);
+	}
+	size_t          size   = ParticleSystem_SnapshotSize(ps);
+	unsigned char * buffer = PARTIKEL_ALLOC(size, 1);
+	CHECK(ParticleSystem_Snapshot(ps, buffer, size) == size);
+
+	// Copies of exactly the given length let the sanitizers catch overreads.
+	for (size_t length = 0; length < size; length += 1 + length / 4) {
+		unsigned char * copy = PARTIKEL_ALLOC(length + 1, 1);
+		memcpy(copy, buffer, length);
+		CHECK(!ParticleSystem_Restore(ps, copy, length));
+		CHECK(!Emitter_Restore(e[0], copy, length));
+		PARTIKEL_FREE(copy);
+	}
+
+	// A header claiming less than itself.
+	SystemSnapshot header;
+	memcpy(&header, buffer, sizeof(header));
+	for (uint64_t claimed = 0; claimed < sizeof(header); claimed += 4) {
+		SystemSnapshot bad = header;
+		bad.size           = claimed;
+		memcpy(buffer, &bad, sizeof(bad));
+		CHECK(!ParticleSystem_Restore(ps, buffer, size));
+	}
+	memcpy(buffer, &header, sizeof(header));
+
+	// Flipped bits in the headers must not make restore read out of bounds.
+	size_t headers = partikel_alignUp(sizeof(SystemSnapshot)) + sizeof(EmitterSnapshot);
+	for (size_t i = 0; i < headers && i < size; i++) {
+		for (int bit = 0; bit < 8; bit++) {
+			buffer[i] ^= (unsigned char)(1 << bit);
+			ParticleSystem_Restore(ps, buffer, size);
+			buffer[i] ^= (unsigned char)(1 << bit);
+		}
+	}
+	CHECK(ParticleSystem_Restore(ps, buffer, size));
+
+	PARTIKEL_FREE(buffer);
+	ParticleSystem_Free(ps);
+	Emitter_Free(e[0]);
+	Emitter_Free(e[1]);
+}
+
+// TestBounce checks that a particle falling onto a segment bounces off.
+static void TestBounce(void) {
+	EmitterConfig ecfg = {
+		.capacity   = 4,
+		.origin     = (Vector2){.x = 0, .y = -20},
+		.direction  = (Vector2){.x = 0, .y = 1},
+		.velocity   = (FloatRange){.min = 120, .max = 120},
+		.age        = (FloatRange){.min = 5, .max = 5},
+		.burst      = (IntRange){.min = 1, .max = 1},
+		.texture    = texSquare,
+		.seed       = 1,
+		.collide    = true,
+	};
+	ParticleSystem * ps = ParticleSystem_New();
+	Emitter *        e  = Emitter_New(ecfg);
+	ParticleSystem_Register(ps, e);
+	CHECK(ParticleSystem_AddCollider(ps, (Collider){.type        = COLLIDER_SEGMENT,
+	                                                .start       = {.x = -50, .y = 0},
+	                                                .end         = {.x = 50, .y = 0},
+	                                                .restitution = 1}));
+	Emitter_Burst(e);
+	for (int f = 0; f < 30; f++) {
+		ParticleSystem_Update(ps, TEST_DT);
+	}
+	CHECK(e->length == 1);
+	// 0.5 s at 120 px/s: 20 px down, bounced back up 40 px.
+	CHECK(e->particles.posY[0] < 0);
+	CHECK(e->particles.velY[0] < 0);
+	CHECK_NEAR(e->particles.posY[0], -40, 3);
+	ParticleSystem_Free(ps);
+	Emitter_Free(e);
+}
+
+// TestTunnel checks that streams fired across a segment from both sides
+// stay on their side, however far they move per step.
+static void TestTunnel(void) {
+	ParticleSystem * ps = ParticleSystem_New();
+	Emitter *        e[2];
+	for (int k = 0; k < 2; k++) {
+		EmitterConfig ecfg = {
+			.capacity       = 1000,
+			.emissionRate   = 200,
+			.origin         = (Vector2){.x = 0, .y = k ? -50 : 50},
+			.direction      = (Vector2){.x = 0, .y = k ? 1 : -1},
+			.directionAngle = (FloatRange){.min = -20, .max = 20},
+			.velocity       = (FloatRange){.min = 300, .max = 3000},
+			.age            = (FloatRange){.min = 1, .max = 1},
+			.texture        = texSquare,
+			.seed           = (uint64_t)k + 1,
+			.collide        = true,
+		};
+		e[k] = Emitter_New(ecfg);
+		ParticleSystem_Register(ps, e[k]);
+	}
+	CHECK(ParticleSystem_AddCollider(ps, (Collider){.type        = COLLIDER_SEGMENT,
+	                                                .start       = {.x = -100, .y = 0},
+	                                                .end         = {.x = 100, .y = 0},
+	                                                .restitution = 1}));
+	ParticleSystem_Start(ps);
+	for (int f = 0; f < 60; f++) {
+		ParticleSystem_Update(ps, TEST_DT);
+	}
+	for (int k = 0; k < 2; k++) {
+		size_t beyond = 0;
+		for (size_t i = 0; i < e[k]->length; i++) {
+			float y = e[k]->particles.posY[i];
+			beyond += k ? y > 0 : y < 0;
+		}
+		CHECK(e[k]->length > 0);
+		CHECK(beyond == 0);
+	}
+
+	// A particle at a non-finite position is left out of queries.
+	e[0]->particles.posX[0] = NAN;
+	e[1]->particles.posY[0] = INFINITY;
+	ParticleSystem_Update(ps, 0);
+	Rectangle   area = {.x = -1e4f, .y = -1e4f, .width = 2e4f, .height = 2e4f};
+	ParticleRef refs[2000];
+	CHECK(ParticleSystem_QueryRect(ps, area, refs, 2000) == e[0]->length + e[1]->length - 2);
+	ParticleSystem_Free(ps);
+	Emitter_Free(e[0]);
+	Emitter_Free(e[1]);
+}
+
+// KeyX sorts particles by their x position.
+static void KeyX(const ParticleSpan * span, float * keys, void * sortData) {
+	(void)sortData;
+	for (size_t i = 0; i < span->length; i++) {
+		keys[i] = span->posX[i];
+	}
+}
+
+// TestSortKey checks that keys are sorted exactly, even next to an outlier
+// and a NaN, and that the sorted order is kept for the next frame.
+static void TestSortKey(void) {
+	EmitterConfig ecfg = Spray(7);
+	ecfg.sortMode      = PARTICLE_SORT_KEY;
+	ecfg.sortKeys      = KeyX;
+	Emitter * e        = Emitter_New(ecfg);
+	Emitter_Start(e);
+	for (int f = 0; f < 30; f++) {
+		Emitter_Update(e, TEST_DT);
+	}
+	size_t n = e->length;
+	CHECK(n > 100);
+	float * x = e->particles.posX;
+	for (size_t i = 0; i < n; i++) {
+		// Keys within 1e-3 of each other, far below a 16 bit step of the range.
+		x[i] = (float)((i * 7919) % n) * 1e-3f;
+	}
+	x[n / 2] = 1e6f;
+	x[n / 3] = NAN;
+	x[n / 4] = -0.0f;
+
+	CHECK(Emitter_sort(e) == NULL);
+	size_t descents = 0;
+	for (size_t i = 1; i + 1 < n; i++) {
+		descents += x[i] < x[i - 1];
+	}
+	CHECK(descents == 0);
+	CHECK(x[n - 2] == 1e6f);
+	CHECK(isnan(x[n - 1]));
+
+	// Small moves only need a few insertions.
+	x[0] += 2e-3f;
+	x[n - 3] -= 2e-3f;
+	CHECK(Emitter_sort(e) == NULL);
+	descents = 0;
+	for (size_t i = 1; i + 1 < n; i++) {
+		descents += x[i] < x[i - 1];
+	}
+	CHECK(descents == 0);
+	Emitter_Free(e);
+}
+
+// TestPipelined checks that snapshots, restores and pool or rate changes
+// wait for a running pipelined update instead of racing with it.
+static void TestPipelined(void) {
+	ParticleSystem * ps[2];
+	Emitter *        e[2];
+	for (int k = 0; k < 2; k++) {
+		ps[k] = ParticleSystem_New();
+		e[k]  = Emitter_New(Spray(3));
+		ParticleSystem_Register(ps[k], e[k]);
+		ParticleSystem_Start(ps[k]);
+	}
+	CHECK(ParticleSystem_SetPipelined(ps[1], true));
+	for (int f = 0; f < 30; f++) {
+		ParticleSystem_Update(ps[0], TEST_DT);
+		ParticleSystem_UpdateAsync(ps[1], TEST_DT);
+	}
+	size_t          size = ParticleSystem_SnapshotSize(ps[1]);
+	unsigned char * x    = PARTIKEL_ALLOC(size, 1);
+	unsigned char * y    = PARTIKEL_ALLOC(size, 1);
+	CHECK(size == ParticleSystem_SnapshotSize(ps[0]));
+	CHECK(ParticleSystem_Snapshot(ps[0], x, size) == size);
+	ParticleSystem_UpdateAsync(ps[1], 0);
+	CHECK(ParticleSystem_Snapshot(ps[1], y, size) == size);
+	CHECK(memcmp(x, y, size) == 0);
+
+	ParticleSystem_UpdateAsync(ps[1], TEST_DT);
+	CHECK(ParticleSystem_SetPool(ps[1], 10000));
+	ParticleSystem_UpdateAsync(ps[1], TEST_DT);
+	ParticleSystem_SetFixedRate(ps[1], 120);
+	ParticleSystem_UpdateAsync(ps[1], TEST_DT);
+	CHECK(ParticleSystem_Restore(ps[1], x, size));
+	CHECK(e[1]->length == e[0]->length);
+	CHECK(memcmp(e[1]->particles.posX, e[0]->particles.posX, e[0]->length * sizeof(float)) == 0);
+
+	// Every other change waits for the update, too.
+	Emitter * extra = Emitter_New(Spray(4));
+	ParticleSystem_UpdateAsync(ps[1], TEST_DT);
+	CHECK(ParticleSystem_Register(ps[1], extra));
+	ParticleSystem_UpdateAsync(ps[1], TEST_DT);
+	CHECK(ParticleSystem_Deregister(ps[1], extra));
+	ParticleSystem_UpdateAsync(ps[1], TEST_DT);
+	ParticleSystem_SetOrigin(ps[1], (Vector2){.x = 10, .y = 10});
+	ParticleSystem_UpdateAsync(ps[1], TEST_DT);
+	ParticleSystem_Burst(ps[1]);
+	ParticleSystem_UpdateAsync(ps[1], TEST_DT);
+	ParticleSystem_SetView(ps[1], (Rectangle){.x = -500, .y = -500, .width = 1000, .height = 1000});
+	ParticleSystem_UpdateAsync(ps[1], TEST_DT);
+	CHECK(ParticleSystem_AddCollider(ps[1], (Collider){.type = COLLIDER_SEGMENT, .end = {.x = 100}}));
+	ParticleSystem_UpdateAsync(ps[1], TEST_DT);
+	CHECK(ParticleSystem_AddForceField(ps[1], (ForceField){.type = FORCE_POINT, .strength = 1}));
+	ParticleSystem_UpdateAsync(ps[1], TEST_DT);
+	CHECK(ParticleSystem_SetForceField(ps[1], 0, (ForceField){.type = FORCE_POINT, .strength = 2}));
+	ParticleSystem_UpdateAsync(ps[1], TEST_DT);
+	Rectangle   area = {.x = -1e4f, .y = -1e4f, .width = 2e4f, .height = 2e4f};
+	ParticleRef refs[1];
+	CHECK(ParticleSystem_QueryRect(ps[1], area, refs, 1) == 1);
+	ParticleSystem_Sync(ps[1]);
+	Emitter_Free(extra);
+
+	PARTIKEL_FREE(x);
+	PARTIKEL_FREE(y);
+	for (int k = 0; k < 2; k++) {
+		ParticleSystem_Free(ps[k]);
+		Emitter_Free(e[k]);
+	}
+}
+
+// TestSaturated checks that an analytic Emitter at its capacity spawns
+// new particles at the start of their life instead of in the past, and
+// that a backlog left for a rate of 0 gets finite spawn times.
+static void TestSaturated(void) {
+	EmitterConfig ecfg = {
+		.capacity     = 100,
+		.emissionRate = 1000,
+		.velocity     = (FloatRange){.min = 10, .max = 10},
+		.age          = (FloatRange){.min = 1, .max = 1},
+		.texture      = texSquare,
+		.seed         = 5,
+		.analytic     = true,
+	};
+	Emitter * e = Emitter_New(ecfg);
+	CHECK(e->analytic);
+	Emitter_Start(e);
+	// The first particles die after 1 s and are replaced right away.
+	size_t young = 0;
+	for (int f = 0; f < 70; f++) {
+		Emitter_Update(e, TEST_DT);
+		for (size_t i = 0; f >= 60 && i < e->length; i++) {
+			young += e->clock - e->particles.born[i] <= TEST_DT * 1.001f;
+		}
+	}
+	CHECK(e->length == 100);
+	CHECK(young > 0);
+
+	ecfg.emissionRate = 0;
+	CHECK(Emitter_Reinit(e, ecfg));
+	size_t finite = 0;
+	size_t spawned = 0;
+	for (int f = 0; f < 90; f++) {
+		Emitter_Update(e, TEST_DT);
+		for (size_t i = 0; i < e->length; i++) {
+			finite += isfinite(e->particles.born[i]);
+		}
+		spawned += e->length;
+	}
+	CHECK(finite == spawned);
+	// The backlog replaces the particles that died meanwhile.
+	CHECK(e->length > 0);
+	Emitter_Free(e);
+}
+
+// TestOutlive checks that an Emitter can be updated after its system was
+// freed, without using its freed colliders and force fields.
+static void TestOutlive(void) {
+	ParticleSystem * ps   = ParticleSystem_New();
+	EmitterConfig    ecfg = Spray(9);
+	ecfg.collide          = true;
+	ecfg.forceLayers      = 1;
+	Emitter * e           = Emitter_New(ecfg);
+	ParticleSystem_Register(ps, e);
+	CHECK(ParticleSystem_AddCollider(ps, (Collider){.type        = COLLIDER_SEGMENT,
+	                                                .start       = {.x = -100, .y = 0},
+	                                                .end         = {.x = 100, .y = 0},
+	                                                .restitution = 1}));
+	CHECK(ParticleSystem_AddForceField(
+		ps, (ForceField){.type = FORCE_POINT, .layers = 1, .strength = 100, .radius = 500}));
+	ParticleSystem_Start(ps);
+	for (int f = 0; f < 10; f++) {
+		ParticleSystem_Update(ps, TEST_DT);
+	}
+	ParticleSystem_Free(ps);
+	for (int f = 0; f < 10; f++) {
+		Emitter_Update(e, TEST_DT);
+	}
+	CHECK(e->length > 0);
+	Emitter_Free(e);
+}
+
+int main(void) {
+	TestSeed();
+	TestThreads();
+	TestVertices();
+	TestSnapshot();
+	TestCorruptSnapshot();
+	TestBounce();
+	TestTunnel();
+	TestSortKey();
+	TestPipelined();
+	TestSaturated();
+	TestOutlive();
+
+	printf("%d checks, %d failed\n", checks, failures);
+	return failures == 0 ? 0 : 1;
+}